@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# ingest_bench.py - time how long ircII takes to take in a burst of server
+# traffic, over a plain or a TLS connection.
+#
+# it pretends to be a server: once the client has registered, it sends the
+# lines of a capture file (server lines, one per line, as for irc --replay)
+# in one go, followed by a PING, and times how long it takes for the PONG
+# to come back.  this is done for a number of rounds and the times are
+# printed in milliseconds.  the same capture can then be sent over TLS to
+# compare the two.
+#
+# with -i, the client is started (with -q, so no .ircrc is read) and made
+# to /quit afterwards; otherwise start it yourself against the port given.
+#
+#	openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost \
+#	    -keyout key.pem -out cert.pem
+#	python3 contrib/ingest_bench.py -i ./irc capture.log
+#	python3 contrib/ingest_bench.py -i ./irc -t -c cert.pem -k key.pem \
+#	    capture.log
+#
+# the capture is whatever a real server sent, saved as it came.  PING lines
+# and the 001 in it are skipped; the client is sent its own welcome.
+
+import getopt
+import socket
+import ssl
+import subprocess
+import sys
+import time
+
+def usage():
+	sys.stderr.write("usage: ingest_bench.py [-p port] [-r rounds] "
+	    "[-t -c cert -k key] [-i irc] capture\n")
+	sys.exit(1)
+
+def main():
+	port = 16667
+	rounds = 5
+	tls = False
+	cert = key = irc = None
+	try:
+		opts, args = getopt.getopt(sys.argv[1:], "p:r:tc:k:i:")
+	except getopt.GetoptError:
+		usage()
+	for o, a in opts:
+		if o == "-p":
+			port = int(a)
+		elif o == "-r":
+			rounds = int(a)
+		elif o == "-t":
+			tls = True
+		elif o == "-c":
+			cert = a
+		elif o == "-k":
+			key = a
+		elif o == "-i":
+			irc = a
+	if len(args) != 1 or (tls and not (cert and key)):
+		usage()
+
+	burst = []
+	with open(args[0], "rb") as f:
+		for l in f:
+			l = l.rstrip(b"\r\n")
+			w = l.split(None, 2)
+			if not l or w[0] == b"PING" or \
+			    (len(w) > 1 and l[0:1] == b":" and w[1] == b"001"):
+				continue
+			burst.append(l + b"\r\n")
+	burst = b"".join(burst)
+
+	s = socket.socket()
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	s.bind(("127.0.0.1", port))
+	s.listen(1)
+
+	client = None
+	if irc:
+		host = "127.0.0.1:%d" % port
+		if tls:
+			host = "SSLIRCNOCHECK/" + host
+		client = subprocess.Popen([irc, "-q", "-d", "bench", host],
+		    stdin=subprocess.PIPE, stdout=subprocess.DEVNULL,
+		    stderr=subprocess.DEVNULL)
+
+	c, _ = s.accept()
+	if tls:
+		ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+		ctx.load_cert_chain(cert, key)
+		c = ctx.wrap_socket(c, server_side=True)
+	f = c.makefile("rb")
+
+	nick = b"bench"
+	for l in f:
+		w = l.split()
+		if len(w) > 1 and w[0].upper() == b"NICK":
+			nick = w[1]
+		if w and w[0].upper() == b"USER":
+			break
+	c.sendall(b":bench 001 " + nick + b" :Welcome\r\n" +
+	    b":bench 376 " + nick + b" :End of MOTD\r\n")
+	time.sleep(0.5)
+
+	times = []
+	for r in range(rounds):
+		token = b"round%d" % r
+		start = time.time()
+		c.sendall(burst + b"PING :" + token + b"\r\n")
+		for l in f:
+			if l.startswith(b"PONG") and token in l:
+				break
+		else:
+			sys.stderr.write("connection closed\n")
+			sys.exit(1)
+		times.append((time.time() - start) * 1000)
+		time.sleep(0.2)
+
+	times.sort()
+	print("%s %d bytes: %s ms (median %.1f)" % ("tls" if tls else "plain",
+	    len(burst), " ".join("%.1f" % t for t in times),
+	    times[len(times) // 2]))
+
+	if client:
+		try:
+			client.stdin.write(b"/quit\n")
+			client.stdin.flush()
+		except (BrokenPipeError, OSError):
+			pass
+		client.wait(10)
+	c.close()
+
+if __name__ == "__main__":
+	main()
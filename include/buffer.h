@@ -40,7 +40,7 @@
 #if defined(HAVE_VASPRINTF)
 
 /* put_it() and friends need to be reentrant */
-#define PUTBUF_INIT	u_char *putbuf;
+#define PUTBUF_INIT	u_char *putbuf = NULL;
 
 # define PUTBUF_SPRINTF(f, v) 				\
 if (vasprintf((char **)(void *)&putbuf, f, v) == -1)	\
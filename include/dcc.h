@@ -71,8 +71,7 @@
 	void	dcc_chat_transmit(u_char *, u_char *);
 	void	dcc_message_transmit(u_char *, u_char *, int, int);
 	void	close_all_dcc(void);
-	void	set_dcc_bits(fd_set *, fd_set *);
-	void	dcc_check(fd_set *, fd_set *);
+	void	dcc_check(void);
 	u_char	*dcc_list_func(u_char *);
 	u_char	*dcc_chatpeers_func(void);
 	void	set_dcchost(u_char *);
@@ -42,8 +42,7 @@
 	int	get_child_exit(int);
 	int	check_wait_status(int);
 	void	check_process_limits(void);
-	void	do_processes(fd_set *);
-	void	set_process_bits(fd_set *);
+	void	do_processes(void);
 	int	text_to_process(int, u_char *, int);
 	void	clean_up_processes(void);
 	int	is_process(u_char *);
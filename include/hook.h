@@ -43,10 +43,7 @@ typedef struct	hook_stru Hook;
 /* HookFunc: A little structure to keep track of the various hook functions */
 typedef struct hook_func_stru HookFunc;
 
-/*
- * NumericList: a special list type to dynamically handle numeric hook
- * requests 
- */
+/* NumericList: the hooks for one numeric, kept in hook.c by its number */
 typedef struct numeric_list_stru NumericList;
 
 	int	do_hook(int, char *, ...)
@@ -117,6 +114,7 @@ enum {
 	SEND_MSG_LIST,
 	SEND_NOTICE_LIST,
 	SEND_PUBLIC_LIST,
+	SEND_QUEUE_LIST,
 	SEND_TALK_LIST,
 	SERVER_NOTICE_LIST,
 	SIGNOFF_LIST,
@@ -264,6 +264,11 @@ typedef	struct window_stru Window;
 	u_char	*empty_string(void);
 
 	/* reg.h */
+typedef	struct wild_stru Wild;
 	int	wild_match(u_char *, u_char *);
+	Wild	*wild_compile(u_char *);
+	int	wild_exec(Wild *, u_char *);
+	unsigned wild_hash(u_char *, size_t);
+	void	wild_free(Wild **);
 
 #endif /* irc__irc_h */
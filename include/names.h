@@ -64,6 +64,7 @@
 #define CHAN_UNLINK	2
 
 typedef	struct channel_stru ChannelList;
+typedef	struct chan_hash_stru ChanHash;
 
 typedef enum {
 	CHAN_LIMBO = 	-1,
@@ -78,6 +79,8 @@ typedef enum {
 } ChanListStatus;
 
 typedef struct nick_stru NickList;
+typedef struct nick_index_stru NickIndex;
+typedef struct userhost_cache_stru UserhostCache;
 
 	int	is_channel_mode(u_char *, int, int);
 	int	is_chanop(u_char *, u_char *);
@@ -86,7 +89,10 @@ typedef struct nick_stru NickList;
 	u_char	*get_channel_mode(u_char *, int);
 	void	add_channel(u_char *, u_char *, int, int, ChannelList *);
 	void	rename_channel(u_char *, u_char *, int);
-	void	add_to_channel(u_char *, u_char *, int, int, int);
+	void	add_to_channel(u_char *, u_char *, int, int, int, u_char *);
+	void	stage_channel_names(u_char *, u_char *, int);
+	void	end_channel_names(u_char *, int);
+	u_char	*channel_nick(u_char *, int, u_char *);
 	void	remove_channel(u_char *, int);
 	void	remove_from_channel(u_char *, u_char *, int);
 	int	is_on_channel(u_char *, int, u_char *);
@@ -94,7 +100,7 @@ typedef struct nick_stru NickList;
 	void	reconnect_all_channels(int);
 	void	switch_channels(u_int, u_char *);
 	u_char	*what_channel(u_char *, int);
-	u_char	*walk_channels(u_char *, int, int);
+	u_char	*nick_channels(u_char *, int);
 	void	rename_nick(u_char *, u_char *, int);
 	void	update_channel_mode(u_char *, int, u_char *);
 	void	set_channel_window(Window *, u_char *, int);
@@ -121,5 +127,13 @@ typedef struct nick_stru NickList;
 	void	realloc_channels(Window *);
 	void	channel_swap_win_ptr(Window *, Window *);
 	int	nicks_has_who_from(NickList **);
+	u_char	*nick_userhost(u_char *, int);
+	void	userhost_cache_add(int, u_char *, u_char *);
+	u_char	*userhost_cache_find(int, u_char *);
+	void	userhost_cache_rename(int, u_char *, u_char *);
+	void	userhost_cache_remove(int, u_char *);
+	void	userhost_cache_clear(int);
+	void	nick_set_away(u_char *, int, int);
+	int	nick_is_away(u_char *, int);
 
 #endif /* irc__names_h_ */
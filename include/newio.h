@@ -37,10 +37,40 @@
 
 #include "ssl.h"
 
+/* events for new_io_register() and new_io_ready() */
+#define NEWIO_READ	0x1
+#define NEWIO_WRITE	0x2
+
+/* what new_io_stats() says about a descriptor's buffer */
+typedef	struct	io_stats
+{
+	size_t	size;			/* 0 while freed for being idle */
+	size_t	used;			/* bytes not yet read by dgets() */
+	unsigned long	reads,		/* read()s done, and bytes they got */
+			bytes;
+	unsigned long	grows,		/* times the buffer has grown */
+			shrinks;	/* times it was shrunk or freed */
+	time_t	idle;			/* seconds since the last read */
+} IOStats;
+
 	time_t	dgets_timeout(int);
 	int	dgets_set_separator(int);
 	int	dgets(u_char *, size_t, int);
+	int	dgets_view(int, u_char **, size_t *);
+	void	dgets_view_release(void);
+	void	dgets_view_discard(int);
+	int	dgets_buffered(int);
 	int	new_select(fd_set *, fd_set *, struct timeval *);
+	int	new_io_poll(int, struct timeval *);
+	int	new_io_poll_write(int, struct timeval *);
+	void	new_io_register(int, int);
+	int	new_io_wait(struct timeval *);
+	int	new_io_ready(int);
+	const char *new_io_backend(void);
+	void	new_io_set_buffer_max(int);
+	void	new_io_set_buffer_idle(int);
+	int	new_io_stats(int, IOStats *);
+	int	new_io_stats_next(int);
 	void	new_close(int);
 	void	set_socket_options(int);
 	int	dgets_errno(void);
@@ -45,6 +45,7 @@
 	void	notify(u_char *, u_char *, u_char *);
 	void	do_notify(void);
 	void	notify_mark(u_char *, int, int);
+	void	notify_mark_channel(u_char *, int);
 	void	save_notify(FILE *);
 	void	set_notify_handler(u_char *);
 	u_char	*get_last_notify_nick(void);
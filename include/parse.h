@@ -36,6 +36,7 @@
 # define irc__parse_h_
 
 	u_char	*PasteArgs(u_char **, int);
+	u_char	*parse_scratch(size_t);
 	void	irc2_parse_server(u_char *);
 	int	is_channel(u_char *);
 	void	beep_em(int);
@@ -44,5 +45,8 @@
 	void	set_from_user_host(u_char *);
 	u_char	*get_public_nick(void);
 	u_char	*get_joined_nick(void);
+	void	servercommandcmd(u_char *, u_char *, u_char *);
+	void	parse_batch_clear(int);
+	u_char	*parse_cap_string(int);
 
 #endif /* irc__parse_h_ */
@@ -68,6 +68,39 @@ typedef enum server_ssl_level {
 
 typedef void (*server_private_cb_type)(void **);
 
+/*
+ * classes of outgoing lines, most urgent first.  urgent lines are
+ * written at once; the others wait for SEND_QUEUE_RATE, and user lines
+ * go ahead of bulk ones.
+ */
+#define	SENDQ_URGENT	0	/* PING, PONG and registration */
+#define	SENDQ_USER	1	/* typed by the user */
+#define	SENDQ_BULK	2	/* scripts, timers and everything else */
+#define	SENDQ_CLASSES	3
+
+/*
+ * counters kept for each server connection, from when it last logged
+ * in.  see server_get_stats().
+ */
+typedef struct server_stats_stru
+{
+	unsigned long	lines_in;	/* lines read from the server */
+	unsigned long	bytes_in;
+	unsigned long	lines_out;	/* lines sent or queued for it */
+	unsigned long	bytes_out;
+	unsigned long	parse_usec;	/* parsing and handling lines */
+	unsigned long	parse_max;	/* the slowest line of all */
+	unsigned long	hook_usec;	/* of parse_usec, running ON hooks */
+	unsigned long	display_usec;	/* of parse_usec, in add_to_screen() */
+	unsigned long	pings;		/* lag PINGs sent and answered */
+	unsigned long	pongs;
+	long	lag;			/* last round trip in ms, or -1 */
+	long	lag_wait;		/* ms the unanswered PING has waited */
+	size_t	sendq_bytes;		/* waiting to be written */
+	int	sendq_lines;
+	time_t	since;			/* when the counters started */
+} ServerStats;
+
 	int	find_server_group(u_char *, int);
 	u_char	*find_server_group_name(int);
 	void	add_to_server_list(u_char *, int, u_char *, int,
@@ -81,7 +114,7 @@ typedef void (*server_private_cb_type)(void **);
 	void	get_connected(int);
 	int	read_server_file(void);
 	void	display_server_list(void);
-	void	do_server(fd_set *, fd_set *);
+	void	do_server(void);
 	void	send_to_server(const char *, ...) 
 			__attribute__((__format__ (__printf__, 1, 2)));
 	int	server_get_whois(int);
@@ -119,7 +152,6 @@ typedef void (*server_private_cb_type)(void **);
 				  u_char **, u_char **, u_char **,
 				  int *, server_ssl_level *,
 				  u_char **, int *);
-	void	server_set_bits(fd_set *, fd_set *);
 	void	server_set_itsname(int, u_char *);
 	void	server_set_version(int, int);
 	int	is_server_open(int);
@@ -145,6 +177,12 @@ typedef void (*server_private_cb_type)(void **);
 	void	server_get_local_ip_info(int, SOCKADDR_STORAGE **, socklen_t *);
 	void	server_set_chan_list(int, ChannelList *);
 	ChannelList *server_get_chan_list(int);
+	void	server_set_nick_index(int, NickIndex *);
+	NickIndex *server_get_nick_index(int);
+	void	server_set_chan_hash(int, ChanHash *);
+	ChanHash *server_get_chan_hash(int);
+	void	server_set_userhost_cache(int, UserhostCache *);
+	UserhostCache *server_get_userhost_cache(int);
 	void	server_set_attempting_to_connect(int, int);
 	int	server_get_attempting_to_connect(int);
 	void	server_set_sent(int, int);
@@ -171,6 +209,25 @@ typedef void (*server_private_cb_type)(void **);
 	u_char	*server_get_proxy_name(int, int);
 	void	server_set_default_proxy(u_char *);
 	int	ssl_level_to_sa_flags(server_ssl_level level);
+	int	server_set_send_class(int);
+	void	server_sendq_run(void);
+	int	server_sendq_timeout(struct timeval *);
+	size_t	server_get_sendq_bytes(int);
+	int	server_get_sendq_lines(int, int);
+	void	server_race_run(void);
+	int	server_race_timeout(struct timeval *);
+	int	server_get_stats(int, ServerStats *);
+	void	server_stats_hook(struct timeval *);
+	void	server_stats_display(struct timeval *);
+	void	server_replay(u_char *);
+	void	server_ping_run(void);
+	int	server_ping_timeout(struct timeval *);
+	int	server_ping_pong(int, u_char *);
+	void	serverstatscmd(u_char *, u_char *, u_char *);
+	int	server_get_caps(int);
+	void	server_set_caps(int, int);
+	int	server_get_cap_ask(int);
+	void	server_set_cap_ask(int, int);
 
 #define	USER_MODE_I	0x0001
 #define	USER_MODE_W	0x0002
@@ -191,6 +248,20 @@ typedef void (*server_private_cb_type)(void **);
 #define	PROXY_CONNECT	0x2000	/* have sent CONNECT to proxy. */
 #define	PROXY_REPLY	0x4000	/* got "200" from proxy. */
 #define	PROXY_DONE	0x8000	/* got blank line from proxy - done. */
+#define	CAP_PENDING	0x10000	/* have sent CAP LS, and not yet CAP END. */
+#define	SERVER_REPLAY	0x20000	/* lines come from a file; see
+				   server_replay(). */
+
+/*
+ * IRCv3 capabilities we know how to use.  the names are in parse.c;
+ * see server_get_caps().
+ */
+#define	CAP_MULTI_PREFIX	0x01	/* all of @+ in NAMES */
+#define	CAP_USERHOST_IN_NAMES	0x02	/* nick!user@host in NAMES */
+#define	CAP_AWAY_NOTIFY		0x04	/* AWAY from people we share
+					   channels with */
+#define	CAP_EXTENDED_JOIN	0x08	/* account and real name in JOIN */
+#define	CAP_BATCH		0x10	/* BATCH, with message tags */
 
 /* pick the default port if none is given. */
 #define	CHOOSE_PORT(type) \
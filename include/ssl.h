@@ -34,6 +34,7 @@
 # define irc__ssl_h_
 
 typedef struct ssl_info_stru SslInfo;
+struct iovec;
 
 typedef enum {
 	SSL_INIT_OK,
@@ -44,7 +45,11 @@ typedef enum {
 	void	ssl_setup_certs(u_char *);
 	ssl_init_status	ssl_init_connection(int, int, SslInfo **);
 	void	ssl_close_connection(SslInfo **);
+	int	ssl_want_write(SslInfo *);
+	int	ssl_pending(SslInfo *);
+	int	ssl_session_stats(u_char *, int, int *, int *);
 	ssize_t	ssl_write(SslInfo *, int, const void *, size_t);
+	ssize_t	ssl_writev(SslInfo *, int, struct iovec *, int);
 	ssize_t	ssl_read(SslInfo *, int, void *, size_t);
 
 #endif /* irc__ssl_h_ */
@@ -120,6 +120,8 @@ enum {
 	INPUT_PROTECTION_VAR,
 	INSERT_MODE_VAR,
 	INVERSE_VIDEO_VAR,
+	IO_BUFFER_IDLE_VAR,
+	IO_BUFFER_MAX_VAR,
 	IRCHOST_VAR,
 	IRC_ENCODING_VAR,
 	LASTLOG_VAR,
@@ -146,6 +148,13 @@ enum {
 	SCROLL_VAR,
 	SCROLL_LINES_VAR,
 	SEND_IGNORE_MSG_VAR,
+	SEND_QUEUE_BURST_VAR,
+	SEND_QUEUE_HIGH_VAR,
+	SEND_QUEUE_LOW_VAR,
+	SEND_QUEUE_RATE_VAR,
+	SERVER_DRAIN_LINES_VAR,
+	SERVER_DRAIN_USECONDS_VAR,
+	SERVER_PING_INTERVAL_VAR,
 	SHELL_VAR,
 	SHELL_FLAGS_VAR,
 	SHELL_LIMIT_VAR,
@@ -160,6 +169,7 @@ enum {
 	SSL_CA_FILE_VAR,
 	SSL_CA_PATH_VAR,
 	SSL_CA_PRIVATE_KEY_FILE_VAR,
+	SSL_SESSION_FILE_VAR,
 	STAR_PREFIX_VAR,
 	STATUS_AWAY_VAR,
 	STATUS_CHANNEL_VAR,
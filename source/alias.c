@@ -56,6 +56,7 @@ IRCII_RCSID("@(#)$eterna: alias.c,v 1.171 2015/02/22 12:43:18 mrg Exp $");
 #include "exec.h"
 #include "ircterm.h"
 #include "numbers.h"
+#include "newio.h"
 
 #include <sys/stat.h>
 
@@ -177,6 +178,7 @@ static	u_char	*function_encode(u_char *);
 static	u_char	*function_decode(u_char *);
 static	u_char	*function_ischannel(u_char *);
 static	u_char	*function_ischanop(u_char *);
+static	u_char	*function_isaway(u_char *);
 #ifdef HAVE_CRYPT
 static	u_char	*function_crypt(u_char *);
 #endif /* HAVE_CRYPT */
@@ -203,6 +205,9 @@ static	u_char	*function_tolower(u_char *);
 static	u_char	*function_channels(u_char *);
 static	u_char	*function_servers(u_char *);
 static	u_char	*function_servertype(u_char *);
+static	u_char	*function_sendqueue(u_char *);
+static	u_char	*function_iostats(u_char *);
+static	u_char	*function_serverstats(u_char *);
 static	u_char	*function_onchannel(u_char *);
 static	u_char	*function_pid(u_char *);
 static	u_char	*function_ppid(u_char *);
@@ -240,6 +245,7 @@ static BuiltInFunctions	built_in_functions[] =
 	{ UP("DECODE"),		function_decode },
 	{ UP("ISCHANNEL"),	function_ischannel },
 	{ UP("ISCHANOP"),	function_ischanop },
+	{ UP("ISAWAY"),		function_isaway },
 #ifdef HAVE_CRYPT
 	{ UP("CRYPT"),		function_crypt },
 #endif /* HAVE_CRYPT */
@@ -261,6 +267,9 @@ static BuiltInFunctions	built_in_functions[] =
 	{ UP("MYCHANNELS"),	function_channels },
 	{ UP("MYSERVERS"),	function_servers },
 	{ UP("SERVERTYPE"),	function_servertype },
+	{ UP("SENDQUEUE"),	function_sendqueue },
+	{ UP("SERVERSTATS"),	function_serverstats },
+	{ UP("IOSTATS"),	function_iostats },
 	{ UP("CURPOS"),		function_curpos },
 	{ UP("ONCHANNEL"),	function_onchannel },
 	{ UP("PID"),		function_pid },
@@ -2524,8 +2533,13 @@ static u_char	*
 function_userhost(u_char *input)
 {
 	u_char	*result = NULL;
-	u_char	*userhost = from_user_host();
+	u_char	*userhost;
+	u_char	*nick;
 
+	if ((nick = next_arg(input, &input)) != NULL)
+		userhost = nick_userhost(nick, get_from_server());
+	else
+		userhost = from_user_host();
 	malloc_strcpy(&result, userhost ? userhost : empty_string());
 	return (result);
 }
@@ -2651,6 +2665,20 @@ function_hasvoice(u_char *input)
 	return (result);
 }
 
+static u_char *
+function_isaway(u_char *input)
+{
+	u_char	*result = NULL;
+	u_char	*nick;
+	int	away;
+
+	if (!(nick = next_arg(input, &input)) ||
+	    (away = nick_is_away(nick, get_from_server())) == -1)
+		return empty_string();
+	malloc_strcpy(&result, away ? one() : zero());
+	return (result);
+}
+
 static u_char *
 function_dcclist(u_char *nick)
 {
@@ -3003,6 +3031,100 @@ function_tolower(u_char *input)
 	return new;
 }
 
+static u_char	*
+function_sendqueue(u_char *input)
+{
+	u_char	*result = NULL;
+	u_char	tmp[48];
+	int	server;
+
+	if (input && *input)
+	{
+		if ((server = parse_server_index(input)) == -1)
+			server = find_in_server_list(input, 0, NULL);
+	}
+	else if ((server = get_from_server()) < 0)
+		server = get_primary_server();
+	if (server < 0)
+		return empty_string();
+	snprintf(CP(tmp), sizeof tmp, "%lu %d %d",
+		 (unsigned long)server_get_sendq_bytes(server),
+		 server_get_sendq_lines(server, SENDQ_USER),
+		 server_get_sendq_lines(server, SENDQ_BULK));
+	malloc_strcpy(&result, tmp);
+	return (result);
+}
+
+/*
+ * function_serverstats: the traffic, parsing and lag counters for a
+ * server, in the order of ServerStats.
+ */
+static	u_char	*
+function_serverstats(u_char *input)
+{
+	u_char	*result = NULL;
+	u_char	tmp[256];
+	ServerStats stats;
+	int	server;
+
+	if (input && *input)
+	{
+		if ((server = parse_server_index(input)) == -1)
+			server = find_in_server_list(input, 0, NULL);
+	}
+	else if ((server = get_from_server()) < 0)
+		server = get_primary_server();
+	if (server_get_stats(server, &stats))
+		return empty_string();
+	snprintf(CP(tmp), sizeof tmp,
+		 "%lu %lu %lu %lu %lu %lu %lu %lu %lu %ld %ld %lu %d %ld %lu",
+		 stats.lines_in, stats.bytes_in, stats.lines_out,
+		 stats.bytes_out, stats.parse_usec, stats.parse_max,
+		 stats.hook_usec, stats.pings, stats.pongs, stats.lag,
+		 stats.lag_wait, (unsigned long)stats.sendq_bytes,
+		 stats.sendq_lines, (long)(time(NULL) - stats.since),
+		 stats.display_usec);
+	malloc_strcpy(&result, tmp);
+	return (result);
+}
+
+/*
+ * function_iostats: with a descriptor, the size of its input buffer,
+ * bytes waiting in it, reads, bytes read, times grown and shrunk, and
+ * seconds idle.  with none, the descriptors that have a buffer.
+ */
+static	u_char	*
+function_iostats(u_char *input)
+{
+	u_char	*result = NULL;
+	u_char	tmp[128];
+	IOStats	stats;
+	int	des;
+
+	if (input && *input)
+	{
+		if (!is_number(input) || new_io_stats(my_atoi(input), &stats))
+			return empty_string();
+		snprintf(CP(tmp), sizeof tmp, "%lu %lu %lu %lu %lu %lu %ld",
+			 (unsigned long)stats.size, (unsigned long)stats.used,
+			 stats.reads, stats.bytes, stats.grows, stats.shrinks,
+			 (long)stats.idle);
+		malloc_strcpy(&result, tmp);
+		return (result);
+	}
+	for (des = new_io_stats_next(-1); des != -1;
+	     des = new_io_stats_next(des))
+	{
+		snprintf(CP(tmp), sizeof tmp, "%d", des);
+		if (result)
+			malloc_strcat(&result, UP(" "));
+		malloc_strcat(&result, tmp);
+	}
+	if (!result)
+		return empty_string();
+	return (result);
+}
+
 static u_char	*
 function_channels(u_char *input)
 {
@@ -70,7 +70,6 @@ typedef	struct	DCC_struct
 	off_t	bytes_sent;
 	time_t	lasttime;
 	time_t	starttime;
-	u_char	*buffer;
 	struct DCC_struct	*next;
 } DCC_list;
 
@@ -137,7 +136,6 @@ static	off_t	filesize = 0;
 
 static	DCC_list *ClientList = NULL;
 
-static	void	add_to_dcc_buffer(DCC_list *, u_char *);
 static	void	dcc_really_erase(void);
 static	void	dcc_add_deadclient(DCC_list *);
 static	int	dcc_open(DCC_list *);
@@ -188,7 +186,6 @@ dcc_searchlist(u_char *name, u_char *user, int type, int flag, u_char *othername
 	NewClient->user = NewClient->description = NewClient->othername = NULL;
 	NewClient->bytes_read = NewClient->bytes_sent = 0L;
 	NewClient->starttime = 0;
-	NewClient->buffer = 0;
 	NewClient->remname = 0;
 	malloc_strcpy(&NewClient->description, name);
 	malloc_strcpy(&NewClient->user, user);
@@ -230,7 +227,6 @@ dcc_erase(DCC_list *Element)
 			new_free(&Element->description);
 			new_free(&Element->user);
 			new_free(&Element->othername);
-			new_free(&Element->buffer);
 			new_free(&Element->remname);
 			new_free(&Element);
 			return;
@@ -251,23 +247,19 @@ dcc_really_erase(void)
 }
 
 /*
- * Set the descriptor set to show all fds in Client connections to
- * be checked for data.
+ * Register the Client's descriptor with the main loop, asking to hear
+ * about it being writable while a connect is still pending.
  */
-void
-set_dcc_bits(fd_set *rd, fd_set *wd)
+static	void
+dcc_set_io(DCC_list *Client)
 {
-	DCC_list	*Client;
+	int	events = NEWIO_READ;
 
-	for (Client = ClientList; Client != NULL; Client = Client->next)
-	{
 #ifdef DCC_CNCT_PEND
-		if (Client->write != -1 && (Client->flags & DCC_CNCT_PEND))
-			FD_SET(Client->write, wd);
+	if (Client->write == Client->read && (Client->flags & DCC_CNCT_PEND))
+		events |= NEWIO_WRITE;
 #endif /* DCC_CNCT_PEND */
-		if (Client->read != -1)
-			FD_SET(Client->read, rd);
-	}
+	new_io_register(Client->read, events);
 }
 
 /*
@@ -275,7 +267,7 @@ set_dcc_bits(fd_set *rd, fd_set *wd)
  * actions are required.
  */
 void
-dcc_check(fd_set *rd, fd_set *wd)
+dcc_check(void)
 {
 	DCC_list	**Client;
 	struct	timeval	time_out;
@@ -312,13 +304,15 @@ dcc_check(fd_set *rd, fd_set *wd)
 				}
 				(*Client)->starttime = time(NULL);
 				(*Client)->flags &= ~DCC_CNCT_PEND;
+				dcc_set_io(*Client);
 				set_blocking((*Client)->read);
 				if ((*Client)->read != (*Client)->write)
 					set_blocking((*Client)->write);
 			} /* else we're not connected yet */
 		}
 #endif /* NON_BLOCKING_CONNECTS */
-		if ((*Client)->read != -1 && FD_ISSET((*Client)->read, rd))
+		if ((*Client)->read != -1 &&
+		    (new_io_ready((*Client)->read) & NEWIO_READ))
 		{
 			switch((*Client)->flags & DCC_TYPES)
 			{
@@ -480,6 +474,7 @@ dcc_open(DCC_list *Client)
 		Client->read = Client->write;
 		Client->bytes_read = Client->bytes_sent = 0L;
 		Client->flags |= DCC_ACTIVE;
+		dcc_set_io(Client);
 #ifndef NON_BLOCKING_CONNECTS
 		Client->flags &= ~DCC_OFFER;
 		Client->starttime = time(NULL);
@@ -523,6 +518,7 @@ dcc_open(DCC_list *Client)
 			set_from_server(old_server);
 			return 0;
 		}
+		dcc_set_io(Client);
 		if (Client->flags & DCC_TWOCLIENTS)
 		{
 			SOCKADDR_STORAGE	locaddr;
@@ -739,6 +735,7 @@ dcc_raw_listen(u_int iport)
 		return RetName;
 	}
 	listen(Client->read, 4);
+	new_io_register(Client->read, NEWIO_READ);
 	size = sizeof(locaddr);
 	Client->starttime = time(NULL);
 	getsockname(Client->read, (struct sockaddr *) &locaddr, &size);
@@ -1093,7 +1090,7 @@ process_incoming_chat(DCC_list *Client)
 	socklen_t	sra;
 	u_char	tmp[BIG_BUFFER_SIZE];
 	u_char	tmpuser[IRCD_BUFFER_SIZE];
-	u_char	*s, *bufptr;
+	u_char	*s, *line;
 	long	bytesread;
 	int	old_timeout;
 	size_t	len;
@@ -1117,35 +1114,20 @@ process_incoming_chat(DCC_list *Client)
 		Client->read = Client->write;
 		Client->flags &= ~DCC_WAIT;
 		Client->flags |= DCC_ACTIVE;
+		dcc_set_io(Client);
 		say("DCC chat connection to %s[%s] established", Client->user, dcc_sockname(&remaddr, sra));
 		Client->starttime = time(NULL);
 		goto out;
 	}
-	s = Client->buffer;
-	bufptr = tmp;
-	if (s && *s)
-	{
-		len = my_strlen(s);
-		my_strncpy(tmp, s, len);
-		bufptr += len;
-	}
-	else
-		len = 0;
 	old_timeout = dgets_timeout(1);
-	bytesread = dgets(bufptr, ((sizeof(tmp)/2) - len), Client->read);
+	bytesread = dgets_view(Client->read, &line, &len);
 	(void) dgets_timeout(old_timeout);
 	switch ((int)bytesread)
 	{
 	case -2:
 		/* SSL retry */
-		break;
 	case -1:
-		add_to_dcc_buffer(Client, bufptr);
-		if (Client->buffer && (my_strlen(Client->buffer) > sizeof(tmp)/2))
-		{
-			new_free(&Client->buffer);
-			say("*** dropped long DCC CHAT message from %s", Client->user);
-		}
+		/* partial lines are kept by dgets_view() */
 		break;
 	case 0:
 		say("DCC CHAT connection to %s lost: %s", Client->user,
@@ -1156,19 +1138,16 @@ process_incoming_chat(DCC_list *Client)
 		Client->flags |= DCC_DELETE;
 		break;
 	default:
-		new_free(&Client->buffer);
-		len = my_strlen(tmp);
-		if (len > sizeof(tmp)/2)
-			len = sizeof(tmp)/2;
-		Client->bytes_read += len;
+		Client->bytes_read += bytesread;
+		/* stop dcc long messages, stupid but "safe"? */
+		if (len >= sizeof(tmp)/2)
+			line[sizeof(tmp)/2-1] = '\0';
 		*tmpuser = '=';
 		strmcpy(tmpuser+1, Client->user, sizeof(tmpuser)-2);
-		s = do_ctcp(tmpuser, my_nickname(), tmp);
-		s[my_strlen(s) - 1] = '\0';	/* remove newline */
+		s = do_ctcp(tmpuser, my_nickname(), line);
+		dgets_view_release();
 		if (s && *s)
 		{
-			/* stop dcc long messages, stupid but "safe"? */
-			s[sizeof(tmp)/2-1] = '\0';
 			if (do_hook(DCC_CHAT_LIST, "%s %s", Client->user, s))
 			{
 				if (is_away_set())
@@ -1213,6 +1192,7 @@ process_incoming_listen(DCC_list *Client)
 	NewClient->starttime = time(NULL);
 	NewClient->read = NewClient->write = new_socket;
 	NewClient->flags |= DCC_ACTIVE;
+	dcc_set_io(NewClient);
 	NewClient->bytes_read = NewClient->bytes_sent = 0L;
 	malloc_strcpy(&NewClient->remname, Name);
 	if (SS_FAMILY(&remaddr) == PF_INET)
@@ -1243,8 +1223,7 @@ process_incoming_listen(DCC_list *Client)
 static	void
 process_incoming_raw(DCC_list *Client)
 {
-	u_char	tmp[BIG_BUFFER_SIZE];
-	u_char	*s, *bufptr;
+	u_char	*line;
 	long	bytesread;
 	int     old_timeout;
 	size_t	len;
@@ -1252,29 +1231,14 @@ process_incoming_raw(DCC_list *Client)
 	save_message_from();
 	message_from(Client->user, LOG_DCC);
 
-	s = Client->buffer;
-	bufptr = tmp;
-	if (s && *s)
-	{
-		len = my_strlen(s);
-		my_strncpy(tmp, s, len);
-		bufptr += len;
-	}
-	else
-		len = 0;
 	old_timeout = dgets_timeout(1);
-	switch((int)(bytesread = dgets(bufptr, ((sizeof(tmp)/2) - len), Client->read)))
+	switch((int)(bytesread = dgets_view(Client->read, &line, &len)))
 	{
 	case -2:
 		/* SSL retry */
-		break;
 	case -1:
-		add_to_dcc_buffer(Client, bufptr);
-		if (Client->buffer && (my_strlen(Client->buffer) > sizeof(tmp)/2))
-		{
-			new_free(&Client->buffer);
-			say("*** dropping long DCC message from %s", Client->user);
-		}
+		/* partial lines are kept by dgets_view() */
+		(void) dgets_timeout(old_timeout);
 		break;
 	case 0:
 		if (do_hook(DCC_RAW_LIST, "%s %s C",
@@ -1287,16 +1251,14 @@ process_incoming_raw(DCC_list *Client)
 		(void) dgets_timeout(old_timeout);
 		break;
 	default:
-		new_free(&Client->buffer);
-		len = my_strlen(tmp);
-		if (len > sizeof(tmp) / 2)
-			len = sizeof(tmp) / 2;
-		tmp[len - 1] = '\0';
-		Client->bytes_read += len;
+		if (len >= BIG_BUFFER_SIZE / 2)
+			line[BIG_BUFFER_SIZE / 2 - 1] = '\0';
+		Client->bytes_read += bytesread;
 		if (do_hook(DCC_RAW_LIST, "%s %s D %s",
-				Client->user, Client->description, tmp))
+				Client->user, Client->description, line))
 			say("Raw data on %s from %s: %s",
-				Client->user, Client->description, tmp);
+				Client->user, Client->description, line);
+		dgets_view_release();
 		(void) dgets_timeout(old_timeout);
 	}
 	restore_message_from();
@@ -1323,6 +1285,7 @@ process_outgoing_file(DCC_list *Client)
 		Client->read = Client->write;
 		Client->flags &= ~DCC_WAIT;
 		Client->flags |= DCC_ACTIVE;
+		dcc_set_io(Client);
 		Client->bytes_sent = 0L;
 		Client->starttime = time(NULL);
 		say("DCC SEND connection to %s[%s] established", Client->user,
@@ -1773,18 +1736,6 @@ close_all_dcc(void)
 		dcc_erase(Client);
 }
 
-static	void
-add_to_dcc_buffer(DCC_list *Client, u_char *buf)
-{
-	if (buf && *buf)
-	{
-		if (Client->buffer)
-			malloc_strcat(&Client->buffer, buf);
-		else
-			malloc_strcpy(&Client->buffer, buf);
-	}
-}
-
 /*
  * backend for the $dcclist() function.
  */
@@ -71,16 +71,22 @@ IRCII_RCSID("@(#)$eterna: edit.c,v 1.260 2015/02/22 12:43:18 mrg Exp $");
 #include "icb.h"
 #include "strsep.h"
 
-/* a structure for the timer list */
+/*
+ * a structure for the timer list.  pending timers are kept in a binary
+ * heap ordered by due time, and in a hash table by reference number.
+ */
 typedef struct	timerlist_stru
 {
 	int	ref;
 	int	in_on_who;
-	time_t	time;
-	unsigned microseconds;
+	struct	timeval due;		/* when it goes off next */
+	struct	timeval interval;	/* how long it waits each time */
+	int	repeat;			/* runs left, or -1 for ever */
+	int	slot;			/* heap index, -1 while running */
+	unsigned long serial;		/* keeps equal due times in order */
 	int	server;
 	u_char	*command;
-	struct	timerlist_stru *next;
+	struct	timerlist_stru *next;	/* hash chain */
 } TimerList;
 
 /* a structure for per-screen info */
@@ -104,12 +110,6 @@ struct who_info_stru {
 	u_char	*who_real;
 };
 
-/*
- * current_exec_timer - used to make sure we don't remove a timer
- * from within itself.
- */
-static	int	current_exec_timer = -1;
-
 static	int	save_which;
 static	int	save_do_all;
 static	int	away_set;		/* set if there is an away
@@ -121,9 +121,27 @@ static	int	prompt_check_input(int, u_char *, u_char);
 static	void	send_action(u_char *, u_char *);
 static	void	show_timer(u_char *);
 static	int	create_timer_ref(int);
+static	int	timer_before(TimerList *, TimerList *);
+static	void	timer_heap_set(TimerList *, int);
+static	void	timer_heap_up(int);
+static	void	timer_heap_down(int);
+static	void	timer_heap_add(TimerList *);
+static	void	timer_heap_remove(TimerList *);
+static	TimerList *timer_find(int);
+static	void	timer_hash_add(TimerList *);
+static	void	timer_free(TimerList *);
+static	void	timer_set_due(TimerList *, struct timeval *);
+static	int	timer_compare(const void *, const void *);
 static	void	load_a_file(FILE *, u_char *, int);
 
-static TimerList *PendingTimers = NULL;
+static	TimerList **timer_heap = NULL;	/* pending timers, soonest first */
+static	int	timer_heap_count = 0;
+static	int	timer_heap_size = 0;
+static	TimerList **timer_hash = NULL;	/* the same timers, by refnum */
+static	int	timer_hash_count = 0;
+static	int	timer_hash_size = 0;
+static	int	timer_free_ref = 0;	/* lowest refnum that may be free */
+static	unsigned long timer_serial = 0;
 
 /* used with input_move_cursor */
 #define RIGHT 1
@@ -366,6 +384,8 @@ static	IrcCommand irc_command[] =
 	{ "SEND",	NULL,		do_send_text,		SERVERREQ },
 	{ "SENDLINE",	"",		 sendlinecmd,		0 },
 	{ "SERVER",	NULL,		servercmd,		0 },
+	{ "SERVERCOMMAND", NULL,	servercommandcmd,	0 },
+	{ "SERVERSTATS", NULL,		serverstatscmd,		0 },
 	{ "SERVLIST",	"SERVLIST",	send_comm,		SERVERREQ|NOICB },
 	{ "SET",	NULL,		set_variable,		0 },
 #ifdef HAVE_SETENV
@@ -3160,8 +3180,10 @@ send_line(u_int key, u_char *ptr)
 {
 	u_char	*line;
 	int	server;
+	int	old_class;
 
 	server = set_from_server(get_window_server(0));
+	old_class = server_set_send_class(SENDQ_USER);
 	reset_hold(NULL);
 	window_hold_mode(NULL, OFF, 1);
 	line = get_input();
@@ -3183,6 +3205,7 @@ send_line(u_int key, u_char *ptr)
 		update_input(UPDATE_ALL);
 		new_free(&tmp);
 	}
+	server_set_send_class(old_class);
 	set_from_server(server);
 }
 
@@ -3526,40 +3549,242 @@ evalcmd(u_char *command, u_char *args, u_char *subargs)
 }
 
 /*
- * execute_timer:  checks to see if any currently pending timers have
- * gone off, and if so, execute them, delete them, etc, setting the
- * current_exec_timer, so that we can't remove the timer while its
- * still executing.
+ * timer_before: true if timer a is due before timer b.  ties go to the
+ * one that was scheduled first, so timers set for the same moment run
+ * in the order they were added.
+ */
+static	int
+timer_before(TimerList *a, TimerList *b)
+{
+	if (a->due.tv_sec != b->due.tv_sec)
+		return a->due.tv_sec < b->due.tv_sec;
+	if (a->due.tv_usec != b->due.tv_usec)
+		return a->due.tv_usec < b->due.tv_usec;
+	return a->serial < b->serial;
+}
+
+/*
+ * timer_heap_set: put timer in heap slot i.
+ */
+static	void
+timer_heap_set(TimerList *timer, int i)
+{
+	timer_heap[i] = timer;
+	timer->slot = i;
+}
+
+/*
+ * timer_heap_up: move the timer in slot i towards the top of the heap
+ * until its parent is due before it.
+ */
+static	void
+timer_heap_up(int i)
+{
+	TimerList *timer = timer_heap[i];
+
+	while (i > 0 && timer_before(timer, timer_heap[(i - 1) / 2]))
+	{
+		timer_heap_set(timer_heap[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+	timer_heap_set(timer, i);
+}
+
+/*
+ * timer_heap_down: move the timer in slot i away from the top of the
+ * heap until both its children are due after it.
+ */
+static	void
+timer_heap_down(int i)
+{
+	TimerList *timer = timer_heap[i];
+	int	child;
+
+	while ((child = 2 * i + 1) < timer_heap_count)
+	{
+		if (child + 1 < timer_heap_count &&
+		    timer_before(timer_heap[child + 1], timer_heap[child]))
+			child++;
+		if (!timer_before(timer_heap[child], timer))
+			break;
+		timer_heap_set(timer_heap[child], i);
+		i = child;
+	}
+	timer_heap_set(timer, i);
+}
+
+/*
+ * timer_heap_add: schedule timer according to its due time.
+ */
+static	void
+timer_heap_add(TimerList *timer)
+{
+	if (timer_heap_count == timer_heap_size)
+	{
+		timer_heap_size = timer_heap_size ? timer_heap_size * 2 : 16;
+		timer_heap = new_realloc(timer_heap,
+		    timer_heap_size * sizeof *timer_heap);
+	}
+	timer->serial = timer_serial++;
+	timer_heap_set(timer, timer_heap_count++);
+	timer_heap_up(timer->slot);
+}
+
+/*
+ * timer_heap_remove: take timer out of the heap.  it stays in the
+ * refnum table.
+ */
+static	void
+timer_heap_remove(TimerList *timer)
+{
+	int	i = timer->slot;
+
+	timer->slot = -1;
+	if (--timer_heap_count == i)
+		return;
+	timer_heap_set(timer_heap[timer_heap_count], i);
+	if (i > 0 && timer_before(timer_heap[i], timer_heap[(i - 1) / 2]))
+		timer_heap_up(i);
+	else
+		timer_heap_down(i);
+}
+
+/*
+ * timer_find: look up the timer with reference number ref.
+ */
+static	TimerList *
+timer_find(int ref)
+{
+	TimerList *timer;
+
+	if (!timer_hash_size)
+		return NULL;
+	for (timer = timer_hash[ref & (timer_hash_size - 1)]; timer;
+	     timer = timer->next)
+		if (timer->ref == ref)
+			return timer;
+	return NULL;
+}
+
+/*
+ * timer_hash_add: enter timer in the refnum table, making the table
+ * bigger once its chains get long.
+ */
+static	void
+timer_hash_add(TimerList *timer)
+{
+	TimerList **bucket;
+
+	if (timer_hash_count >= timer_hash_size * 2)
+	{
+		TimerList **old = timer_hash, *tmp;
+		int	old_size = timer_hash_size, i;
+
+		timer_hash_size = timer_hash_size ? timer_hash_size * 2 : 32;
+		timer_hash = new_malloc(timer_hash_size * sizeof *timer_hash);
+		memset(timer_hash, 0, timer_hash_size * sizeof *timer_hash);
+		for (i = 0; i < old_size; i++)
+			while ((tmp = old[i]) != NULL)
+			{
+				old[i] = tmp->next;
+				bucket = &timer_hash[tmp->ref & (timer_hash_size - 1)];
+				tmp->next = *bucket;
+				*bucket = tmp;
+			}
+		new_free(&old);
+	}
+	bucket = &timer_hash[timer->ref & (timer_hash_size - 1)];
+	timer->next = *bucket;
+	*bucket = timer;
+	timer_hash_count++;
+}
+
+/*
+ * timer_free: remove timer from the refnum table and free it.  it must
+ * already be out of the heap.
+ */
+static	void
+timer_free(TimerList *timer)
+{
+	TimerList **slot;
+
+	for (slot = &timer_hash[timer->ref & (timer_hash_size - 1)];
+	     *slot != timer; slot = &(*slot)->next)
+		;
+	*slot = timer->next;
+	timer_hash_count--;
+	if (timer->ref < timer_free_ref)
+		timer_free_ref = timer->ref;
+	new_free(&timer->command);
+	new_free(&timer);
+}
+
+/*
+ * timer_set_due: make timer due its interval after base.
+ */
+static	void
+timer_set_due(TimerList *timer, struct timeval *base)
+{
+	timer->due.tv_sec = base->tv_sec + timer->interval.tv_sec;
+	timer->due.tv_usec = base->tv_usec + timer->interval.tv_usec;
+	if (timer->due.tv_usec >= 1000000)
+	{
+		timer->due.tv_sec++;
+		timer->due.tv_usec -= 1000000;
+	}
+}
+
+/*
+ * execute_timer:  runs every timer at the top of the heap that has gone
+ * off.  each is taken out of the heap while its command runs, so the
+ * command may add or delete timers (including itself) freely.  repeating
+ * timers are then put back, due one interval after they were last due.
  */
 void
 execute_timer(void)
 {
 	struct timeval current;
-	TimerList *next;
+	TimerList *timer;
 	
 	gettimeofday(&current, NULL);
 
-	while (PendingTimers &&
-	          (PendingTimers->time < current.tv_sec
-	        || (PendingTimers->time == current.tv_sec
-	        &&  PendingTimers->microseconds <= current.tv_usec)))
+	while (timer_heap_count &&
+	          (timer_heap[0]->due.tv_sec < current.tv_sec
+	        || (timer_heap[0]->due.tv_sec == current.tv_sec
+	        &&  timer_heap[0]->due.tv_usec <= current.tv_usec)))
 	{
 		int	old_in_on_who, old_server;
+		u_char	*cmd = NULL;
+
+		timer = timer_heap[0];
+		timer_heap_remove(timer);
+		if (timer->repeat > 0)
+			timer->repeat--;
 
-		old_in_on_who = set_in_on_who(PendingTimers->in_on_who);
-		current_exec_timer = PendingTimers->ref;
+		old_in_on_who = set_in_on_who(timer->in_on_who);
 		save_message_from();
 		message_from(NULL, LOG_CRAP);
-		old_server = set_from_server(PendingTimers->server);
-		parse_command(PendingTimers->command, 0, empty_string());
+		old_server = set_from_server(timer->server);
+		/* parse_command() writes on its argument */
+		malloc_strcpy(&cmd, timer->command);
+		parse_command(cmd, 0, empty_string());
+		new_free(&cmd);
 		set_from_server(old_server);
 		restore_message_from();
-		current_exec_timer = -1;
-		new_free(&PendingTimers->command);
-		next = PendingTimers->next;
-		new_free(&PendingTimers);
-		PendingTimers = next;
 		set_in_on_who(old_in_on_who);
+
+		if (timer->repeat == 0)
+		{
+			timer_free(timer);
+			continue;
+		}
+		/* don't try to catch up if we fell behind */
+		timer_set_due(timer, &timer->due);
+		if (timer->due.tv_sec < current.tv_sec ||
+		    (timer->due.tv_sec == current.tv_sec &&
+		     timer->due.tv_usec <= current.tv_usec))
+			timer_set_due(timer, &current);
+		timer_heap_add(timer);
 	}
 }
 
@@ -3575,12 +3800,12 @@ timercmd(u_char *command, u_char *args, u_char *subargs)
 	u_char	*waittime, *flag;
 	struct	timeval timertime;
 	long	waitsec, waitusec;
-	TimerList **slot,
-		  *ntimer;
+	TimerList *ntimer;
 	int	want = -1,
+		repeat = 1,
 		refnum;
 
-	if (*args == '-')
+	while (*args == '-')
 	{
 		size_t	len;
 
@@ -3593,38 +3818,30 @@ timercmd(u_char *command, u_char *args, u_char *subargs)
 		if (!my_strncmp(flag, "-DELETE", len))
 		{
 			u_char	*ptr;
-			int	ref;
-			TimerList	*tmp,
-					*prev;
+			TimerList *tmp;
 
-			if (current_exec_timer != -1)
+			if (!(ptr = next_arg(args, &args)))
 			{
-				say("You may not remove a TIMER from itself");
+				say("%s: Need a timer reference number for -DELETE", command);
 				return;
 			}
-			if (!(ptr = next_arg(args, &args)))
+			if (!(tmp = timer_find(my_atoi(ptr))))
 			{
-				say("%s: Need a timer reference number for -DELETE", command);
+				say("%s: Can't delete %d, no such refnum",
+					command, my_atoi(ptr));
 				return;
 			}
-			ref = my_atoi(ptr);
-			for (prev = tmp = PendingTimers; tmp; prev = tmp,
-					tmp = tmp->next)
+			/*
+			 * a timer that is running right now is freed by
+			 * execute_timer() once it has finished.
+			 */
+			if (tmp->slot == -1)
+				tmp->repeat = 0;
+			else
 			{
-				if (tmp->ref == ref)
-				{
-					if (tmp == prev)
-						PendingTimers =
-							PendingTimers->next;
-					else
-						prev->next = tmp->next;
-					new_free(&tmp->command);
-					new_free(&tmp);
-					return;
-				}
+				timer_heap_remove(tmp);
+				timer_free(tmp);
 			}
-			say("%s: Can't delete %d, no such refnum",
-				command, ref);
 			return;
 		}
 		else if (!my_strncmp(flag, "-REFNUM", len))
@@ -3639,6 +3856,19 @@ timercmd(u_char *command, u_char *args, u_char *subargs)
 				return;
 			}
 		}
+		else if (!my_strncmp(flag, "-REPEAT", len))
+		{
+			u_char	*ptr;
+
+			ptr = next_arg(args, &args);
+			repeat = my_atoi(ptr);
+			if (repeat == 0)
+			{
+				say("%s: Illegal repeat count %d", command,
+				    repeat);
+				return;
+			}
+		}
 		else
 		{
 			say("%s: %s no such flag", command, flag);
@@ -3671,33 +3901,39 @@ timercmd(u_char *command, u_char *args, u_char *subargs)
 		for(; isdigit(*++waittime); decimalmul /= 10)
 			waitusec += (*waittime - '0') * decimalmul;
 	}
+	/* a repeating timer with no interval would never let go */
+	if (repeat != 1 && waitsec == 0 && waitusec < 1000)
+		waitusec = 1000;
 	
 	gettimeofday(&timertime, NULL);	
-	timertime.tv_sec += waitsec;
-	timertime.tv_usec+= waitusec;
-	timertime.tv_sec += (timertime.tv_usec/1000000);
-	timertime.tv_usec %= 1000000;
 	
 	ntimer = new_malloc(sizeof *ntimer);
 	ntimer->in_on_who = in_on_who();
-	ntimer->time = timertime.tv_sec;
-	ntimer->microseconds = timertime.tv_usec;
+	ntimer->interval.tv_sec = waitsec;
+	ntimer->interval.tv_usec = waitusec;
+	timer_set_due(ntimer, &timertime);
+	ntimer->repeat = repeat;
 	ntimer->server = get_from_server();
 	ntimer->ref = refnum;
 	ntimer->command = NULL;
 	malloc_strcpy(&ntimer->command, args);
 
-	/* we've created it, now put it in order */
+	timer_hash_add(ntimer);
+	timer_heap_add(ntimer);
+}
 
-	for (slot = &PendingTimers; *slot; slot = &(*slot)->next)
-	{
-		if ((*slot)->time > ntimer->time ||
-		    ((*slot)->time == ntimer->time &&
-		     (*slot)->microseconds > ntimer->microseconds))
-			break;
-	}
-	ntimer->next = *slot;
-	*slot = ntimer;
+/*
+ * timer_compare: qsort() helper for show_timer(), soonest first.
+ */
+static	int
+timer_compare(const void *a, const void *b)
+{
+	TimerList *ta = *(TimerList * const *) a,
+		  *tb = *(TimerList * const *) b;
+
+	if (timer_before(ta, tb))
+		return -1;
+	return timer_before(tb, ta);
 }
 
 /*
@@ -3708,21 +3944,28 @@ static	void
 show_timer(u_char *command)
 {
 	u_char  lbuf[BIG_BUFFER_SIZE];
-	TimerList *tmp;
+	TimerList **list;
 	struct timeval current, time_left;
+	int	count, i;
 
-	if (!PendingTimers)
+	if (!timer_heap_count)
 	{
 		say("%s: No commands pending to be executed", command);
 		return;
 	}
 
+	/* the heap is only partly ordered, so sort a copy of it */
+	count = timer_heap_count;
+	list = new_malloc(count * sizeof *list);
+	memmove(list, timer_heap, count * sizeof *list);
+	qsort((void *) list, count, sizeof *list, timer_compare);
+
 	gettimeofday(&current, NULL);
 	say("Timer Seconds      Command");
-	for (tmp = PendingTimers; tmp; tmp = tmp->next)
+	for (i = 0; i < count; i++)
 	{
-		time_left.tv_sec = tmp->time;
-		time_left.tv_usec = tmp->microseconds;
+		time_left.tv_sec = list[i]->due.tv_sec;
+		time_left.tv_usec = list[i]->due.tv_usec;
 		time_left.tv_sec -= current.tv_sec;
 
 		if (time_left.tv_usec >= current.tv_usec)
@@ -3733,47 +3976,49 @@ show_timer(u_char *command)
 			    current.tv_usec + 1000000;
 			time_left.tv_sec--;
 		}
+		/* due already, it just hasn't been run yet */
+		if (time_left.tv_sec < 0)
+			time_left.tv_sec = time_left.tv_usec = 0;
 
 		snprintf(CP(lbuf), sizeof(lbuf), "%ld.%06d",
 		    (long)time_left.tv_sec, (int)time_left.tv_usec);
-		say("%-5d %-12s %s", tmp->ref, lbuf, tmp->command);
+		if (list[i]->repeat == 1)
+			say("%-5d %-12s %s", list[i]->ref, lbuf,
+			    list[i]->command);
+		else
+		{
+			u_char	rbuf[32];
+
+			if (list[i]->repeat < 0)
+				my_strcpy(rbuf, "forever");
+			else
+				snprintf(CP(rbuf), sizeof rbuf, "%d more",
+				    list[i]->repeat - 1);
+			say("%-5d %-12s %s (every %ld.%06d, %s)",
+			    list[i]->ref, lbuf, list[i]->command,
+			    (long)list[i]->interval.tv_sec,
+			    (int)list[i]->interval.tv_usec, rbuf);
+		}
 	}
+	new_free(&list);
 }
 
 /*
  * create_timer_ref:  returns the lowest unused reference number for
- * a timer
+ * a timer.  every number below timer_free_ref is known to be in use,
+ * so the search starts there.
  */
 static	int
 create_timer_ref(int want)
 {
-	TimerList	*tmp;
-	int	ref = 0;
-	int	done = 0;
+	int	ref;
 
-	if (want == -1)
-		while (!done)
-		{
-			done = 1;
-			for (tmp = PendingTimers; tmp; tmp = tmp->next)
-				if (ref == tmp->ref)
-				{
-					ref++;
-					done = 0;
-					break;
-				}
-		}
-	else
-	{
-		ref = want;
-		for (tmp = PendingTimers; tmp; tmp = tmp->next)
-			if (ref == tmp->ref)
-			{
-				ref = -1;
-				break;
-			}
-	}
+	if (want != -1)
+		return timer_find(want) ? -1 : want;
 
+	for (ref = timer_free_ref; timer_find(ref); ref++)
+		;
+	timer_free_ref = ref + 1;
 	return (ref);
 }
 
@@ -3785,31 +4030,33 @@ void
 timer_timeout(struct timeval *tv)
 {
 	struct timeval current;
+	TimerList *timer;
 
 	tv->tv_usec =0;
 	tv->tv_sec  =0;
 	
-	if (!PendingTimers)
+	if (!timer_heap_count)
 	{
 		tv->tv_sec = 70; /* Just larger than the maximum of 60 */
 		return;
 	}
+	timer = timer_heap[0];
 	gettimeofday(&current, NULL);
 	
-	if (PendingTimers->time < current.tv_sec ||
-	    (PendingTimers->time == current.tv_sec &&
-	    PendingTimers->microseconds < current.tv_usec))
+	if (timer->due.tv_sec < current.tv_sec ||
+	    (timer->due.tv_sec == current.tv_sec &&
+	    timer->due.tv_usec < current.tv_usec))
 	{
 		/* No time to lose, the event is now or was */
 		return;
 	}
 	
-	tv->tv_sec = PendingTimers->time - current.tv_sec;
-	if (PendingTimers->microseconds >= current.tv_usec)
-		tv->tv_usec = PendingTimers->microseconds - current.tv_usec;
+	tv->tv_sec = timer->due.tv_sec - current.tv_sec;
+	if (timer->due.tv_usec >= current.tv_usec)
+		tv->tv_usec = timer->due.tv_usec - current.tv_usec;
 	else
 	{
-		tv->tv_usec = current.tv_usec - PendingTimers->microseconds;
+		tv->tv_usec = timer->due.tv_usec + 1000000 - current.tv_usec;
 		tv->tv_sec -= 1;
 	}
 }
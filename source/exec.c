@@ -86,6 +86,7 @@ static	int	valid_process_index(int);
 static	void	add_process(u_char *, u_char *, int, int, int, int, u_char *, u_char *, unsigned int);
 static	int	is_logical_unique(u_char *);
 static	void	send_exec_result(Process *, u_char *);
+static	void	exec_strip_line(u_char *, size_t, size_t);
 
 /* We use environ here */
 extern	char	**environ;
@@ -203,6 +204,19 @@ check_process_limits(void)
 	}
 }
 
+/*
+ * exec_strip_line: trim a line of process output to fewer than max
+ * characters and take off any trailing carriage return or newline.
+ */
+static	void
+exec_strip_line(u_char *line, size_t len, size_t max)
+{
+	if (len >= max)
+		line[len = max - 1] = '\0';
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		line[--len] = '\0';
+}
+
 static void
 send_exec_result(Process *proc, u_char *exec_buffer)
 {
@@ -247,17 +261,18 @@ send_exec_result(Process *proc, u_char *exec_buffer)
 }
 
 /*
- * do_processes: given a set of read-descriptors (as returned by a call to
- * select()), this will determine which of the process has produced output
- * and will hadle it appropriately 
+ * do_processes: using the descriptors found ready by new_io_wait(), this
+ * will determine which of the process has produced output and will hadle
+ * it appropriately 
  */
 void
-do_processes(fd_set *rd)
+do_processes(void)
 {
 	int	i,
 		flag;
 	u_char	exec_buffer[INPUT_BUFFER_SIZE];
-	u_char	*ptr;
+	u_char	*line;
+	size_t	len;
 	Process	*proc;
 	int	old_timeout;
 	int	server;
@@ -269,9 +284,9 @@ do_processes(fd_set *rd)
 	{
 		if ((proc = process_list[i]) && proc->p_stdout != -1)
 		{
-			if (FD_ISSET(proc->p_stdout, rd))
+			if (new_io_ready(proc->p_stdout) & NEWIO_READ)
 			{
-				switch (dgets(exec_buffer, sizeof exec_buffer, proc->p_stdout))
+				switch (dgets_view(proc->p_stdout, &line, &len))
 				{
 				case 0:
 					if (proc->p_stderr == -1)
@@ -285,6 +300,8 @@ do_processes(fd_set *rd)
 						proc->p_stdout = exec_close(proc->p_stdout);
 					break;
 				case -1:
+					strmcpy(exec_buffer, line, sizeof exec_buffer);
+					dgets_view_discard(proc->p_stdout);
 					server = set_from_server(proc->server);
 					if (proc->logical)
 						flag = do_hook(EXEC_PROMPT_LIST, "%s %s", proc->logical, exec_buffer);
@@ -299,22 +316,15 @@ do_processes(fd_set *rd)
 					server = set_from_server(proc->server);
 					message_to(proc->refnum);
 					proc->counter++;
-					exec_buffer[sizeof(exec_buffer) - 1] = '\0';	/* blah... */
-					ptr = exec_buffer + my_strlen(exec_buffer) - 1;
-					if ((*ptr == '\n') || (*ptr == '\r'))
-					{
-						*ptr = (u_char) 0;
-						ptr = exec_buffer + my_strlen(exec_buffer) - 1;
-						if ((*ptr == '\n') || (*ptr == '\r'))
-							*ptr = (u_char) 0;
-					}
+					exec_strip_line(line, len, sizeof exec_buffer);
 					if (proc->logical)
-						flag = do_hook(EXEC_LIST, "%s %s", proc->logical, exec_buffer);
+						flag = do_hook(EXEC_LIST, "%s %s", proc->logical, line);
 					else
-						flag = do_hook(EXEC_LIST, "%d %s", i, exec_buffer);
+						flag = do_hook(EXEC_LIST, "%d %s", i, line);
 
 					if (flag)
-						send_exec_result(proc, exec_buffer);
+						send_exec_result(proc, line);
+					dgets_view_release();
 					message_to(0);
 					set_from_server(server);
 					break;
@@ -324,9 +334,11 @@ do_processes(fd_set *rd)
 		if (process_list && i < process_list_size &&
 		    (proc = process_list[i]) && proc->p_stderr != -1)
 		{
-			if (FD_ISSET(proc->p_stderr, rd))
+			if (new_io_ready(proc->p_stderr) & NEWIO_READ)
 			{
-				switch (dgets(exec_buffer, sizeof exec_buffer, proc->p_stderr))
+				int	held = 1;
+
+				switch (dgets_view(proc->p_stderr, &line, &len))
 				{
 				case 0:
 					if (proc->p_stdout == -1)
@@ -341,6 +353,8 @@ do_processes(fd_set *rd)
 					break;
 
 				case -1:
+					strmcpy(exec_buffer, line, sizeof exec_buffer);
+					dgets_view_discard(proc->p_stderr);
 					server = set_from_server(proc->server);
 					if (proc->logical)
 						flag = do_hook(EXEC_PROMPT_LIST, "%s %s", proc->logical, exec_buffer);
@@ -351,25 +365,24 @@ do_processes(fd_set *rd)
 					set_from_server(server);
 					if (flag == 0)
 						break;
+					line = exec_buffer;
+					len = my_strlen(exec_buffer);
+					held = 0;
+					/* FALLTHROUGH */
 
 				default:
 					server = set_from_server(proc->server);
 					message_to(proc->refnum);
 					(proc->counter)++;
-					ptr = exec_buffer + my_strlen(exec_buffer) - 1;
-					if ((*ptr == '\n') || (*ptr == '\r'))
-					{
-						*ptr = (u_char) 0;
-						ptr = exec_buffer + my_strlen(exec_buffer) - 1;
-						if ((*ptr == '\n') || (*ptr == '\r'))
-							*ptr = (u_char) 0;
-					}
+					exec_strip_line(line, len, sizeof exec_buffer);
 					if (proc->logical)
-						flag = do_hook(EXEC_ERRORS_LIST, "%s %s", proc->logical, exec_buffer);
+						flag = do_hook(EXEC_ERRORS_LIST, "%s %s", proc->logical, line);
 					else
-						flag = do_hook(EXEC_ERRORS_LIST, "%d %s", i, exec_buffer);
+						flag = do_hook(EXEC_ERRORS_LIST, "%d %s", i, line);
 					if (flag)
-						send_exec_result(proc, exec_buffer);
+						send_exec_result(proc, line);
+					if (held)
+						dgets_view_release();
 					message_to(0);
 					set_from_server(server);
 					break;
@@ -380,31 +393,6 @@ do_processes(fd_set *rd)
 	(void) dgets_timeout(old_timeout);
 }
 
-/*
- * set_process_bits: This will set the bits in a fd_set map for each of the
- * process descriptors. 
- */
-void
-set_process_bits(fd_set *rd)
-{
-	int	i;
-	Process	*proc;
-
-	if (process_list)
-	{
-		for (i = 0; i < process_list_size; i++)
-		{
-			if ((proc = process_list[i]) != NULL)
-			{
-				if (proc->p_stdout != -1)
-					FD_SET(proc->p_stdout, rd);
-				if (proc->p_stderr != -1)
-					FD_SET(proc->p_stderr, rd);
-			}
-		}
-	}
-}
-
 /*
  * list_processes: displays a list of all currently running processes,
  * including index number, pid, and process name 
@@ -545,6 +533,8 @@ add_process(u_char *name, u_char *logical, int pid, int p_stdin, int p_stdout, i
 	int	i;
 	Process	*proc;
 
+	new_io_register(p_stdout, NEWIO_READ);
+	new_io_register(p_stderr, NEWIO_READ);
 	if (process_list == NULL)
 	{
 		process_list = new_malloc(sizeof *process_list);
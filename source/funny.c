@@ -228,7 +228,6 @@ void
 funny_namreply(u_char *from, u_char **Args)
 {
 	u_char	*type,
-		*nick,
 		*channel;
 	static	u_char	format[40];
 	static	int	last_width = -1;
@@ -247,8 +246,7 @@ funny_namreply(u_char *from, u_char **Args)
 		if (do_hook(current_numeric(), "%s %s %s %s", from, type, channel,
 			line) && get_int_var(SHOW_CHANNEL_NAMES_VAR))
 			say("Users on %s: %s", channel, line);
-		while ((nick = next_arg(line, &line)) != NULL)
-			add_to_channel(channel, nick, parsing_server(), 0, 0);
+		stage_channel_names(channel, line, parsing_server());
 		goto out;
 	}
 	if (last_width != get_int_var(CHANNEL_NAME_WIDTH_VAR))
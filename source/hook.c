@@ -50,6 +50,7 @@ struct	hook_stru
 {
 	Hook	*next;		/* pointer to next element in list */
 	u_char	*nick;		/* The Nickname */
+	Wild	*wild;		/* nick, compiled */
 	int	not;		/* If true, this entry should be
 				 * ignored when matched, otherwise it
 				 * is a normal entry */
@@ -74,6 +75,33 @@ struct	hook_stru
 	int	global;		/* set if loaded from `global' */
 };
 
+/*
+ * HookIndex: a hook list, arranged for do_hook().  hooks whose pattern
+ * starts with a literal word, as "NICK *" does, are kept by the
+ * wild_hash() of that word, so that a line is only tried against those
+ * for its own first word, and the rest.  the rest are those starting
+ * with a wildcard, and those for one server only, which must always be
+ * seen.  every chain keeps the order of the list.  the index is built
+ * when first needed, and thrown away whenever the list changes.
+ */
+typedef struct hook_ref_stru HookRef;
+
+struct hook_ref_stru
+{
+	HookRef	*next;		/* in the same slot, or in rest */
+	Hook	*hook;
+	unsigned hash;		/* of the first word of its pattern */
+};
+
+typedef struct
+{
+	HookRef	*refs;		/* one for each hook, in list order */
+	int	count;
+	HookRef	**bucket;	/* by hash */
+	unsigned size;		/* slots in bucket, a power of 2 */
+	HookRef	*rest;
+} HookIndex;
+
 struct hook_func_stru
 {
 	u_char	*name;		/* name of the function */
@@ -82,13 +110,14 @@ struct hook_func_stru
 	int	params;		/* number of parameters expected */
 	int	mark;
 	unsigned flags;
+	HookIndex *index;	/* list, for do_hook() */
 };
 
 struct numeric_list_stru
 {
-	NumericList *next;
-	u_char	*name;
+	u_char	*name;		/* the numeric, as "%3.3u" */
 	Hook	*list;
+	HookIndex *index;
 };
 
 static	u_char	*fill_it_out(u_char *, int);
@@ -101,6 +130,10 @@ static	int	show_numeric_list(int);
 static	int	show_list(int);
 static	void	remove_numeric_hook(int, u_char *, int, int, int);
 static	void	write_hook(FILE *, Hook *, u_char *);
+static	NumericList *numeric_hook(int);
+static	int	hook_first_word(u_char *, size_t *);
+static	HookIndex *hook_index_build(Hook *);
+static	void	hook_index_free(HookIndex **);
 
 #define SILENT 0
 #define QUIET 1
@@ -126,7 +159,9 @@ static	int	in_on_who_real = 0,
 		current_hook = -1;	/* used in the send_text()
 					   routine */
 
-static	NumericList *numeric_list = NULL;
+/* numeric_list: the hooks for each numeric, or NULL if it has none */
+#define	NUMBER_OF_NUMERICS	1000
+static	NumericList *numeric_list[NUMBER_OF_NUMERICS];
 
 /* hook_functions: the list of all hook functions available */
 static	HookFunc hook_functions[] =
@@ -189,6 +224,7 @@ static	HookFunc hook_functions[] =
 	{ UP("SEND_MSG"),	NULL,	2,	0,	0 },
 	{ UP("SEND_NOTICE"),	NULL,	2,	0,	0 },
 	{ UP("SEND_PUBLIC"),	NULL,	2,	0,	0 },
+	{ UP("SEND_QUEUE"),	NULL,	3,	0,	0 },
 	{ UP("SEND_TALK"),	NULL,	2,	0,	0 },
 	{ UP("SERVER_NOTICE"),	NULL,	1,	0,	0 },
 	{ UP("SIGNOFF"),	NULL,	1,	0,	0 },
@@ -284,6 +320,15 @@ Add_Remove_Check_List(List *_Item, List *_Item2)
 	return Add_Remove_Check(_Item, _Item->name);
 }
 
+/* numeric_hook: the hooks for numeric, or NULL */
+static	NumericList *
+numeric_hook(int numeric)
+{
+	if (numeric < 0 || numeric >= NUMBER_OF_NUMERICS)
+		return NULL;
+	return numeric_list[numeric];
+}
+
 static	void
 add_numeric_hook(int numeric, u_char *nick, u_char *stuff, int noisy, int not, int server, int sernum)
 {
@@ -291,14 +336,20 @@ add_numeric_hook(int numeric, u_char *nick, u_char *stuff, int noisy, int not, i
 	Hook	*new;
 	u_char	buf[4];
 
-	snprintf(CP(buf), sizeof buf, "%3.3u", numeric);
-	if ((entry = (NumericList *) find_in_list((List **)(void *)&numeric_list, buf, 0)) == NULL)
+	if (numeric < 0 || numeric >= NUMBER_OF_NUMERICS)
 	{
+		yell("add_numeric_hook: numeric %d out of range", numeric);
+		return;
+	}
+	if ((entry = numeric_list[numeric]) == NULL)
+	{
+		snprintf(CP(buf), sizeof buf, "%3.3u", numeric);
 		entry = new_malloc(sizeof *entry);
 		entry->name = NULL;
 		entry->list = NULL;
+		entry->index = NULL;
 		malloc_strcpy(&(entry->name), buf);
-		add_to_list((List **)(void *)&numeric_list, (List *) entry);
+		numeric_list[numeric] = entry;
 	}
 
 	setup_struct((server==-1) ? -1 : (server & ~HS_NOGENERIC), sernum-1, sernum, 0);
@@ -306,6 +357,7 @@ add_numeric_hook(int numeric, u_char *nick, u_char *stuff, int noisy, int not, i
 	{
 		new->not = 1;
 		new_free(&(new->nick));
+		wild_free(&(new->wild));
 		new_free(&(new->stuff));
 		wait_new_free((u_char **)(void *)&new);
 	}
@@ -320,7 +372,9 @@ add_numeric_hook(int numeric, u_char *nick, u_char *stuff, int noisy, int not, i
 	malloc_strcpy(&new->nick, nick);
 	malloc_strcpy(&new->stuff, stuff);
 	upper(new->nick);
+	new->wild = wild_compile(new->nick);
 	add_to_list_ext((List **)(void *)&(entry->list), (List *) new, Add_Remove_Check_List);
+	hook_index_free(&entry->index);
 }
 
 /*
@@ -349,6 +403,7 @@ add_hook(int which, u_char *nick, u_char *stuff, int noisy, int not, int server,
 	{
 		new->not = 1;
 		new_free(&(new->nick));
+		wild_free(&(new->wild));
 		new_free(&(new->stuff));
 		wait_new_free((u_char **)(void *)&new);
 	}
@@ -363,7 +418,9 @@ add_hook(int which, u_char *nick, u_char *stuff, int noisy, int not, int server,
 	malloc_strcpy(&new->nick, nick);
 	malloc_strcpy(&new->stuff, stuff);
 	upper(new->nick);
+	new->wild = wild_compile(new->nick);
 	add_to_list_ext((List **)(void *)&(hook_functions[which].list), (List *) new, Add_Remove_Check_List);
+	hook_index_free(&hook_functions[which].index);
 }
 
 /* show_hook shows a single hook */
@@ -395,14 +452,12 @@ show_numeric_list(int numeric)
 {
 	NumericList *tmp;
 	Hook	*list;
-	u_char	buf[4];
-	int	cnt = 0;
+	int	cnt = 0,
+		i;
 
 	if (numeric)
 	{
-		snprintf(CP(buf), sizeof buf, "%3.3u", numeric);
-		if ((tmp = (NumericList *) find_in_list((List **)(void *)&numeric_list, buf, 0))
-				!= NULL)
+		if ((tmp = numeric_hook(numeric)) != NULL)
 		{
 			for (list = tmp->list; list; list = list->next, cnt++)
 				show_hook(list, tmp->name);
@@ -410,8 +465,10 @@ show_numeric_list(int numeric)
 	}
 	else
 	{
-		for (tmp = numeric_list; tmp; tmp = tmp->next)
+		for (i = 0; i < NUMBER_OF_NUMERICS; i++)
 		{
+			if ((tmp = numeric_list[i]) == NULL)
+				continue;
 			for (list = tmp->list; list; list = list->next, cnt++)
 				show_hook(list, tmp->name);
 		}
@@ -441,6 +498,77 @@ show_list(int which)
 	return (cnt);
 }
 
+/*
+ * hook_first_word: 1 if pattern starts with a word with no wildcards in
+ * it, which every line it matches must also start with, and its length.
+ */
+static	int
+hook_first_word(u_char *pattern, size_t *len)
+{
+	u_char	*p;
+
+	for (p = pattern; *p && *p != ' '; p++)
+		if (*p == '*' || *p == '%' || *p == '?' || *p == '\\')
+			return 0;
+	*len = p - pattern;
+	return 1;
+}
+
+/* hook_index_build: make the HookIndex for list, which is not empty */
+static	HookIndex *
+hook_index_build(Hook *list)
+{
+	HookIndex *idx;
+	HookRef	*ref,
+		**slot;
+	Hook	*tmp;
+	size_t	len;
+	int	i;
+
+	idx = new_malloc(sizeof *idx);
+	for (idx->count = 0, tmp = list; tmp; tmp = tmp->next)
+		idx->count++;
+	idx->refs = new_malloc(idx->count * sizeof *idx->refs);
+	for (i = 0, tmp = list; tmp; tmp = tmp->next)
+		idx->refs[i++].hook = tmp;
+	for (idx->size = 16; idx->size < (unsigned) idx->count; idx->size *= 2)
+		;
+	idx->bucket = new_malloc(idx->size * sizeof *idx->bucket);
+	memset(idx->bucket, 0, idx->size * sizeof *idx->bucket);
+	idx->rest = NULL;
+
+	/* backwards, so that each chain comes out in list order */
+	for (i = idx->count; i-- > 0; )
+	{
+		ref = &idx->refs[i];
+		tmp = ref->hook;
+		if ((tmp->server == -1 || !(tmp->server & HS_NOGENERIC)) &&
+		    hook_first_word(tmp->nick, &len))
+		{
+			ref->hash = wild_hash(tmp->nick, len);
+			slot = &idx->bucket[ref->hash & (idx->size - 1)];
+		}
+		else
+		{
+			ref->hash = 0;
+			slot = &idx->rest;
+		}
+		ref->next = *slot;
+		*slot = ref;
+	}
+	return idx;
+}
+
+static	void
+hook_index_free(HookIndex **idx)
+{
+	if (!*idx)
+		return;
+	new_free(&(*idx)->refs);
+	new_free(&(*idx)->bucket);
+	new_free(idx);
+}
+
 /*
  * do_hook: This is what gets called whenever a MSG, INVITES, WALL, (you get
  * the idea) occurs.  The nick is looked up in the appropriate list. If a
@@ -456,11 +584,18 @@ do_hook(int which, char *format, ...)
 {
 	va_list vl;
 	Hook	*tmp, **list;
+	HookIndex **index = NULL,
+		*idx;
+	HookRef	*ref,
+		*word,
+		*rest;
+	unsigned hash;
 	u_char	*name = NULL;
 	int	RetVal = 1;
 	int	i,
 		old_in_on_who;
-	Hook	*hook_array[2048];	/* XXX ugh */
+	Hook	*hook_buf[32],
+		**hook_array = hook_buf;
 	int	hook_num = 0;
 	static	int hook_level = 0;
 	size_t	len;
@@ -470,6 +605,8 @@ do_hook(int which, char *format, ...)
 	int currmatch = 0, oldmatch = 0;
 	Hook *bestmatch = NULL;
 	int nomorethisserial = 0;
+	struct timeval start;
+	int timed = 0;
 #ifdef NEED_PUTBUF_DECLARED
 	/* make this buffer *much* bigger than needed */
 	u_char	putbuf[2*BIG_BUFFER_SIZE];
@@ -479,20 +616,15 @@ do_hook(int which, char *format, ...)
 
 	hook_level++;
 
-	va_start(vl, format);
-	PUTBUF_SPRINTF(format, vl);
-	va_end(vl);
 	if (which < 0)
 	{
 		NumericList *hook;
-		u_char	buf[4];
 
-		snprintf(CP(buf), sizeof buf, "%3.3u", -which);
-		if ((hook = (NumericList *) find_in_list((List **)(void *)&numeric_list, buf, 0))
-				!= NULL)
+		if ((hook = numeric_hook(-which)) != NULL)
 		{
 			name = hook->name;
 			list = &hook->list;
+			index = &hook->index;
 		}
 		else
 			list = NULL;
@@ -510,19 +642,62 @@ do_hook(int which, char *format, ...)
 		{
 			list = &(hook_functions[which].list);
 			name = hook_functions[which].name;
+			index = &(hook_functions[which].index);
 		}
 	}
-	if (!list)
+	if (!list || !*list)
 	{
 		RetVal = 1;
 		goto out;
 	}
 
+	/* only bother to format the arguments if there are hooks to see */
+	va_start(vl, format);
+	PUTBUF_SPRINTF(format, vl);
+	va_end(vl);
+
 	if (which >= 0)
 		hook_functions[which].mark++;
 
-	for (tmp = *list; tmp; tmp = tmp->next)
+	/* time the outermost hook for the server stats */
+	if (hook_level == 1 && *list && parsing_server() != -1)
+	{
+		gettimeofday(&start, NULL);
+		timed = 1;
+	}
+
+	/*
+	 * look at the hooks for the first word of the line, and those
+	 * that may match any, merged back into the order of the list.
+	 * the others cannot match, and would make no difference here.
+	 */
+	if (!*index)
+		*index = hook_index_build(*list);
+	idx = *index;
+	if (idx->count > (int) (sizeof hook_buf / sizeof *hook_buf))
+		hook_array = new_malloc(idx->count * sizeof *hook_array);
+	for (len = 0; putbuf[len] && putbuf[len] != ' '; len++)
+		;
+	hash = wild_hash(putbuf, len);
+	word = idx->size ? idx->bucket[hash & (idx->size - 1)] : NULL;
+	rest = idx->rest;
+	for (;;)
 	{
+		while (word && word->hash != hash)
+			word = word->next;
+		if (word && (!rest || word < rest))
+		{
+			ref = word;
+			word = word->next;
+		}
+		else if (rest)
+		{
+			ref = rest;
+			rest = rest->next;
+		}
+		else
+			break;
+		tmp = ref->hook;
 		currser = tmp->sernum;
 		if (currser != oldser)      /* new serial number */
 		{
@@ -547,7 +722,7 @@ do_hook(int which, char *format, ...)
 			bestmatch = NULL;
 			continue;
 		}
-		currmatch = wild_match(tmp->nick, putbuf);
+		currmatch = wild_exec(tmp->wild, putbuf);
 		if (currmatch > oldmatch)
 		{
 			oldmatch = currmatch;
@@ -596,6 +771,10 @@ do_hook(int which, char *format, ...)
 	if (which >= 0)
 		hook_functions[which].mark--;
 out:
+	if (hook_array != hook_buf)
+		new_free(&hook_array);
+	if (timed)
+		server_stats_hook(&start);
 	PUTBUF_END
 	return really_free(--hook_level), RetVal;
 }
@@ -609,7 +788,7 @@ remove_numeric_hook(int numeric, u_char *nick, int server, int sernum, int quiet
 	u_char	buf[4];
 
 	snprintf(CP(buf), sizeof buf, "%3.3u", numeric);
-	if ((hook = (NumericList *) find_in_list((List **)(void *)&numeric_list, buf,0)) != NULL)
+	if ((hook = numeric_hook(numeric)) != NULL)
 	{
 		if (nick)
 		{
@@ -621,15 +800,15 @@ remove_numeric_hook(int numeric, u_char *nick, int server, int sernum, int quiet
 					say("\"%s\" removed from %s list", nick, buf);
 				tmp->not = 1;
 				new_free(&(tmp->nick));
+				wild_free(&(tmp->wild));
 				new_free(&(tmp->stuff));
 				wait_new_free((u_char **)(void *)&tmp);
+				hook_index_free(&hook->index);
 				if (hook->list == NULL)
 				{
-					if ((hook = (NumericList *) remove_from_list((List **)(void *)&numeric_list, buf)) != NULL)
-					{
-						new_free(&(hook->name));
-						new_free(&hook);
-					}
+					numeric_list[numeric] = NULL;
+					new_free(&(hook->name));
+					new_free(&hook);
 				}
 				return;
 			}
@@ -641,10 +820,12 @@ remove_numeric_hook(int numeric, u_char *nick, int server, int sernum, int quiet
 				next = tmp->next;
 				tmp->not = 1;
 				new_free(&(tmp->nick));
+				wild_free(&(tmp->wild));
 				new_free(&(tmp->stuff));
 				wait_new_free((u_char **)(void *)&tmp);
 			}
 			hook->list = NULL;
+			hook_index_free(&hook->index);
 			if (!quiet)
 				say("The %s list is empty", buf);
 			return;
@@ -684,8 +865,10 @@ remove_hook(int which, u_char *nick, int server, int sernum, int quiet)
 				say("\"%s\" removed from %s list", nick, hook_functions[which].name);
 			tmp->not = 1;
 			new_free(&(tmp->nick));
+			wild_free(&(tmp->wild));
 			new_free(&(tmp->stuff));
 			wait_new_free((u_char **)(void *)&tmp);
+			hook_index_free(&hook_functions[which].index);
 		}
 		else if (!quiet)
 			say("\"%s\" is not on the %s list", nick, hook_functions[which].name);
@@ -697,10 +880,12 @@ remove_hook(int which, u_char *nick, int server, int sernum, int quiet)
 			next = tmp->next;
 			tmp->not = 1;
 			new_free(&(tmp->nick));
+			wild_free(&(tmp->wild));
 			new_free(&(tmp->stuff));
 			wait_new_free((u_char **)(void *)&tmp);
 		}
 		hook_functions[which].list = NULL;
+		hook_index_free(&hook_functions[which].index);
 		if (!quiet)
 			say("The %s list is empty", hook_functions[which].name);
 	}
@@ -998,7 +1183,8 @@ save_hooks(FILE *fp, int do_all)
 {
 	Hook	*list;
 	NumericList *numeric;
-	int	which;
+	int	which,
+		i;
 
 	for (which = 0; which < NUMBER_OF_LISTS; which++)
 	{
@@ -1006,8 +1192,10 @@ save_hooks(FILE *fp, int do_all)
 			if (!list->global || do_all)
 				write_hook(fp,list, hook_functions[which].name);
 	}
-	for (numeric = numeric_list; numeric; numeric = numeric->next)
+	for (i = 0; i < NUMBER_OF_NUMERICS; i++)
 	{
+		if ((numeric = numeric_list[i]) == NULL)
+			continue;
 		for (list = numeric->list; list; list = list->next)
 			if (!list->global)
 				write_hook(fp, list, numeric->name);
@@ -316,7 +316,7 @@ icb_got_status(u_char *line)
 		if (double_ignore(ap[1], from_user_host(), IGNORE_CRAP) != IGNORED &&
 		    do_hook(JOIN_LIST, "%s %s %s", ap[1], server_get_icbgroup(parsing_server()), empty_string()) == 0)
 			do_say = 0;
-		add_to_channel(server_get_icbgroup(parsing_server()), ap[1], parsing_server(), 0, 0);
+		add_to_channel(server_get_icbgroup(parsing_server()), ap[1], parsing_server(), 0, 0, NULL);
 		RESTORE_SPACE;
 	}
 	else
@@ -347,7 +347,7 @@ icb_got_status(u_char *line)
 		if (double_ignore(ap[1], from_user_host(), IGNORE_CRAP) != IGNORED &&
 		    do_hook(JOIN_LIST, "%s %s %s", ap[1], server_get_icbgroup(parsing_server()), empty_string()) == 0)
 			do_say = 0;
-		add_to_channel(server_get_icbgroup(parsing_server()), ap[1], parsing_server(), 0, 0);
+		add_to_channel(server_get_icbgroup(parsing_server()), ap[1], parsing_server(), 0, 0, NULL);
 		RESTORE_SPACE;
 	}
 	else
@@ -622,7 +622,7 @@ icb_cmdout_check_members(u_char *line)
 			if (*next == ' ')
 				next++;
 		}
-		add_to_channel(group, line, parsing_server(), 0, 0);
+		add_to_channel(group, line, parsing_server(), 0, 0, NULL);
 		line = next;
 	}
 	new_free(&nick_list);
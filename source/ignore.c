@@ -40,6 +40,8 @@ IRCII_RCSID("@(#)$eterna: ignore.c,v 1.45 2014/03/12 06:17:05 mrg Exp $");
 #include "list.h"
 #include "vars.h"
 #include "output.h"
+#include "names.h"
+#include "server.h"
 
 #define NUMBER_OF_IGNORE_LEVELS 9
 
@@ -55,12 +57,14 @@ typedef struct	IgnoreStru
 {
 	struct	IgnoreStru *next;
 	u_char	*nick;
+	Wild	*wild;		/* nick, compiled */
 	int	type;
 	int	dont;
 	int	high;
 }	Ignore;
 
 static	int	remove_ignore(u_char *);
+static	int	ignore_match(List *, u_char *);
 static	u_char	*ignore_list(u_char *, int);
 static	int	ignore_usernames_mask(int, int);
 static	void	ignore_nickname(u_char *, int, int);
@@ -129,6 +133,7 @@ ignore_nickname(u_char *nick, int type, int flag)
 					if ((new = (Ignore *) remove_from_list((List **)(void *)&ignored_nicks, nick)) != NULL)
 					{
 						new_free(&(new->nick));
+						wild_free(&(new->wild));
 						new_free(&new);
 					}
 					new = new_malloc(sizeof *new);
@@ -138,6 +143,7 @@ ignore_nickname(u_char *nick, int type, int flag)
 					new->high = 0;
 					malloc_strcpy(&(new->nick), nick);
 					upper(new->nick);
+					new->wild = wild_compile(new->nick);
 					add_to_list((List **)(void *)&ignored_nicks, (List *) new);
 				}
 			}
@@ -237,12 +243,20 @@ remove_ignore(u_char *nick)
 		if (my_index(nick, '@'))
 			do_ignore_usernames = ignore_usernames_mask(tmp->type, -1);
 		new_free(&(tmp->nick));
+		wild_free(&(tmp->wild));
 		new_free(&tmp);
 		return (0);
 	}
 	return (1);
 }
 
+/* ignore_match: list_lookup_ext() helper, matching with the compiled nick */
+static	int
+ignore_match(List *item, u_char *str)
+{
+	return wild_exec(((Ignore *) item)->wild, str);
+}
+
 /*
  * is_ignored: checks to see if nick is being ignored (poor nick).  Checks
  * against type to see if ignorance is to take place.  If nick is marked as
@@ -256,7 +270,7 @@ is_ignored(u_char *nick, int type)
 
 	if (ignored_nicks)
 	{
-		if ((tmp = (Ignore *) list_lookup((List **)(void *)&ignored_nicks, nick, USE_WILDCARDS, 0)) != NULL)
+		if ((tmp = (Ignore *) list_lookup_ext((List **)(void *)&ignored_nicks, nick, USE_WILDCARDS, 0, ignore_match)) != NULL)
 		{
 			if (tmp->dont & type)
 				return (DONT_IGNORE);
@@ -595,11 +609,14 @@ ignore_combo(int flag1, int flag2)
 
 /*
  * double_ignore - makes live simpiler when using doing ignore code
- * added, april 1993, phone.
+ * added, april 1993, phone.  with no userhost, the one the server
+ * last showed for nick is used, if there is one.
  */
 int
 double_ignore(u_char *nick, u_char *userhost, int type)
 {
+	if (!userhost)
+		userhost = nick_userhost(nick, parsing_server());
 	if (userhost)
 		return (ignore_combo(is_ignored(nick, type),
 			is_ignored(userhost, type)));
@@ -111,6 +111,9 @@ static	u_char	*irc_path,			/* paths used by /load */
 		*my_path_dir,			/* path to users home dir */
 		*log_file,			/* path to debug log file */
 		*default_proxy,			/* default proxy to use */
+		*replay_file,			/* --replay: server lines to
+						   parse instead of
+						   connecting */
 		irc_version_str[] = IRCII_VERSION;
 
 #ifdef DO_USER2
@@ -126,7 +129,7 @@ static	int	do_sig_user1;
 #ifdef	DO_USER2
 static	void	sig_user2(int) ;
 #endif /* DO_USER2 */
-static	int	irc_do_a_screen(Screen *, fd_set *);
+static	int	irc_do_a_screen(Screen *);
 static	void	irc_io(void);
 static	void	quit_response(u_char *, u_char *);
 static	void	show_version(void);
@@ -175,6 +178,8 @@ static	char	switch_help[] =
    -S\t\tuse separate server processes (ircio)\n\
    -t\t\tdo not use termcap ti and te sequences at startup\n\
    -T\t\tuse termcap ti and te sequences at startup (default)\n\
+   --replay <file>\tparse the server lines saved in <file> without\n\
+\t\tconnecting, and write how long it took to stderr\n\
 Usage: icb [same switches]  (default to -icb)\n";
 
 /* irc_exit: cleans up and leaves */
@@ -492,7 +497,9 @@ parse_args(u_char **argv, int argc)
 	{
 		malloc_strcat(&args_str, arg);
 		malloc_strcat(&args_str, UP(" "));
-		if (*arg == '-')
+		if (my_strcmp(arg, "--replay") == 0)
+			replay_file = get_arg(empty_string(), argv[ac], &ac);
+		else if (*arg == '-')
 		{
 			minus_minus = parse_arg(arg+1, argv, &ac, &channel);
 			if (minus_minus)
@@ -671,15 +678,15 @@ input_pause(void)
  * it returns 0 if IO processing should continue and 1 if it should stop.
  */
 static	int
-irc_do_a_screen(Screen *screen, fd_set *rd) 
+irc_do_a_screen(Screen *screen) 
 {
 	if (!screen_get_alive(screen))
 		return 0;
 	set_current_screen(screen);
 	if (!is_main_screen(screen) &&
-	    FD_ISSET(screen_get_wserv_fd(screen), rd))
+	    (new_io_ready(screen_get_wserv_fd(screen)) & NEWIO_READ))
 		screen_wserv_message(screen);
-	if (FD_ISSET(screen_get_fdin(screen), rd))
+	if (new_io_ready(screen_get_fdin(screen)) & NEWIO_READ)
 	{
 		/* buffer much bigger than IRCD_BUFFER_SIZE */
 		u_char	lbuf[BIG_BUFFER_SIZE + 1];
@@ -693,6 +700,7 @@ irc_do_a_screen(Screen *screen, fd_set *rd)
 		if (term_basic())
 		{
 			int     old_timeout;
+			int	old_class;
 
 			old_timeout = dgets_timeout(1);
 			switch (dgets(lbuf, INPUT_BUFFER_SIZE, screen_get_fdin(screen)))
@@ -705,12 +713,14 @@ irc_do_a_screen(Screen *screen, fd_set *rd)
 			default:
 				(void) dgets_timeout(old_timeout);
 				*(lbuf + my_strlen(lbuf) - 1) = '\0';
+				old_class = server_set_send_class(SENDQ_USER);
 				if (get_int_var(INPUT_ALIASES_VAR))	
 					parse_line(NULL, lbuf,
 					    empty_string(), 1, 0, 0);
 				else
 					parse_line(NULL, lbuf,
 					    NULL, 1, 0, 0);
+				server_set_send_class(old_class);
 				break;
 			}
 		}
@@ -762,12 +772,13 @@ irc_do_a_screen(Screen *screen, fd_set *rd)
 void
 irc_io(void)
 {
-	fd_set	rd,
-		wd;
 	struct	timeval cursor_timeout,
 		clock_timeout,
 		right_away,
 		timer,
+		sendq,
+		race,
+		ping,
 		*timeptr;
 	int	hold_over;
 	Screen	*screen,
@@ -798,27 +809,30 @@ irc_io(void)
 	do
 	{
 		set_ctcp_was_crypted(0);
-		FD_ZERO(&rd);
-		FD_ZERO(&wd);
-		set_process_bits(&rd);
-		server_set_bits(&rd, &wd);
-		for (screen = screen_first(); screen; screen = screen_get_next(screen))
-			if (screen_get_alive(screen))
-			{
-				FD_SET(screen_get_fdin(screen), &rd);
-				if (!is_main_screen(screen))
-					FD_SET(screen_get_wserv_fd(screen), &rd);
-			}
-		set_dcc_bits(&rd, &wd);
 		term_check_refresh();
 		timer_timeout(&timer);
 		if (timer.tv_sec <= timeptr->tv_sec)
 			timeptr = &timer;
+		if (server_sendq_timeout(&sendq) &&
+		    (sendq.tv_sec < timeptr->tv_sec ||
+		     (sendq.tv_sec == timeptr->tv_sec &&
+		      sendq.tv_usec < timeptr->tv_usec)))
+			timeptr = &sendq;
+		if (server_race_timeout(&race) &&
+		    (race.tv_sec < timeptr->tv_sec ||
+		     (race.tv_sec == timeptr->tv_sec &&
+		      race.tv_usec < timeptr->tv_usec)))
+			timeptr = &race;
+		if (server_ping_timeout(&ping) &&
+		    (ping.tv_sec < timeptr->tv_sec ||
+		     (ping.tv_sec == timeptr->tv_sec &&
+		      ping.tv_usec < timeptr->tv_usec)))
+			timeptr = &ping;
 		if ((hold_over = unhold_windows()) != 0)
 			timeptr = &right_away;
 		Debug(DB_IRCIO, "irc_io: selecting with %ld:%ld timeout", timeptr->tv_sec,
 			(long)timeptr->tv_usec);
-		switch (new_select(&rd, &wd, timeptr))
+		switch (new_io_wait(timeptr))
 		{
 		case 0:
 		case -1:
@@ -858,21 +872,24 @@ irc_io(void)
 			term_check_refresh();
 			old_current_screen = get_current_screen();
 			set_current_screen(get_last_input_screen());
-			dcc_check(&rd, &wd);
-			do_server(&rd, &wd);
+			dcc_check();
+			do_server();
 			set_current_screen(old_current_screen);
 			for (screen = screen_first(); screen;
 			     screen = screen_get_next(screen))
-				if (irc_do_a_screen(screen, &rd))
+				if (irc_do_a_screen(screen))
 					irc_io_loop = 0;
 			set_current_screen(old_current_screen);
 			if (irc_io_loop)
-				do_processes(&rd);
+				do_processes();
 			break;
 		}
 		if (!irc_io_loop)
 			break;
 		execute_timer();
+		server_sendq_run();
+		server_race_run();
+		server_ping_run();
 		check_process_limits();
 		while (check_wait_status(-1) >= 0)
 			;
@@ -1060,6 +1077,11 @@ main(int argc, char *argv[], char *envp[])
 		load_ircrc();
 	}
 
+	if (replay_file)
+	{
+		server_replay(replay_file);
+		irc_exit();
+	}
 	get_connected(0);
 	if (channel)
 	{
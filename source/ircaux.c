@@ -85,6 +85,7 @@ new_free(void *iptr)
 
 #define WAIT_BUFFER 2048
 static u_char * wait_pointers[WAIT_BUFFER] = {0}, **current_wait_ptr = wait_pointers;
+static int wait_wrapped = 0;	/* every slot may be in use */
 
 /*
  * wait_new_free: same as new_free() except that free() is postponed.
@@ -96,22 +97,30 @@ wait_new_free(u_char **ptr)
 		new_free(current_wait_ptr);
 	*current_wait_ptr++ = *ptr;
 	if (current_wait_ptr >= wait_pointers + WAIT_BUFFER)
+	{
 		current_wait_ptr = wait_pointers;
+		wait_wrapped = 1;
+	}
 	*ptr = NULL;
 }
 
 /*
- * really_free: really free the data if level == 0
+ * really_free: really free the data if level == 0.  this is called
+ * after every hook, so only the slots used since last time are looked at.
  */
 void
 really_free(int level)
 {
+	u_char	**end;
+
 	if (level != 0)
 		return;
-	for (current_wait_ptr = wait_pointers; current_wait_ptr < wait_pointers + WAIT_BUFFER; current_wait_ptr++)
+	end = wait_wrapped ? wait_pointers + WAIT_BUFFER : current_wait_ptr;
+	for (current_wait_ptr = wait_pointers; current_wait_ptr < end; current_wait_ptr++)
 		if (*current_wait_ptr)
 			new_free(current_wait_ptr);
 	current_wait_ptr = wait_pointers;
+	wait_wrapped = 0;
 }
 
 void	*
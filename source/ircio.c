@@ -49,6 +49,7 @@ static	int	connect_to_unix(char *);
 
 	void	new_free(char **);
 	void	*new_malloc(size_t);
+	void	*new_realloc(void *, size_t);
 static	int	connect_by_number(char *, char *);
 	int	main(int, char *[], char *[]);
 
@@ -65,6 +66,19 @@ new_malloc(size_t size)
 	return (ptr);
 }
 
+void	*
+new_realloc(void *ptr, size_t size)
+{
+	void	*new_ptr;
+
+	if ((new_ptr = realloc(ptr, size)) == NULL)
+	{
+		printf("-1 0\n");
+		exit(1);
+	}
+	return (new_ptr);
+}
+
 /*
  * new_free:  Why do this?  Why not?  Saves me a bit of trouble here and
  * there 
@@ -92,6 +106,12 @@ ssl_read(SslInfo *info, int fd, void *buf, size_t buflen)
 	return read(fd, buf, buflen);
 }
 
+int
+ssl_pending(SslInfo *info)
+{
+	return 0;
+}
+
 /*
  * connect_by_number Performs a connecting to socket 'service' on host
  * 'host'.  Host can be a hostname or ip-address.  If 'host' is null, the
@@ -47,14 +47,89 @@ IRCII_RCSID("@(#)$eterna: names.c,v 1.135 2014/12/20 20:32:39 mrg Exp $");
 #include "notify.h"
 #include "vars.h"
 
+typedef struct nick_user_stru NickUser;
+
 /* NickList: structure for the list of nicknames of people on a channel */
 struct nick_stru
 {
-	NickList *next;		/* pointer to next nickname entry */
-	u_char	*nick;		/* nickname of person on channel */
+	NickList *next;		/* next entry, or next in the same slot of
+				 * the channel's nick_hash */
+	u_char	*nick;		/* nickname of person on channel; on a
+				 * channel, that of the NickUser */
 	int	chanop;		/* True if the given nick has chanop */
 	int	hasvoice;	/* Has voice? (Notice this is a bit
 				 * unreliable if chanop) */
+	u_char	*userhost;	/* user@host, if NAMES or JOIN said */
+	int	away;		/* set by AWAY, with away-notify, or by
+				 * WHO; -1 until one of them says */
+	ChannelList *chan;	/* the channel this entry is on */
+	NickUser *user;		/* the nick in its server's nick_index */
+	NickList *user_next;	/* the same nick on its next channel */
+};
+
+/*
+ * NickUser: a nick on one of our channels, with all its entries on that
+ * server's channels, so that QUIT and NICK need visit only those.  the
+ * entries share its copy of the nick, and lookups on a channel compare
+ * NickUser pointers rather than names.
+ */
+struct nick_user_stru
+{
+	NickUser *next;		/* next in the same slot of the index */
+	u_char	*nick;
+	unsigned hash;		/* nick_hash_name(nick) */
+	int	refs;		/* entries sharing nick */
+	NickList *chans;	/* its entries, by their user_next */
+	NickList **chans_tail;	/* the user_next of the last of them */
+};
+
+/*
+ * ChanHash: a server's channels, by channel_hash_name(), so that
+ * lookup_channel() need not walk them all.  the server's chan_list
+ * keeps them in order.
+ */
+struct chan_hash_stru
+{
+	ChannelList **hash;
+	unsigned size;		/* slots in hash, a power of 2 */
+	unsigned count;		/* channels in hash */
+};
+
+/* NickIndex: a server's NickUsers, by nick_hash_name() */
+struct nick_index_stru
+{
+	NickUser **hash;
+	unsigned size;		/* slots in hash, a power of 2 */
+	unsigned count;		/* NickUsers in hash */
+};
+
+/*
+ * UserhostCache: the user@host of nicks a server has told us about in
+ * message prefixes and WHO replies, whether or not they are on our
+ * channels, so that ignores and $userhost() need not ask.  it holds at
+ * most USERHOST_CACHE_MAX of them, dropping the least recently used.
+ */
+#define	USERHOST_CACHE_MAX	1024
+#define	USERHOST_CACHE_SLOTS	256	/* a power of 2 */
+
+typedef struct userhost_entry_stru UserhostEntry;
+
+struct userhost_entry_stru
+{
+	UserhostEntry *next;	/* next in the same slot of the cache */
+	UserhostEntry *newer;	/* in order of use, most recent first */
+	UserhostEntry *older;
+	u_char	*nick;
+	u_char	*userhost;
+	unsigned hash;		/* nick_hash_name(nick) */
+};
+
+struct userhost_cache_stru
+{
+	UserhostEntry *hash[USERHOST_CACHE_SLOTS];
+	UserhostEntry *newest;
+	UserhostEntry *oldest;
+	unsigned count;		/* entries in hash */
 };
 
 /* ChannelList: structure for the list of channels you are current on */
@@ -69,10 +144,27 @@ struct	channel_stru
 	u_char	*key;		/* key for this channel */
 	ChanListConnected connected;	/* connection status */
 	Window	*window;	/* the window that the channel is "on" */
-	NickList *nicks;	/* pointer to list of nicks on channel */
+	ChannelList *hash_next;	/* next in the same slot of the server's
+				 * chan_hash */
+	NickList **nick_hash;	/* nicks on the channel, by nick_hash_name() */
+	unsigned nick_hash_size;	/* slots in nick_hash, a power of 2 */
+	unsigned nick_count;	/* nicks in nick_hash */
+	u_char	*names;		/* NAMES nicks not yet added, until 366 */
+	size_t	names_len;
+	size_t	names_size;	/* bytes malloced for names */
 	ChanListStatus status;	/* different flags */
 };
 
+/* NamesEntry: a nick from NAMES or JOIN, for channel_set_nick() */
+typedef struct
+{
+	u_char	*nick;
+	u_char	*userhost;
+	int	chanop;
+	int	hasvoice;
+	int	atsign;		/* was "@nick", not a JOIN mode */
+} NamesEntry;
+
 /* from names.h */
 static	u_char	mode_str[] = MODE_STRING;
 
@@ -80,9 +172,36 @@ static	int	same_channel(ChannelList *, u_char *);
 static	void	free_channel(ChannelList **);
 static	void	show_channel(ChannelList *);
 static	void	clear_channel(ChannelList *);
+static	void	free_nick(NickList *);
+static	NickList *find_nick(u_char *, int);
+static	unsigned nick_hash_name(u_char *);
+static	NickList **nick_hash_slot(ChannelList *, NickUser *);
+static	NickList *nick_hash_find(ChannelList *, u_char *);
+static	void	nick_hash_unlink(ChannelList *, NickList *);
+static	void	nick_hash_add(ChannelList *, NickList *);
+static	void	nick_hash_grow(ChannelList *, unsigned);
+static	NickList **nick_hash_sorted(ChannelList *);
+static	unsigned channel_hash_name(u_char *);
+static	void	channel_hash_add(ChannelList *);
+static	void	channel_hash_remove(ChannelList *);
+static	void	channel_hash_free(int);
+static	NickList *channel_add_nick(ChannelList *, u_char *);
+static	void	channel_remove_nick(ChannelList *, NickList *);
+static	void	channel_free_nick(ChannelList *, NickList *);
+static	NickUser *nick_index_find(int, u_char *);
+static	void	nick_index_link(int, u_char *, NickList *);
+static	void	nick_index_unlink(int, NickList *);
+static	void	nick_index_rename(int, NickUser *, u_char *);
+static	UserhostEntry **userhost_cache_slot(UserhostCache *, u_char *);
+static	void	userhost_cache_unlink(UserhostCache *, UserhostEntry *);
+static	void	userhost_cache_use(UserhostCache *, UserhostEntry *);
+static	int	nick_fold_cmp(u_char *, u_char *);
+static	int	nick_compare(const void *, const void *);
+static	u_char	*names_nick(u_char *, int, NamesEntry *);
+static	void	channel_set_nick(ChannelList *, NamesEntry *);
 static	u_char	*recreate_mode(ChannelList *);
 static	int	decifer_mode(u_char *, u_long *, ChanListStatus *,
-			     NickList **, u_char **);
+			     ChannelList *, u_char **);
 static	int	switch_channels_backend(ChannelList *);
 
 /* clear_channel: erases all entries in a nick list for the given channel */
@@ -91,15 +210,405 @@ clear_channel(ChannelList *chan)
 {
 	NickList *tmp,
 		*next;
+	unsigned i;
+
+	for (i = 0; i < chan->nick_hash_size; i++)
+		for (tmp = chan->nick_hash[i]; tmp; tmp = next)
+		{
+			next = tmp->next;
+			channel_free_nick(chan, tmp);
+		}
+	new_free(&chan->nick_hash);
+	chan->nick_hash_size = 0;
+	chan->nick_count = 0;
+	new_free(&chan->names);
+	chan->names_len = 0;
+	chan->names_size = 0;
+	chan->status &= ~CHAN_NAMES;
+}
+
+/* free_nick: free a nick list entry and all it holds */
+static	void
+free_nick(NickList *nick)
+{
+	new_free(&nick->nick);
+	new_free(&nick->userhost);
+	new_free(&nick);
+}
+
+/*
+ * channel_add_nick: a new entry for nick on chan, which must not have
+ * it yet.
+ */
+static	NickList *
+channel_add_nick(ChannelList *chan, u_char *nick)
+{
+	NickList *new;
+
+	new = new_malloc(sizeof *new);
+	new->chanop = 0;
+	new->hasvoice = 0;
+	new->userhost = NULL;
+	new->away = -1;
+	new->chan = chan;
+	nick_index_link(chan->server, nick, new);
+	nick_hash_add(chan, new);
+	return new;
+}
+
+/* channel_remove_nick: take an entry off chan, and free it */
+static	void
+channel_remove_nick(ChannelList *chan, NickList *nick)
+{
+	nick_hash_unlink(chan, nick);
+	channel_free_nick(chan, nick);
+}
+
+/*
+ * channel_free_nick: free an entry that was on chan.  its nick is the
+ * NickUser's, which goes with the last entry sharing it.
+ */
+static	void
+channel_free_nick(ChannelList *chan, NickList *nick)
+{
+	nick_index_unlink(chan->server, nick);
+	new_free(&nick->userhost);
+	new_free(&nick);
+}
+
+/*
+ * find_nick: the entry for nick on the first of server's channels that
+ * has it, or NULL.
+ */
+static	NickList *
+find_nick(u_char *nick, int server)
+{
+	NickUser *user;
+
+	if ((user = nick_index_find(server, nick)) == NULL)
+		return NULL;
+	return user->chans;
+}
+
+/*
+ * nick_hash_name: the hash of a nick, folding case the way my_stricmp()
+ * does so that nicks it calls the same land in the same slot.
+ */
+static	unsigned
+nick_hash_name(u_char *nick)
+{
+	unsigned hash = 0;
 
-	for (tmp = chan->nicks; tmp; tmp = next)
+	for (; *nick; nick++)
+		hash = hash * 31 + (isalpha(*nick) ? (*nick | 32) : *nick);
+	return hash;
+}
+
+/*
+ * nick_hash_slot: the link in chan's nick_hash that points at user's
+ * entry, or the NULL at the end of the chain it would be on.  nick_hash
+ * must exist.
+ */
+static	NickList **
+nick_hash_slot(ChannelList *chan, NickUser *user)
+{
+	NickList **slot;
+
+	slot = &chan->nick_hash[user->hash & (chan->nick_hash_size - 1)];
+	for (; *slot; slot = &(*slot)->next)
+		if ((*slot)->user == user)
+			break;
+	return slot;
+}
+
+/* nick_hash_find: the entry for nick on chan, or NULL */
+static	NickList *
+nick_hash_find(ChannelList *chan, u_char *nick)
+{
+	NickUser *user;
+
+	if (chan->nick_count == 0 ||
+	    (user = nick_index_find(chan->server, nick)) == NULL)
+		return NULL;
+	return *nick_hash_slot(chan, user);
+}
+
+/* nick_hash_unlink: take nick, one of chan's entries, out of nick_hash */
+static	void
+nick_hash_unlink(ChannelList *chan, NickList *nick)
+{
+	NickList **slot;
+
+	slot = nick_hash_slot(chan, nick->user);
+	if (*slot == nick)
 	{
-		next = tmp->next;
-		new_free(&tmp->nick);
-		new_free(&tmp);
+		*slot = nick->next;
+		nick->next = NULL;
+		chan->nick_count--;
 	}
-	chan->nicks = NULL;
-	chan->status &= ~CHAN_NAMES;
+}
+
+/*
+ * nick_hash_add: put new, which has its NickUser, on chan, which must not
+ * have it yet.  the table doubles to keep the chains no longer than one
+ * on average.
+ */
+static	void
+nick_hash_add(ChannelList *chan, NickList *new)
+{
+	NickList **slot;
+
+	if (chan->nick_count >= chan->nick_hash_size)
+		nick_hash_grow(chan, chan->nick_count + 1);
+	slot = &chan->nick_hash[new->user->hash & (chan->nick_hash_size - 1)];
+	new->next = *slot;
+	*slot = new;
+	chan->nick_count++;
+}
+
+/*
+ * nick_hash_grow: make chan's nick_hash at least count slots, so as to
+ * hold count nicks.
+ */
+static	void
+nick_hash_grow(ChannelList *chan, unsigned count)
+{
+	NickList **old = chan->nick_hash,
+		**slot,
+		*tmp,
+		*next;
+	unsigned old_size = chan->nick_hash_size,
+		i;
+
+	if (count <= old_size)
+		return;
+	if (chan->nick_hash_size == 0)
+		chan->nick_hash_size = 16;
+	while (chan->nick_hash_size < count)
+		chan->nick_hash_size *= 2;
+	chan->nick_hash = new_malloc(chan->nick_hash_size *
+				     sizeof *chan->nick_hash);
+	memset(chan->nick_hash, 0,
+	       chan->nick_hash_size * sizeof *chan->nick_hash);
+	for (i = 0; i < old_size; i++)
+		for (tmp = old[i]; tmp; tmp = next)
+		{
+			next = tmp->next;
+			slot = &chan->nick_hash[tmp->user->hash &
+						(chan->nick_hash_size - 1)];
+			tmp->next = *slot;
+			*slot = tmp;
+		}
+	new_free(&old);
+}
+
+/* nick_index_find: the NickUser for nick on server, or NULL */
+static	NickUser *
+nick_index_find(int server, u_char *nick)
+{
+	NickIndex *index;
+	NickUser *user;
+	unsigned hash;
+
+	if (server < 0 || !nick || !(index = server_get_nick_index(server)))
+		return NULL;
+	hash = nick_hash_name(nick);
+	for (user = index->hash[hash & (index->size - 1)]; user;
+	     user = user->next)
+		if (user->hash == hash && !my_stricmp(user->nick, nick))
+			break;
+	return user;
+}
+
+/*
+ * nick_index_link: give new, which is on its chan on server, the NickUser
+ * for nick and its copy of the nick.  the NickUser is made if this is the
+ * first entry for nick.
+ */
+static	void
+nick_index_link(int server, u_char *nick, NickList *new)
+{
+	NickIndex *index;
+	NickUser *user,
+		**slot;
+
+	if ((user = nick_index_find(server, nick)) == NULL)
+	{
+		if ((index = server_get_nick_index(server)) == NULL)
+		{
+			index = new_malloc(sizeof *index);
+			index->hash = NULL;
+			index->size = 0;
+			index->count = 0;
+			server_set_nick_index(server, index);
+		}
+		if (index->count >= index->size)
+		{
+			NickUser **old = index->hash,
+				*tmp,
+				*next;
+			unsigned old_size = index->size,
+				i;
+
+			index->size = old_size ? old_size * 2 : 64;
+			index->hash = new_malloc(index->size * sizeof *index->hash);
+			memset(index->hash, 0, index->size * sizeof *index->hash);
+			for (i = 0; i < old_size; i++)
+				for (tmp = old[i]; tmp; tmp = next)
+				{
+					next = tmp->next;
+					slot = &index->hash[tmp->hash &
+							    (index->size - 1)];
+					tmp->next = *slot;
+					*slot = tmp;
+				}
+			new_free(&old);
+		}
+		user = new_malloc(sizeof *user);
+		user->nick = NULL;
+		malloc_strcpy(&user->nick, nick);
+		user->hash = nick_hash_name(user->nick);
+		user->refs = 0;
+		user->chans = NULL;
+		user->chans_tail = &user->chans;
+		slot = &index->hash[user->hash & (index->size - 1)];
+		user->next = *slot;
+		*slot = user;
+		index->count++;
+	}
+	/* at the end, so nick_channels() goes in the order they came */
+	new->user = user;
+	new->nick = user->nick;
+	new->user_next = NULL;
+	*user->chans_tail = new;
+	user->chans_tail = &new->user_next;
+	user->refs++;
+}
+
+/*
+ * nick_index_unlink: old, an entry on server, is going.  the NickUser
+ * goes with its last entry, and the index with its last NickUser.
+ */
+static	void
+nick_index_unlink(int server, NickList *old)
+{
+	NickIndex *index;
+	NickUser *user,
+		**slot;
+	NickList **np;
+
+	if ((user = old->user) == NULL)
+		return;
+	for (np = &user->chans; *np; np = &(*np)->user_next)
+		if (*np == old)
+		{
+			if ((*np = old->user_next) == NULL)
+				user->chans_tail = np;
+			break;
+		}
+	old->user = NULL;
+	old->user_next = NULL;
+	old->nick = NULL;
+	if (--user->refs > 0 ||
+	    (index = server_get_nick_index(server)) == NULL)
+		return;
+	for (slot = &index->hash[user->hash & (index->size - 1)];
+	     *slot; slot = &(*slot)->next)
+		if (*slot == user)
+		{
+			*slot = user->next;
+			break;
+		}
+	new_free(&user->nick);
+	new_free(&user);
+	if (--index->count == 0)
+	{
+		new_free(&index->hash);
+		new_free(&index);
+		server_set_nick_index(server, NULL);
+	}
+}
+
+/*
+ * nick_index_rename: user, on server, is now new_nick, which must not be
+ * another NickUser's.  the nick is changed once, for every entry sharing
+ * it, and they move to its new slot on each channel.
+ */
+static	void
+nick_index_rename(int server, NickUser *user, u_char *new_nick)
+{
+	NickIndex *index = server_get_nick_index(server);
+	NickUser **slot;
+	NickList *tmp;
+
+	for (tmp = user->chans; tmp; tmp = tmp->user_next)
+		nick_hash_unlink(tmp->chan, tmp);
+	for (slot = &index->hash[user->hash & (index->size - 1)];
+	     *slot; slot = &(*slot)->next)
+		if (*slot == user)
+		{
+			*slot = user->next;
+			break;
+		}
+	malloc_strcpy(&user->nick, new_nick);
+	user->hash = nick_hash_name(user->nick);
+	slot = &index->hash[user->hash & (index->size - 1)];
+	user->next = *slot;
+	*slot = user;
+	for (tmp = user->chans; tmp; tmp = tmp->user_next)
+	{
+		tmp->nick = user->nick;
+		nick_hash_add(tmp->chan, tmp);
+	}
+}
+
+/*
+ * nick_fold_cmp: compare two nicks, folding case like nick_hash_name().
+ * my_stricmp() is not a total order when letters meet other characters,
+ * so it will not do for sorting.
+ */
+static	int
+nick_fold_cmp(u_char *s1, u_char *s2)
+{
+	int	c1,
+		c2;
+
+	do
+	{
+		c1 = isalpha(*s1) ? (*s1 | 32) : *s1;
+		c2 = isalpha(*s2) ? (*s2 | 32) : *s2;
+		s1++, s2++;
+	} while (c1 && c1 == c2);
+	return c1 - c2;
+}
+
+/* nick_compare: qsort() helper for nick_hash_sorted() */
+static	int
+nick_compare(const void *a, const void *b)
+{
+	return nick_fold_cmp((*(NickList * const *) a)->nick,
+			     (*(NickList * const *) b)->nick);
+}
+
+/*
+ * nick_hash_sorted: a malloced, NULL terminated array of the nicks on
+ * chan, sorted by name, for showing them.
+ */
+static	NickList **
+nick_hash_sorted(ChannelList *chan)
+{
+	NickList **list,
+		*tmp;
+	unsigned i,
+		count = 0;
+
+	list = new_malloc((chan->nick_count + 1) * sizeof *list);
+	for (i = 0; i < chan->nick_hash_size; i++)
+		for (tmp = chan->nick_hash[i]; tmp; tmp = tmp->next)
+			list[count++] = tmp;
+	list[count] = NULL;
+	qsort((void *) list, count, sizeof *list, nick_compare);
+	return list;
 }
 
 /*
@@ -138,30 +647,130 @@ same_channel(ChannelList *chan, u_char	*channel)
 	return 0;
 }
 
+/*
+ * channel_hash_name: the hash of a channel name.  a !channel is hashed
+ * on its short name, without the "!" and its id or the "!!" we created
+ * it with, so that same_channel() finds the full name in the same slot.
+ */
+static	unsigned
+channel_hash_name(u_char *channel)
+{
+	if (*channel == '!')
+	{
+		if (channel[1] == '!')
+			channel += 2;
+		else if (my_strlen(channel) > 6)
+			channel += 6;
+	}
+	return nick_hash_name(channel);
+}
+
+/* channel_hash_add: put chan in its server's chan_hash */
+static	void
+channel_hash_add(ChannelList *chan)
+{
+	ChanHash *hash;
+	ChannelList **slot;
+
+	if (chan->server < 0)
+		return;
+	if ((hash = server_get_chan_hash(chan->server)) == NULL)
+	{
+		hash = new_malloc(sizeof *hash);
+		hash->hash = NULL;
+		hash->size = 0;
+		hash->count = 0;
+		server_set_chan_hash(chan->server, hash);
+	}
+	if (hash->count >= hash->size)
+	{
+		ChannelList **old = hash->hash,
+			*tmp,
+			*next;
+		unsigned old_size = hash->size,
+			i;
+
+		hash->size = old_size ? old_size * 2 : 16;
+		hash->hash = new_malloc(hash->size * sizeof *hash->hash);
+		memset(hash->hash, 0, hash->size * sizeof *hash->hash);
+		for (i = 0; i < old_size; i++)
+			for (tmp = old[i]; tmp; tmp = next)
+			{
+				next = tmp->hash_next;
+				slot = &hash->hash[channel_hash_name(tmp->channel) &
+						   (hash->size - 1)];
+				tmp->hash_next = *slot;
+				*slot = tmp;
+			}
+		new_free(&old);
+	}
+	slot = &hash->hash[channel_hash_name(chan->channel) & (hash->size - 1)];
+	chan->hash_next = *slot;
+	*slot = chan;
+	hash->count++;
+}
+
+/* channel_hash_remove: take chan out of its server's chan_hash */
+static	void
+channel_hash_remove(ChannelList *chan)
+{
+	ChanHash *hash;
+	ChannelList **slot;
+
+	if (chan->server < 0 || (hash = server_get_chan_hash(chan->server)) == NULL)
+		return;
+	for (slot = &hash->hash[channel_hash_name(chan->channel) &
+				(hash->size - 1)];
+	     *slot; slot = &(*slot)->hash_next)
+		if (*slot == chan)
+		{
+			*slot = chan->hash_next;
+			chan->hash_next = NULL;
+			hash->count--;
+			break;
+		}
+}
+
+/* channel_hash_free: forget server's chan_hash, as its channels go */
+static	void
+channel_hash_free(int server)
+{
+	ChanHash *hash;
+
+	if ((hash = server_get_chan_hash(server)) == NULL)
+		return;
+	new_free(&hash->hash);
+	new_free(&hash);
+	server_set_chan_hash(server, NULL);
+}
+
 ChannelList *
 lookup_channel(u_char *channel, int server, int do_unlink)
 {
 	ChannelList	*chan, *last = NULL;
+	ChanHash	*hash;
 
 	if (!channel || !*channel ||
 	    (server == -1 && (server = get_primary_server()) == -1))
 		return NULL;
-	chan = server_get_chan_list(server);
-	while (chan)
-	{
+	if ((hash = server_get_chan_hash(server)) == NULL)
+		return NULL;
+	for (chan = hash->hash[channel_hash_name(channel) & (hash->size - 1)];
+	     chan; chan = chan->hash_next)
 		if (chan->server == server && same_channel(chan, channel))
-		{
-			if (do_unlink == CHAN_UNLINK)
-			{
-				if (last)
-					last->next = chan->next;
-				else
-					server_set_chan_list(server, chan->next);
-			}
 			break;
-		}
-		last = chan;
-		chan = chan->next;
+	if (chan && do_unlink == CHAN_UNLINK)
+	{
+		ChannelList *tmp;
+
+		for (tmp = server_get_chan_list(server); tmp && tmp != chan;
+		     tmp = tmp->next)
+			last = tmp;
+		if (last)
+			last->next = chan->next;
+		else
+			server_set_chan_list(server, chan->next);
+		channel_hash_remove(chan);
 	}
 	return chan;
 }
@@ -194,7 +803,13 @@ add_channel(u_char *channel, u_char *key, int server, int connected,
 		new->key = 0;
 		if (key)
 			malloc_strcpy(&new->key, key);
-		new->nicks = NULL;
+		new->nick_hash = NULL;
+		new->nick_hash_size = 0;
+		new->nick_count = 0;
+		new->names = NULL;
+		new->names_len = 0;
+		new->names_size = 0;
+		new->server = server;
 		new->s_mode = empty_string();
 		malloc_strcpy(&new->channel, channel);
 		new->mode = 0;
@@ -205,6 +820,7 @@ add_channel(u_char *channel, u_char *key, int server, int connected,
 		full_list = server_get_chan_list(server);
 		add_to_list((List **)(void *)&full_list, (List *) new);
 		server_set_chan_list(server, full_list);
+		channel_hash_add(new);
 	}
 	else
 	{
@@ -275,7 +891,10 @@ rename_channel(u_char *oldchan, u_char *newchan, int server)
 	if (!new)
 		return;
 
+	/* the new name may hash to another slot */
+	channel_hash_remove(new);
 	malloc_strcpy(&new->channel, newchan);
+	channel_hash_add(new);
 	if (new->window)
 		set_channel_by_refnum(window_get_refnum(new->window), newchan);
 
@@ -284,66 +903,182 @@ rename_channel(u_char *oldchan, u_char *newchan, int server)
 	update_all_windows();
 }
 
+/*
+ * names_nick: fill in ent for nick, which may start with any of "@+",
+ * and may be nick!user@host as with the userhost-in-names capability,
+ * in which case the '!' is cut off.  returns the nick without them.
+ */
+static	u_char	*
+names_nick(u_char *nick, int server, NamesEntry *ent)
+{
+	u_char	*bang;
+
+	/* multi-prefix gives every mode the nick has, in any order */
+	for (;; nick++)
+	{
+		if (*nick == '+')
+			ent->hasvoice = 1;
+		else if (*nick == '@')
+			ent->chanop = ent->atsign = 1;
+		else
+			break;
+	}
+	if (server_get_version(server) != ServerICB &&
+	    (bang = my_index(nick, '!')))
+	{
+		*bang++ = '\0';
+		ent->userhost = bang;
+	}
+	return ent->nick = nick;
+}
+
+/*
+ * channel_set_nick: put the nick in ent on chan, or update the entry
+ * that is there.
+ */
+static	void
+channel_set_nick(ChannelList *chan, NamesEntry *ent)
+{
+	NickList *new;
+
+	if (ent->atsign && !my_stricmp(ent->nick, server_get_nickname(chan->server))
+	    && !((chan->status & CHAN_NAMES)
+		 && (chan->status & CHAN_MODE)))
+	{
+		u_char	*mode = recreate_mode(chan);
+
+		if (*mode)
+		{
+			int	old_server;
+
+			old_server = set_from_server(chan->server);
+			send_to_server("MODE %s %s",
+			    chan->channel, mode);
+			set_from_server(old_server);
+		}
+		chan->status |= CHAN_CHOP;
+	}
+
+	/* an entry already there keeps its user@host and away */
+	if ((new = nick_hash_find(chan, ent->nick)) == NULL)
+		new = channel_add_nick(chan, ent->nick);
+	else if (my_strcmp(new->nick, ent->nick) != 0)
+		nick_index_rename(chan->server, new->user, ent->nick);
+	new->chanop = ent->chanop;
+	new->hasvoice = ent->hasvoice;
+	if (ent->userhost)
+		malloc_strcpy(&(new->userhost), ent->userhost);
+}
+
 /*
  * add_to_channel: adds the given nickname to the given channel.  If the
  * nickname is already on the channel, nothing happens.  If the channel is
  * not on the channel list, nothing happens (although perhaps the channel
  * should be addded to the list?  but this should never happen) 
+ *
+ * nick may have the "@+" and "!user@host" that names_nick() takes off.
+ * otherwise userhost, if not NULL, is where the nick is from.
  */
 void
-add_to_channel(u_char *channel, u_char *nick, int server, int oper, int voice)
+add_to_channel(u_char *channel, u_char *nick, int server, int oper, int voice,
+	       u_char *userhost)
 {
-	NickList *new;
 	ChannelList *chan;
-	int	ischop = oper;
-	int	hasvoice = voice;
+	NamesEntry ent;
 
+	ent.chanop = oper;
+	ent.hasvoice = voice;
+	ent.atsign = 0;
+	ent.userhost = userhost;
+	nick = names_nick(nick, server, &ent);
 	if ((chan = lookup_channel(channel, server, CHAN_NOUNLINK)))
-	{
-		if (*nick == '+')
-		{
-			hasvoice = 1;
-			nick++;
-		}
-		if (*nick == '@')
-		{
-			nick++;
-			if (!my_stricmp(nick, server_get_nickname(server))
-			    && !((chan->status & CHAN_NAMES)
-				 && (chan->status & CHAN_MODE)))
-			{
-				u_char	*mode = recreate_mode(chan);
+		channel_set_nick(chan, &ent);
+	notify_mark(nick, 1, 0);
+}
 
-				if (*mode)
-				{
-					int	old_server;
+/*
+ * stage_channel_names: keep the nicks in line, from a NAMES reply for
+ * channel as we join it, until end_channel_names() adds them all at
+ * once.
+ */
+void
+stage_channel_names(u_char *channel, u_char *line, int server)
+{
+	ChannelList *chan;
+	size_t	len;
 
-					old_server = set_from_server(server);
-					send_to_server("MODE %s %s",
-					    chan->channel, mode);
-					set_from_server(old_server);
-				}
-				chan->status |= CHAN_CHOP;
-			}
-			ischop = 1;
-		}
+	if ((chan = lookup_channel(channel, server, CHAN_NOUNLINK)) == NULL ||
+	    (len = my_strlen(line)) == 0)
+		return;
+	if (chan->names_len + len + 2 > chan->names_size)
+	{
+		chan->names_size = chan->names_size ? chan->names_size * 2 :
+						      BIG_BUFFER_SIZE;
+		while (chan->names_len + len + 2 > chan->names_size)
+			chan->names_size *= 2;
+		chan->names = new_realloc(chan->names, chan->names_size);
+	}
+	if (chan->names_len)
+		chan->names[chan->names_len++] = ' ';
+	memmove(chan->names + chan->names_len, line, len + 1);
+	chan->names_len += len;
+}
 
-		if ((new = (NickList *)
-		     remove_from_list((List **)(void *)&(chan->nicks), nick)))
-		{
-			new_free(&new->nick);
-			new_free(&new);
-		}
-		new = new_malloc(sizeof *new);
-		new->nick = NULL;
-		new->chanop = ischop;
-		new->hasvoice = hasvoice;
-		malloc_strcpy(&(new->nick), nick);
-		add_to_list((List **)(void *)&(chan->nicks), (List *) new);
+/*
+ * end_channel_names: at the end of NAMES for channel, add the nicks that
+ * stage_channel_names() kept, in one pass.  nick_hash is made big enough
+ * for them all first, and a nick given twice just finds its entry the
+ * second time.  notify_mark_channel() then looks for each nick we NOTIFY
+ * on, rather than each nick being looked for in the notify list.
+ */
+void
+end_channel_names(u_char *channel, int server)
+{
+	ChannelList *chan;
+	NamesEntry ent;
+	u_char	*line,
+		*nick,
+		*s;
+	unsigned count;
+
+	if (!channel || (chan = lookup_channel(channel, server,
+					       CHAN_NOUNLINK)) == NULL ||
+	    chan->names == NULL)
+		return;
+	for (count = 1, s = chan->names; *s; s++)
+		if (*s == ' ')
+			count++;
+	nick_hash_grow(chan, chan->nick_count + count);
+	for (line = chan->names; (nick = next_arg(line, &line)) != NULL; )
+	{
+		ent.chanop = 0;
+		ent.hasvoice = 0;
+		ent.atsign = 0;
+		ent.userhost = NULL;
+		(void) names_nick(nick, server, &ent);
+		channel_set_nick(chan, &ent);
 	}
-	notify_mark(nick, 1, 0);
+	new_free(&chan->names);
+	chan->names_len = 0;
+	chan->names_size = 0;
+	notify_mark_channel(chan->channel, server);
 }
 
+/*
+ * channel_nick: the nick as channel has it, if nick is on channel, or
+ * NULL.
+ */
+u_char	*
+channel_nick(u_char *channel, int server, u_char *nick)
+{
+	ChannelList *chan;
+	NickList *tmp;
+
+	if ((chan = lookup_channel(channel, server, CHAN_NOUNLINK)) == NULL ||
+	    (tmp = nick_hash_find(chan, nick)) == NULL)
+		return NULL;
+	return tmp->nick;
+}
 
 /*
  * recreate_mode: converts the bitmap representation of a channels mode into
@@ -391,7 +1126,7 @@ recreate_mode(ChannelList *chan)
  */
 static	int
 decifer_mode(u_char *mode_string, u_long *mode, ChanListStatus *chop,
-	     NickList **nicks, u_char **key)
+	     ChannelList *chan, u_char **key)
 {
 	u_char	*limit = 0;
 	u_char	*person;
@@ -459,10 +1194,7 @@ decifer_mode(u_char *mode_string, u_long *mode, ChanListStatus *chop,
 				else
 					*chop &= ~CHAN_CHOP;
 			}
-			ThisNick = (NickList *)
-				list_lookup((List **)(void *)nicks, person,
-					    0, 0);
-			if (ThisNick)
+			if ((ThisNick = nick_hash_find(chan, person)))
 				ThisNick->chanop = add;
 			break;
 		case 'n':
@@ -485,10 +1217,7 @@ decifer_mode(u_char *mode_string, u_long *mode, ChanListStatus *chop,
 			break;
 		case 'v':
 			person = next_arg(rest, &rest);
-			ThisNick = (NickList *)
-				list_lookup((List **) nicks, person,
-					    0, 0);
-			if (ThisNick)
+			if ((ThisNick = nick_hash_find(chan, person)))
 				ThisNick->hasvoice = add;
 			break;
 		case 'b':
@@ -540,7 +1269,7 @@ update_channel_mode(u_char *channel, int server, u_char *mode)
 
 	if ((tmp = lookup_channel(channel, server, CHAN_NOUNLINK)) &&
 	    (limit = decifer_mode(mode, &tmp->mode, &tmp->status,
-				  &tmp->nicks, &tmp->key)) != -1)
+				  tmp, &tmp->key)) != -1)
 		tmp->limit = limit;
 }
 
@@ -604,6 +1333,7 @@ remove_channel(u_char *channel, int server)
 			free_channel(&tmp);
 		}
 		server_set_chan_list(server, NULL);
+		channel_hash_free(server);
 	}
 	update_all_windows();
 }
@@ -623,27 +1353,17 @@ remove_from_channel(u_char *channel, u_char *nick, int server)
 	{
 		if ((chan = lookup_channel(channel, server, CHAN_NOUNLINK)))
 		{
-			if ((tmp = (NickList *)
-				list_lookup((List **)(void *)&chan->nicks, nick,
-					    0, REMOVE_FROM_LIST)))
-			{
-				new_free(&tmp->nick);
-				new_free(&tmp);
-			}
+			if ((tmp = nick_hash_find(chan, nick)))
+				channel_remove_nick(chan, tmp);
 		}
 	}
 	else
 	{
-		for (chan = server_get_chan_list(server); chan; chan = chan->next)
-		{
-			if ((tmp = (NickList *)
-				list_lookup((List **)(void *)&chan->nicks, nick,
-					    0, REMOVE_FROM_LIST)))
-			{
-				new_free(&tmp->nick);
-				new_free(&tmp);
-			}
-		}
+		NickUser *user;
+
+		/* the NickUser goes with its last entry */
+		while ((user = nick_index_find(server, nick)) != NULL)
+			channel_remove_nick(user->chans->chan, user->chans);
 	}
 }
 
@@ -654,21 +1374,39 @@ remove_from_channel(u_char *channel, u_char *nick, int server)
 void
 rename_nick(u_char *old_nick, u_char *new_nick, int server)
 {
+	NickUser *user,
+		*other;
+	NickList *tmp,
+		*new;
 	ChannelList *chan;
-	NickList *tmp;
 
-	for (chan = server_get_chan_list(server); chan; chan = chan->next)
+	if ((user = nick_index_find(server, old_nick)) == NULL)
+		return;
+	if ((other = nick_index_find(server, new_nick)) == NULL ||
+	    other == user)
+	{
+		nick_index_rename(server, user, new_nick);
+		return;
+	}
+
+	/*
+	 * we have new_nick already.  move the old nick's entries to it,
+	 * except where a channel has an entry for new_nick, which wins.
+	 */
+	while ((user = nick_index_find(server, old_nick)) != NULL)
 	{
-		if ((chan->server == server) != 0)
+		tmp = user->chans;
+		chan = tmp->chan;
+		if (!nick_hash_find(chan, new_nick))
 		{
-			if ((tmp = (NickList *)
-				list_lookup((List **)(void *)&chan->nicks,
-					    old_nick, 0, 0)))
-			{
-				new_free(&tmp->nick);
-				malloc_strcpy(&tmp->nick, new_nick);
-			}
+			new = channel_add_nick(chan, new_nick);
+			new->chanop = tmp->chanop;
+			new->hasvoice = tmp->hasvoice;
+			new->userhost = tmp->userhost;
+			tmp->userhost = NULL;
+			new->away = tmp->away;
 		}
+		channel_remove_nick(chan, tmp);
 	}
 }
 
@@ -684,7 +1422,7 @@ is_on_channel(u_char *channel, int server, u_char *nick)
 
 	chan = lookup_channel(channel, server, CHAN_NOUNLINK);
 	if (chan && (chan->connected == CHAN_JOINED)
-	    && list_lookup((List **)(void *)&(chan->nicks), nick, 0, 0))
+	    && nick_hash_find(chan, nick))
 		return 1;
 	return 0;
 }
@@ -699,8 +1437,7 @@ is_chanop(u_char *channel, u_char *nick)
 	    chan->connected == CHAN_JOINED &&
 	    /* channel may be "surviving" from a disconnect/connect
 						check here too -Sol */
-	    (Nick = (NickList *) list_lookup((List **)(void *)&(chan->nicks),
-					     nick, 0, 0)) &&
+	    (Nick = nick_hash_find(chan, nick)) &&
 	    Nick->chanop)
 		return 1;
 	return 0;
@@ -717,17 +1454,231 @@ has_voice(u_char *channel, u_char *nick, int server)
 	    chan->connected == CHAN_JOINED &&
 		/* channel may be "surviving" from a disconnect/connect
 						   check here too -Sol */
-	    (Nick = (NickList *) list_lookup((List **)(void *)&(chan->nicks), nick,
-					     0, 0)) &&
+	    (Nick = nick_hash_find(chan, nick)) &&
 	    (Nick->chanop || Nick->hasvoice))
 		return 1;
 	return 0;
 }
 
+/*
+ * nick_userhost: the user@host of nick, if it is on one of our channels
+ * and NAMES or JOIN has said where it is from, or if server has shown it
+ * to us lately, or NULL.
+ */
+u_char	*
+nick_userhost(u_char *nick, int server)
+{
+	NickList *tmp;
+
+	if (!nick || !*nick)
+		return NULL;
+	if ((tmp = find_nick(nick, server)) != NULL && tmp->userhost)
+		return tmp->userhost;
+	return userhost_cache_find(server, nick);
+}
+
+/*
+ * userhost_cache_slot: the link in cache that points at the entry for
+ * nick, or the NULL at the end of the chain it would be on.
+ */
+static	UserhostEntry **
+userhost_cache_slot(UserhostCache *cache, u_char *nick)
+{
+	UserhostEntry **slot;
+	unsigned hash = nick_hash_name(nick);
+
+	slot = &cache->hash[hash & (USERHOST_CACHE_SLOTS - 1)];
+	for (; *slot; slot = &(*slot)->next)
+		if ((*slot)->hash == hash && !my_stricmp((*slot)->nick, nick))
+			break;
+	return slot;
+}
+
+/* userhost_cache_unlink: take entry out of the order of use */
 static	void
-show_channel(ChannelList *chan)
+userhost_cache_unlink(UserhostCache *cache, UserhostEntry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+	entry->newer = entry->older = NULL;
+}
+
+/* userhost_cache_use: make entry the most recently used */
+static	void
+userhost_cache_use(UserhostCache *cache, UserhostEntry *entry)
+{
+	if (cache->newest == entry)
+		return;
+	if (entry->newer || entry->older || cache->oldest == entry)
+		userhost_cache_unlink(cache, entry);
+	entry->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+}
+
+/*
+ * userhost_cache_add: remember that nick, on server, is userhost.  when
+ * the cache is full, the entry used longest ago makes way.
+ */
+void
+userhost_cache_add(int server, u_char *nick, u_char *userhost)
+{
+	UserhostCache *cache;
+	UserhostEntry *entry,
+		**slot;
+
+	if (server < 0 || !nick || !*nick || !userhost || !*userhost)
+		return;
+	if ((cache = server_get_userhost_cache(server)) == NULL)
+	{
+		cache = new_malloc(sizeof *cache);
+		memset(cache, 0, sizeof *cache);
+		server_set_userhost_cache(server, cache);
+	}
+	if ((entry = *(slot = userhost_cache_slot(cache, nick))) != NULL)
+	{
+		if (my_strcmp(entry->userhost, userhost))
+			malloc_strcpy(&entry->userhost, userhost);
+		userhost_cache_use(cache, entry);
+		return;
+	}
+	if (cache->count >= USERHOST_CACHE_MAX)
+	{
+		userhost_cache_remove(server, cache->oldest->nick);
+		slot = userhost_cache_slot(cache, nick);
+	}
+	entry = new_malloc(sizeof *entry);
+	entry->nick = NULL;
+	entry->userhost = NULL;
+	malloc_strcpy(&entry->nick, nick);
+	malloc_strcpy(&entry->userhost, userhost);
+	entry->hash = nick_hash_name(entry->nick);
+	entry->newer = entry->older = NULL;
+	entry->next = NULL;
+	*slot = entry;
+	cache->count++;
+	userhost_cache_use(cache, entry);
+}
+
+/* userhost_cache_find: the user@host server last showed for nick, or NULL */
+u_char	*
+userhost_cache_find(int server, u_char *nick)
+{
+	UserhostCache *cache;
+	UserhostEntry *entry;
+
+	if (server < 0 || !nick || !*nick ||
+	    (cache = server_get_userhost_cache(server)) == NULL ||
+	    (entry = *userhost_cache_slot(cache, nick)) == NULL)
+		return NULL;
+	userhost_cache_use(cache, entry);
+	return entry->userhost;
+}
+
+/*
+ * userhost_cache_rename: nick, on server, is now new_nick, as NICK says.
+ * whatever was cached for new_nick belonged to someone else, so it goes
+ * even if nothing was cached for nick.
+ */
+void
+userhost_cache_rename(int server, u_char *nick, u_char *new_nick)
+{
+	u_char	*userhost = NULL,
+		*old;
+
+	/* copied first, as new_nick may only differ from nick in case */
+	if ((old = userhost_cache_find(server, nick)) != NULL)
+		malloc_strcpy(&userhost, old);
+	userhost_cache_remove(server, new_nick);
+	if (userhost)
+	{
+		userhost_cache_remove(server, nick);
+		userhost_cache_add(server, new_nick, userhost);
+		new_free(&userhost);
+	}
+}
+
+/* userhost_cache_remove: forget nick on server, which has gone */
+void
+userhost_cache_remove(int server, u_char *nick)
+{
+	UserhostCache *cache;
+	UserhostEntry *entry,
+		**slot;
+
+	if (server < 0 || !nick ||
+	    (cache = server_get_userhost_cache(server)) == NULL ||
+	    (entry = *(slot = userhost_cache_slot(cache, nick))) == NULL)
+		return;
+	*slot = entry->next;
+	userhost_cache_unlink(cache, entry);
+	new_free(&entry->nick);
+	new_free(&entry->userhost);
+	new_free(&entry);
+	cache->count--;
+}
+
+/* userhost_cache_clear: forget everything server has told us */
+void
+userhost_cache_clear(int server)
+{
+	UserhostCache *cache;
+
+	if (server < 0 || (cache = server_get_userhost_cache(server)) == NULL)
+		return;
+	while (cache->newest)
+		userhost_cache_remove(server, cache->newest->nick);
+	new_free(&cache);
+	server_set_userhost_cache(server, NULL);
+}
+
+/*
+ * nick_set_away: note that nick, on server, has gone away or come back,
+ * as the AWAY lines from away-notify, or a WHO reply, say.
+ */
+void
+nick_set_away(u_char *nick, int server, int away)
+{
+	NickUser *user;
+	NickList *tmp;
+
+	if ((user = nick_index_find(server, nick)) != NULL)
+		for (tmp = user->chans; tmp; tmp = tmp->user_next)
+			tmp->away = away;
+}
+
+/*
+ * nick_is_away: 1 if nick is away, 0 if it is here, and -1 if it is on
+ * none of our channels or the server does not tell us.  away-notify only
+ * reports changes, so a nick that has not changed since we joined is -1
+ * as well, until a WHO reply says.
+ */
+int
+nick_is_away(u_char *nick, int server)
 {
 	NickList *tmp;
+
+	if (!(server_get_caps(server) & CAP_AWAY_NOTIFY) || !nick || !*nick ||
+	    (tmp = find_nick(nick, server)) == NULL)
+		return -1;
+	return tmp->away;
+}
+
+static	void
+show_channel(ChannelList *chan)
+{
+	NickList **list,
+		**lp,
+		*tmp;
 	int	buffer_len,
 		len;
 	u_char	*nicks = NULL;
@@ -737,7 +1688,8 @@ show_channel(ChannelList *chan)
 	s = recreate_mode(chan);
 	*buffer = (u_char) 0;
 	buffer_len = 0;
-	for (tmp = chan->nicks; tmp; tmp = tmp->next)
+	list = nick_hash_sorted(chan);
+	for (lp = list; (tmp = *lp); lp++)
 	{
 		len = my_strlen(tmp->nick);
 		if (buffer_len + len >= (sizeof(buffer) / 2))
@@ -752,6 +1704,7 @@ show_channel(ChannelList *chan)
 		my_strmcat(buffer, " ", sizeof buffer);
 		buffer_len += len + 1;
 	}
+	new_free(&list);
 	malloc_strcpy(&nicks, buffer);
 	say("\t%s +%s (%s): %s", chan->channel, s,
 	    server_get_name(chan->server), nicks);
@@ -865,9 +1818,17 @@ change_server_channels(int old, int new)
 		for (tmp = server_get_chan_list(old); tmp ;tmp = tmp->next)
 			tmp->server = new;
 		server_set_chan_list(new, server_get_chan_list(old));
+		server_set_nick_index(new, server_get_nick_index(old));
+		server_set_nick_index(old, NULL);
+		server_set_chan_hash(new, server_get_chan_hash(old));
+		server_set_chan_hash(old, NULL);
 	}
 	else
+	{
 		server_set_chan_list(new, NULL);
+		server_set_nick_index(new, NULL);
+		server_set_chan_hash(new, NULL);
+	}
 }
 
 void
@@ -888,6 +1849,7 @@ clear_channel_list(int server)
 		free_channel(&tmp);
 	}
 	server_set_chan_list(server, NULL);
+	channel_hash_free(server);
 	return;
 }
 
@@ -919,38 +1881,39 @@ reconnect_all_channels(int server)
 u_char	*
 what_channel(u_char *nick, int server)
 {
-	ChannelList *tmp;
+	NickList *tmp;
 	u_char *channel = window_get_current_channel(curr_scr_win);
 
 	if (channel && is_on_channel(channel, window_get_server(curr_scr_win),
 				     nick))
 		return channel;
 
-	for (tmp = server_get_chan_list(get_from_server()); tmp; tmp = tmp->next)
-		if (list_lookup((List **)(void *)&(tmp->nicks), nick,
-				0, 0))
-			return tmp->channel;
+	if ((tmp = find_nick(nick, get_from_server())))
+		return tmp->chan->channel;
 
 	return NULL;
 }
 
+/*
+ * nick_channels: the names of server's channels that nick is on, in the
+ * order that nick was added to them, separated by spaces, or NULL.  the
+ * nick_index means only those channels are looked at.  it is a copy, to
+ * be new_free()d by the caller, so that hooks run for each channel may
+ * part or kick the nick meanwhile.
+ */
 u_char	*
-walk_channels(u_char *nick, int init, int server)
-{
-	static	ChannelList *tmp = NULL;
-
-	if (server < 0)
-		server = get_from_server();
-	if (init)
-		tmp = server_get_chan_list(server);
-	else if (tmp)
-		tmp = tmp->next;
-	for (;tmp ; tmp = tmp->next)
-		if (tmp->server == server &&
-		    list_lookup((List **)(void *)&(tmp->nicks), nick,
-				0, 0))
-			return (tmp->channel);
-	return NULL;
+nick_channels(u_char *nick, int server)
+{
+	NickList *tmp;
+	u_char	*list = NULL;
+
+	for (tmp = find_nick(nick, server); tmp; tmp = tmp->user_next)
+	{
+		if (list)
+			malloc_strcat(&list, UP(" "));
+		malloc_strcat(&list, tmp->chan->channel);
+	}
+	return list;
 }
 
 int
@@ -1044,8 +2007,7 @@ free_nicks(Window *window)
 	for (tmp = nicks; tmp; tmp = next)
 	{
 		next = tmp->next;
-		new_free(&tmp->nick);
-		new_free(&tmp);
+		free_nick(tmp);
 	}
 }
 
@@ -1071,6 +2033,8 @@ nicks_add_to_window(Window *window, u_char *nick)
 	{
 		NickList *new = new_malloc(sizeof *new);
 		new->nick = NULL;
+		new->userhost = NULL;
+		new->away = 0;
 		malloc_strcpy(&new->nick, nick);
 		add_to_list((List **)(void *)nicks, (List *) new);
 		return 1;
@@ -1087,8 +2051,7 @@ nicks_remove_from_window(Window *window, u_char *nick)
 	if ((new = (NickList *)
 		remove_from_list((List **)(void *)nicks, nick)) != NULL)
 	{
-		new_free(&new->nick);
-		new_free(&new);
+		free_nick(new);
 		return 1;
 	}
 	return 0;
@@ -1098,28 +2061,33 @@ u_char	*
 function_chanusers(u_char *input)
 {
 	ChannelList	*chan;
-	NickList	*nicks;
-	u_char	*result = NULL;
+	NickList	**list,
+			**lp;
+	u_char	*result = NULL,
+		*s;
 	int	len = 0;
-	int	notfirst = 0;
 
 	chan = lookup_channel(input, get_from_server(), CHAN_NOUNLINK);
 	if (NULL == chan)
 		return NULL;
 
-	for (nicks = chan->nicks; nicks; nicks = nicks->next)
-		len += (my_strlen(nicks->nick) + 1);
+	list = nick_hash_sorted(chan);
+	for (lp = list; *lp; lp++)
+		len += (my_strlen((*lp)->nick) + 1);
 	result = new_malloc(len + 1);
 	*result = '\0';
 
-	for (nicks = chan->nicks; nicks; nicks = nicks->next)
+	/* my_strmcat() would walk the whole result for each nick */
+	for (s = result, lp = list; *lp; lp++)
 	{
-		if (notfirst)
-			my_strmcat(result, " ", len);
-		else
-			notfirst = 1;
-		my_strmcat(result, nicks->nick, len);
+		if (s != result)
+			*s++ = ' ';
+		len = my_strlen((*lp)->nick);
+		memmove(s, (*lp)->nick, len);
+		s += len;
 	}
+	*s = '\0';
+	new_free(&list);
 
 	return (result);
 }
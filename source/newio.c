@@ -46,7 +46,22 @@ IRCII_RCSID("@(#)$eterna: newio.c,v 1.70 2014/07/11 09:56:27 mrg Exp $");
 #include "assert.h"
 #include "debug.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif /* HAVE_POLL_H */
+
+/*
+ * each io_rec buffer starts out at IO_BUFFER_SIZE, which is also the
+ * longest line handed back.  a descriptor whose reads keep filling its
+ * buffer has it doubled, up to SET IO_BUFFER_MAX; one that has not been
+ * read from for SET IO_BUFFER_IDLE seconds has it shrunk back again, or
+ * freed if it is empty.
+ */
 #define IO_BUFFER_SIZE 4096
+#define IO_GROW_AFTER	2	/* full reads in a row before growing */
 
 #ifdef FDSETSIZE
 # define IO_ARRAYLEN FDSETSIZE
@@ -60,24 +75,144 @@ IRCII_RCSID("@(#)$eterna: newio.c,v 1.70 2014/07/11 09:56:27 mrg Exp $");
 
 typedef	struct	myio_struct
 {
-	char	buffer[IO_BUFFER_SIZE + 1];
+	char	*buffer;		/* size + 1 bytes, or NULL if idle */
+	size_t	size;
 	unsigned int	read_pos,
 			write_pos;
 	SslInfo	*ssl_info;
+	int	pending;		/* on the io_pending list */
+	int	buffered;		/* on the io_buffered list */
+	int	closed;			/* new_close()d while a view was held */
+	int	full_reads;		/* reads in a row that filled buffer */
+	time_t	last_used;		/* when it was last read into */
+	unsigned long	reads,		/* statistics for new_io_stats() */
+			bytes,
+			grows,
+			shrinks;
 } MyIO;
 
+/*
+ * lines handed out by dgets_view() point into the io_rec buffer, so while
+ * one is in use that buffer must not be compacted or freed, even if the
+ * line's handler ends up reading from (or closing) the same descriptor.
+ * each view is pushed here until dgets_view_release() pops it again.
+ */
+typedef	struct	io_hold_struct
+{
+	MyIO	*rec;
+	char	*buffer;
+} IOHold;
+
 #define IO_SOCKET 1
 
 static	struct	timeval	right_away = { 0L, 0L };
-static	MyIO	*io_rec[IO_ARRAYLEN];
+static	MyIO	**io_rec;
+static	int	io_rec_size;
+static	IOHold	*io_hold;
+static	int	io_hold_count;
+static	int	io_hold_size;
+
+/*
+ * the io_recs that have a buffer allocated, which are all io_reclaim()
+ * has to look at, and the earliest that any of them can next be due.
+ */
+static	MyIO	**io_buffered;
+static	int	io_buffered_count;
+static	int	io_buffered_size;
+static	time_t	io_reclaim_at;
 
 static	struct	timeval	dgets_timer;
 static	struct	timeval	*timer;
 static	int	dgets_separator = '\n';
 static	int	dgets_local_errno = 0;
 
+static	size_t	io_buffer_max = DEFAULT_IO_BUFFER_MAX;
+static	int	io_buffer_idle = DEFAULT_IO_BUFFER_IDLE;
+
+/*
+ * readiness state for new_io_wait().  io_events holds what each fd is
+ * registered for, io_revents what the last wait found ready.  the fds
+ * set in io_revents are kept on io_ready so they can be cleared without
+ * scanning every slot, and io_pending lists the fds that have unread
+ * data left over in their io_rec.
+ */
+static	u_char	*io_events;
+static	u_char	*io_revents;
+static	int	io_events_size;
+static	int	*io_ready;
+static	int	io_ready_count;
+static	int	*io_pending;
+static	int	io_pending_count;
+
+/*
+ * a readiness backend.  registrations persist in the backend, update()
+ * is told about each change as it happens, and wait() reports each ready
+ * fd via io_mark_ready().
+ */
+typedef struct io_backend
+{
+	const	char	*name;
+	int	(*init)(void);
+	void	(*update)(int, int, int);
+	int	(*wait)(int);
+} IOBackend;
+
+static	IOBackend	*io_backend;
+
 static	void	init_io(void);
 static	void	init_io_rec(int);
+static	void	io_grow_fd(int);
+static	void	io_mark_ready(int, int);
+static	void	io_note_pending(int);
+static	int	io_buffer_held(char *);
+static	void	io_buffered_add(MyIO *);
+static	void	io_buffered_remove(MyIO *);
+static	void	io_make_room(MyIO *);
+static	void	io_grow(MyIO *);
+static	int	io_reclaim(void);
+static	int	io_find_line(MyIO *, size_t *);
+static	int	io_kernel_poll(int, int, struct timeval *);
+static	int	io_fill(MyIO *, int);
+
+#ifdef HAVE_SYS_EPOLL_H
+static	int	epoll_io_init(void);
+static	void	epoll_io_update(int, int, int);
+static	int	epoll_io_wait(int);
+
+static	IOBackend	epoll_backend = {
+	"epoll", epoll_io_init, epoll_io_update, epoll_io_wait
+};
+#endif /* HAVE_SYS_EPOLL_H */
+
+#ifdef HAVE_POLL_H
+static	int	poll_io_init(void);
+static	void	poll_io_update(int, int, int);
+static	int	poll_io_wait(int);
+
+static	IOBackend	poll_backend = {
+	"poll", poll_io_init, poll_io_update, poll_io_wait
+};
+#endif /* HAVE_POLL_H */
+
+static	int	select_io_init(void);
+static	void	select_io_update(int, int, int);
+static	int	select_io_wait(int);
+
+static	IOBackend	select_backend = {
+	"select", select_io_init, select_io_update, select_io_wait
+};
+
+/* in order of preference; the first one that initialises is used */
+static	IOBackend	*io_backends[] = {
+#ifdef HAVE_SYS_EPOLL_H
+	&epoll_backend,
+#endif /* HAVE_SYS_EPOLL_H */
+#ifdef HAVE_POLL_H
+	&poll_backend,
+#endif /* HAVE_POLL_H */
+	&select_backend,
+	NULL
+};
 
 /*
  * dgets_timeout: does what you'd expect.  Sets a timeout in seconds for
@@ -123,7 +258,7 @@ dgets_set_ssl_info(int des, SslInfo *ssl_info)
 void
 dgets_clear_ssl_info(int des)
 {
-	if (io_rec[des])
+	if (des >= 0 && des < io_rec_size && io_rec[des])
 	{
 		Debug(DB_NEWIO, "fd %d was %p", des, io_rec[des]->ssl_info);
 		io_rec[des]->ssl_info = NULL;
@@ -137,30 +272,393 @@ init_io(void)
 
 	if (first)
 	{
-		int	c;
+		IOBackend	**b;
 
 		Debug(DB_NEWIO, "setting up");
-		for (c = 0; c < IO_ARRAYLEN; c++)
-			io_rec[c] = NULL;
+		io_rec = NULL;
+		io_rec_size = 0;
 		(void) dgets_timeout(-1);
+		for (b = io_backends; *b; b++)
+			if ((*b)->init() == 0)
+				break;
+		io_backend = *b ? *b : &select_backend;
+		Debug(DB_NEWIO, "using %s backend", io_backend->name);
 		first = 0;
 	}
 }
 
+/*
+ * io_grow_fd: make sure the per-fd arrays can hold des.  these grow on
+ * demand so descriptors beyond FD_SETSIZE work with the poll and epoll
+ * backends.
+ */
+static	void
+io_grow_fd(int des)
+{
+	int	newsize, i;
+
+	if (des < io_rec_size)
+		return;
+	for (newsize = io_rec_size ? io_rec_size : 64; newsize <= des; )
+		newsize *= 2;
+	io_rec = new_realloc(io_rec, newsize * sizeof(*io_rec));
+	io_events = new_realloc(io_events, newsize * sizeof(*io_events));
+	io_revents = new_realloc(io_revents, newsize * sizeof(*io_revents));
+	io_ready = new_realloc(io_ready, newsize * sizeof(*io_ready));
+	io_pending = new_realloc(io_pending, newsize * sizeof(*io_pending));
+	for (i = io_rec_size; i < newsize; i++)
+	{
+		io_rec[i] = NULL;
+		io_events[i] = 0;
+		io_revents[i] = 0;
+	}
+	io_rec_size = io_events_size = newsize;
+}
+
 static	void
-init_io_rec(des)
+init_io_rec(int des)
 {
 	init_io();
+	io_grow_fd(des);
 	if (io_rec[des] == NULL)
 	{
 		io_rec[des] = new_malloc(sizeof(MyIO));
+		io_rec[des]->buffer = NULL;
+		io_rec[des]->size = 0;
 		io_rec[des]->read_pos = 0;
 		io_rec[des]->write_pos = 0;
 		io_rec[des]->ssl_info = NULL;
+		io_rec[des]->pending = 0;
+		io_rec[des]->buffered = 0;
+		io_rec[des]->closed = 0;
+		io_rec[des]->full_reads = 0;
+		io_rec[des]->last_used = time(NULL);
+		io_rec[des]->reads = 0;
+		io_rec[des]->bytes = 0;
+		io_rec[des]->grows = 0;
+		io_rec[des]->shrinks = 0;
 		Debug(DB_NEWIO, "setting up io_rec[%d] = %p", des, io_rec[des]);
 	}
 }
 
+/*
+ * io_note_pending: remember that des has a complete line waiting in its
+ * io_rec, or data that SSL has already taken off the socket, so that
+ * new_io_wait() reports it as readable without asking the kernel (which
+ * would know nothing of it).  a partial line left by dgets_view() does
+ * not count on its own; more data must arrive before it is any use.
+ */
+static	void
+io_note_pending(int des)
+{
+	MyIO	*rec = io_rec[des];
+	size_t	len;
+
+	if (rec->pending ||
+	    (!io_find_line(rec, &len) && !ssl_pending(rec->ssl_info)))
+		return;
+	rec->pending = 1;
+	io_pending[io_pending_count++] = des;
+}
+
+/*
+ * io_buffer_held: is there a dgets_view() line still in use in buffer?
+ */
+static	int
+io_buffer_held(char *buffer)
+{
+	int	i;
+
+	for (i = 0; i < io_hold_count; i++)
+		if (io_hold[i].buffer == buffer)
+			return 1;
+	return 0;
+}
+
+/*
+ * io_buffered_add: rec has just been given a buffer, so io_reclaim()
+ * needs to look at it from now on.
+ */
+static	void
+io_buffered_add(MyIO *rec)
+{
+	time_t	due = time(NULL) + io_buffer_idle;
+
+	if (rec->buffered)
+		return;
+	if (io_buffered_count == io_buffered_size)
+	{
+		io_buffered_size = io_buffered_size ? io_buffered_size * 2 : 8;
+		io_buffered = new_realloc(io_buffered,
+		    io_buffered_size * sizeof(*io_buffered));
+	}
+	if (io_buffered_count == 0 || due < io_reclaim_at)
+		io_reclaim_at = due;
+	io_buffered[io_buffered_count++] = rec;
+	rec->buffered = 1;
+}
+
+static	void
+io_buffered_remove(MyIO *rec)
+{
+	int	i;
+
+	if (!rec->buffered)
+		return;
+	for (i = 0; i < io_buffered_count; i++)
+		if (io_buffered[i] == rec)
+		{
+			io_buffered[i] = io_buffered[--io_buffered_count];
+			break;
+		}
+	rec->buffered = 0;
+}
+
+/*
+ * io_make_room: move any partial line to the front of the buffer before
+ * reading more.  if a view is still using the buffer, leave it alone and
+ * only when it is completely full move the partial line into a new one;
+ * the old buffer is freed when the last view of it is released.  a
+ * buffer freed by io_reclaim() is allocated again here.
+ */
+static	void
+io_make_room(MyIO *rec)
+{
+	size_t	left;
+	char	*buffer;
+
+	if (rec->buffer == NULL)
+	{
+		rec->buffer = new_malloc(IO_BUFFER_SIZE + 1);
+		rec->size = IO_BUFFER_SIZE;
+		rec->read_pos = rec->write_pos = 0;
+		io_buffered_add(rec);
+		return;
+	}
+	if (rec->read_pos == 0)
+		return;
+	left = rec->write_pos - rec->read_pos;
+	if (!io_buffer_held(rec->buffer))
+	{
+		if (left)
+			memmove(rec->buffer, rec->buffer + rec->read_pos, left);
+	}
+	else if (rec->write_pos == rec->size)
+	{
+		buffer = new_malloc(rec->size + 1);
+		memcpy(buffer, rec->buffer + rec->read_pos, left);
+		rec->buffer = buffer;
+	}
+	else
+		return;
+	rec->read_pos = 0;
+	rec->write_pos = left;
+}
+
+/*
+ * io_grow: the last few reads have all filled the buffer, so double it,
+ * within SET IO_BUFFER_MAX.  a buffer that a view is still using is left
+ * for dgets_view_release() to free, as in io_make_room().
+ */
+static	void
+io_grow(MyIO *rec)
+{
+	size_t	size = rec->size * 2,
+		left;
+	char	*buffer;
+
+	if (size > io_buffer_max)
+		size = io_buffer_max;
+	if (size <= rec->size)
+		return;
+	if (io_buffer_held(rec->buffer))
+	{
+		left = rec->write_pos - rec->read_pos;
+		buffer = new_malloc(size + 1);
+		memcpy(buffer, rec->buffer + rec->read_pos, left);
+		rec->buffer = buffer;
+		rec->read_pos = 0;
+		rec->write_pos = left;
+	}
+	else
+		rec->buffer = new_realloc(rec->buffer, size + 1);
+	rec->size = size;
+	rec->grows++;
+	rec->full_reads = 0;
+}
+
+/*
+ * io_reclaim: give back the memory of buffers that have not been read
+ * into for SET IO_BUFFER_IDLE seconds.  empty ones are freed, and grown
+ * ones shrunk back to IO_BUFFER_SIZE if what they hold will fit.  only
+ * the io_buffered list is looked at, and only once io_reclaim_at has
+ * passed.  returns how many seconds until it is next due, or -1 if never.
+ * buffers that are in use, or hold data that will not fit, are looked at
+ * again after another IO_BUFFER_IDLE seconds.
+ */
+static	int
+io_reclaim(void)
+{
+	MyIO	*rec;
+	time_t	now,
+		due,
+		next = 0;
+	size_t	left;
+	int	i;
+
+	if (io_buffer_idle <= 0 || io_buffered_count == 0)
+		return -1;
+	now = time(NULL);
+	if (now < io_reclaim_at)
+		return io_reclaim_at - now;
+	for (i = 0; i < io_buffered_count; )
+	{
+		rec = io_buffered[i];
+		left = rec->write_pos - rec->read_pos;
+		if (io_buffer_held(rec->buffer) || (left != 0 &&
+		    (rec->size == IO_BUFFER_SIZE || left >= IO_BUFFER_SIZE)))
+			due = now + io_buffer_idle;
+		else if (now - rec->last_used < io_buffer_idle)
+			due = rec->last_used + io_buffer_idle;
+		else if (left == 0)
+		{
+			new_free(&rec->buffer);
+			rec->size = 0;
+			rec->read_pos = rec->write_pos = 0;
+			rec->full_reads = 0;
+			rec->shrinks++;
+			Debug(DB_NEWIO, "idle buffer %p freed", rec);
+			io_buffered[i] = io_buffered[--io_buffered_count];
+			rec->buffered = 0;
+			continue;
+		}
+		else
+		{
+			memmove(rec->buffer, rec->buffer + rec->read_pos, left);
+			rec->buffer = new_realloc(rec->buffer, IO_BUFFER_SIZE + 1);
+			rec->size = IO_BUFFER_SIZE;
+			rec->read_pos = 0;
+			rec->write_pos = left;
+			rec->full_reads = 0;
+			rec->shrinks++;
+			Debug(DB_NEWIO, "idle buffer %p shrunk", rec);
+			due = now + io_buffer_idle;
+		}
+		if (next == 0 || due < next)
+			next = due;
+		i++;
+	}
+	if (io_buffered_count == 0)
+		return -1;
+	io_reclaim_at = next;
+	return next - now;
+}
+
+/*
+ * io_find_line: if there is a complete line at read_pos, set len to its
+ * length including the separator and return 1.  IO_BUFFER_SIZE bytes
+ * without a separator are handed back as a line of their own, as dgets()
+ * always has, however big the buffer has grown.
+ */
+static	int
+io_find_line(MyIO *rec, size_t *len)
+{
+	char	*ptr, *sep;
+	size_t	left;
+
+	if (rec->read_pos >= rec->write_pos)
+		return 0;
+	ptr = rec->buffer + rec->read_pos;
+	left = rec->write_pos - rec->read_pos;
+	if ((sep = memchr(ptr, dgets_separator,
+			  left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE)) != NULL)
+	{
+		*len = sep - ptr + 1;
+		return 1;
+	}
+	if (left >= IO_BUFFER_SIZE)
+	{
+		*len = IO_BUFFER_SIZE;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * io_kernel_poll: like new_io_poll(), but only asks the kernel, and
+ * waits for des to become writable instead if write is set.
+ */
+static	int
+io_kernel_poll(int des, int write, struct timeval *time_out)
+{
+#ifdef HAVE_POLL_H
+	struct	pollfd	pfd;
+	int	ms = -1;
+
+	if (time_out)
+		ms = time_out->tv_sec * 1000 + (time_out->tv_usec + 999) / 1000;
+	pfd.fd = des;
+	pfd.events = write ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, ms);
+#else
+	fd_set	fds;
+
+	FD_ZERO(&fds);
+	FD_SET(des, &fds);
+	if (write)
+		return select(des + 1, 0, &fds, 0, time_out);
+	return select(des + 1, &fds, 0, 0, time_out);
+#endif /* HAVE_POLL_H */
+}
+
+/*
+ * io_fill: wait (see dgets_timeout()) for des and read what it has onto
+ * the end of the buffer.  returns 1 if something was read, -1 on timeout,
+ * 0 on EOF or error and -2 for SSL retry, with dgets_local_errno set.
+ */
+static	int
+io_fill(MyIO *rec, int des)
+{
+	ssize_t	c;
+	size_t	room;
+
+	io_make_room(rec);
+	if (rec->full_reads >= IO_GROW_AFTER)
+		io_grow(rec);
+	/* what SSL holds already would not wake up the kernel poll */
+	if (!ssl_pending(rec->ssl_info) && io_kernel_poll(des, 0, timer) == 0)
+	{
+		dgets_local_errno = 0;
+		return -1;
+	}
+	room = rec->size - rec->write_pos;
+	c = ssl_read(rec->ssl_info, des, rec->buffer + rec->write_pos, room);
+	if (c > 0)
+	{
+		rec->reads++;
+		rec->bytes += c;
+		rec->last_used = time(NULL);
+		if ((size_t)c == room)
+			rec->full_reads++;
+		else
+			rec->full_reads = 0;
+	}
+	if (c <= 0)
+	{
+		if (c == -2 ||
+		    (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+			return -2;
+		if (c == 0)
+			dgets_local_errno = -1;
+		else
+			dgets_local_errno = errno;
+		return 0;
+	}
+	rec->write_pos += c;
+	return 1;
+}
+
 /*
  * dgets: works much like fgets except on descriptor rather than file
  * pointers.  Returns the number of character read in.  Returns 0 on EOF and
@@ -169,13 +667,12 @@ init_io_rec(des)
 int
 dgets(u_char *str, size_t len, int des)
 {
-	char	*ptr;
-	size_t	cnt = 0;
-	ssize_t	c;
-	fd_set	rd;
+	char	*ptr, *sep;
+	size_t	cnt = 0, n;
+	int	rv;
 	MyIO	*rec;
 
-	if (des >= IO_ARRAYLEN)
+	if (des < 0)
 	{
 		dgets_local_errno = EINVAL;
 		return -1;
@@ -188,47 +685,192 @@ dgets(u_char *str, size_t len, int des)
 	{
 		if (rec->read_pos == rec->write_pos)
 		{
-			rec->read_pos = 0;
-			rec->write_pos = 0;
-			FD_ZERO(&rd);
-			FD_SET(des, &rd);
-			switch (select(des + 1, &rd, 0, 0, timer))
+			switch (rv = io_fill(rec, des))
 			{
-			case 0:
+			case 1:
+				break;
+			case -1:
 				str[cnt] = (char) 0;
-				dgets_local_errno = 0;
-				return (-1);
+				/* FALLTHROUGH */
 			default:
-				c = ssl_read(rec->ssl_info, des, rec->buffer,
-					     sizeof(rec->buffer));
-				if (c <= 0)
-				{
-					if (c == -2)
-						return -2;
-					if (c == 0)
-						dgets_local_errno = -1;
-					else
-						dgets_local_errno = errno;
-					return 0;
-				}
-				rec->write_pos += c;
-				break;
+				return rv;
 			}
 		}
-		ptr = rec->buffer;
-		while (rec->read_pos < rec->write_pos)
+		ptr = rec->buffer + rec->read_pos;
+		n = rec->write_pos - rec->read_pos;
+		if (n > len - 1 - cnt)
+			n = len - 1 - cnt;
+		if ((sep = memchr(ptr, dgets_separator, n)) != NULL)
+			n = sep - ptr + 1;
+		memcpy(str + cnt, ptr, n);
+		cnt += n;
+		rec->read_pos += n;
+		if (sep || cnt == len - 1)
 		{
-			char ch = str[cnt++] = ptr[(rec->read_pos)++];
-			if (ch == (char)dgets_separator || cnt == len)
-			{
-				dgets_local_errno = 0;
-				str[cnt] = (char) 0;
-				return (cnt);
-			}
+			dgets_local_errno = 0;
+			str[cnt] = (char) 0;
+			io_note_pending(des);
+			return (cnt);
 		}
 	}
 }
 
+/*
+ * dgets_view: like dgets(), but rather than copying the line out, set
+ * line and len to point at it inside the descriptor's buffer.  the
+ * separator is replaced with a nul and not counted in len.  returns the
+ * number of bytes used up (so > 0 even for an empty line), or as dgets()
+ * for EOF, SSL retry and timeout; on timeout the partial line read so far
+ * is pointed to, but is kept and returned again once it is complete.
+ *
+ * a returned line stays valid, and must be given back with
+ * dgets_view_release(), even if des is read from or closed meanwhile.
+ * views must be released in the reverse order they were taken.
+ */
+int
+dgets_view(int des, u_char **line, size_t *len)
+{
+	MyIO	*rec;
+	char	*ptr,
+		*buffer;
+	size_t	n;
+	int	rv;
+
+	*line = NULL;
+	*len = 0;
+	if (des < 0)
+	{
+		dgets_local_errno = EINVAL;
+		return -1;
+	}
+	init_io_rec(des);
+
+	rec = io_rec[des];
+
+	while (!io_find_line(rec, &n))
+	{
+		if ((rv = io_fill(rec, des)) == 1)
+			continue;
+		if (rv == -1)
+		{
+			rec->buffer[rec->write_pos] = '\0';
+			*line = UP(rec->buffer + rec->read_pos);
+			*len = rec->write_pos - rec->read_pos;
+		}
+		return rv;
+	}
+	buffer = rec->buffer;
+	ptr = rec->buffer + rec->read_pos;
+	rec->read_pos += n;
+	if (ptr[n - 1] == (char)dgets_separator)
+		*len = n - 1;
+	else
+	{
+		*len = n;
+		/*
+		 * an over-long line; what follows it must not be
+		 * overwritten by the nul, so hand back a copy.
+		 */
+		if (rec->read_pos < rec->write_pos)
+		{
+			buffer = new_malloc(n + 1);
+			memcpy(buffer, ptr, n);
+			ptr = buffer;
+		}
+	}
+	ptr[*len] = '\0';
+	*line = UP(ptr);
+
+	if (io_hold_count == io_hold_size)
+	{
+		io_hold_size = io_hold_size ? io_hold_size * 2 : 8;
+		io_hold = new_realloc(io_hold, io_hold_size * sizeof(*io_hold));
+	}
+	io_hold[io_hold_count].rec = rec;
+	io_hold[io_hold_count].buffer = buffer;
+	io_hold_count++;
+
+	dgets_local_errno = 0;
+	io_note_pending(des);
+	return (int)n;
+}
+
+/*
+ * dgets_view_release: finished with the last line from dgets_view().
+ */
+void
+dgets_view_release(void)
+{
+	IOHold	*hold;
+	int	i;
+
+	if (io_hold_count == 0)
+		return;
+	hold = &io_hold[--io_hold_count];
+	if (hold->buffer != hold->rec->buffer && !io_buffer_held(hold->buffer))
+		new_free(&hold->buffer);
+	if (hold->rec->closed)
+	{
+		for (i = 0; i < io_hold_count; i++)
+			if (io_hold[i].rec == hold->rec)
+				return;
+		new_free(&hold->rec->buffer);
+		new_free(&hold->rec);
+	}
+}
+
+/*
+ * dgets_view_discard: throw away the partial line that dgets_view() last
+ * returned with a timeout, for callers that have used it up themselves.
+ */
+void
+dgets_view_discard(int des)
+{
+	if (des >= 0 && des < io_rec_size && io_rec[des])
+		io_rec[des]->read_pos = io_rec[des]->write_pos;
+}
+
+/*
+ * dgets_buffered: returns 1 if a complete line, as dgets() would return
+ * it, is already sitting in the io_rec for des; ie, the next dgets() will
+ * not need to go to the kernel.  data still held by SSL does not count, as
+ * it may be only part of a line; new_io_wait() comes back for it instead.
+ */
+int
+dgets_buffered(int des)
+{
+	size_t	len;
+
+	if (des < 0 || des >= io_rec_size || io_rec[des] == NULL)
+		return 0;
+	return io_find_line(io_rec[des], &len);
+}
+
+/*
+ * new_io_poll: wait up to time_out (or forever if it is NULL) for des
+ * to become readable, without touching the registrations.  returns like
+ * select(); buffered data counts as readable.
+ */
+int
+new_io_poll(int des, struct timeval *time_out)
+{
+	if (des >= 0 && des < io_rec_size && io_rec[des] &&
+	    (io_rec[des]->read_pos < io_rec[des]->write_pos ||
+	     ssl_pending(io_rec[des]->ssl_info)))
+		return 1;
+	return io_kernel_poll(des, 0, time_out);
+}
+
+/*
+ * new_io_poll_write: wait up to time_out (or forever if it is NULL) for
+ * des to become writable.  returns like select().
+ */
+int
+new_io_poll_write(int des, struct timeval *time_out)
+{
+	return io_kernel_poll(des, 1, time_out);
+}
+
 /*
  * new_select: works just like select(), execpt I trimmed out the excess
  * parameters I didn't need.  
@@ -256,7 +898,9 @@ new_select(fd_set *rd, fd_set *wd, struct timeval *time_out)
 	{
 		if (i > max_fd && ((rd && FD_ISSET(i, rd)) || (wd && FD_ISSET(i, wd))))
 			max_fd = i;
-		if (io_rec[i] && io_rec[i]->read_pos < io_rec[i]->write_pos)
+		if (i < io_rec_size && io_rec[i] &&
+		    (io_rec[i]->read_pos < io_rec[i]->write_pos ||
+		     ssl_pending(io_rec[i]->ssl_info)))
 		{
 			FD_SET(i, &new);
 			set = 1;
@@ -282,13 +926,430 @@ new_select(fd_set *rd, fd_set *wd, struct timeval *time_out)
 	return (select(max_fd + 1, rd, wd, NULL, newtimeout));
 }
 
+/*
+ * new_io_register: set the events (NEWIO_READ and/or NEWIO_WRITE) that
+ * new_io_wait() should watch des for.  an events of 0 removes des.  the
+ * registration persists until it is changed, or des is new_close()d.
+ */
+void
+new_io_register(int des, int events)
+{
+	int	old;
+
+	if (des < 0)
+		return;
+	init_io();
+	io_grow_fd(des);
+	old = io_events[des];
+	if (old == events)
+		return;
+	Debug(DB_NEWIO, "fd %d events %d -> %d", des, old, events);
+	io_events[des] = events;
+	io_revents[des] &= events;
+	io_backend->update(des, old, events);
+}
+
+/*
+ * new_io_wait: wait for any registered descriptor to become ready, or
+ * for time_out to pass.  it returns like select(), and afterwards
+ * new_io_ready() tells the caller which descriptors are ready.  fds that
+ * still have a complete line in their io_rec, or data held by SSL, are
+ * always ready.
+ */
+int
+new_io_wait(struct timeval *time_out)
+{
+	int	i, j, ms, rv,
+		reclaim;
+
+	init_io();
+	reclaim = io_reclaim();
+	while (io_ready_count > 0)
+		io_revents[io_ready[--io_ready_count]] = 0;
+
+	for (i = j = 0; i < io_pending_count; i++)
+	{
+		int	des = io_pending[i];
+		MyIO	*rec = des < io_rec_size ? io_rec[des] : NULL;
+		size_t	len;
+
+		/* as io_note_pending(): a partial line alone is not ready */
+		if (rec && (io_find_line(rec, &len) ||
+			    ssl_pending(rec->ssl_info)))
+		{
+			io_pending[j++] = des;
+			if (io_events[des] & NEWIO_READ)
+				io_mark_ready(des, NEWIO_READ);
+		}
+		else if (rec)
+			rec->pending = 0;
+	}
+	io_pending_count = j;
+
+	if (io_ready_count)
+		ms = 0;
+	else if (time_out)
+		ms = time_out->tv_sec * 1000 + (time_out->tv_usec + 999) / 1000;
+	else
+		ms = -1;
+	/* wake up in time to reclaim the next idle buffer */
+	if (reclaim != -1 && (ms == -1 || ms > reclaim * 1000))
+		ms = reclaim * 1000;
+	rv = io_backend->wait(ms);
+	if (rv < 0 && io_ready_count == 0)
+		return rv;
+	return io_ready_count;
+}
+
+/* new_io_ready: the events that the last new_io_wait() found for des */
+int
+new_io_ready(int des)
+{
+	if (des < 0 || des >= io_events_size)
+		return 0;
+	return io_revents[des];
+}
+
+/* new_io_backend: the name of the readiness backend in use */
+const char *
+new_io_backend(void)
+{
+	init_io();
+	return io_backend->name;
+}
+
+/*
+ * new_io_set_buffer_max: the most that a descriptor's buffer may grow
+ * to; never less than IO_BUFFER_SIZE.
+ */
+void
+new_io_set_buffer_max(int size)
+{
+	io_buffer_max = size < IO_BUFFER_SIZE ? IO_BUFFER_SIZE : size;
+}
+
+/*
+ * new_io_set_buffer_idle: how many seconds a descriptor may go unread
+ * before its buffer is shrunk or freed.  0 never does.
+ */
+void
+new_io_set_buffer_idle(int secs)
+{
+	io_buffer_idle = secs;
+	io_reclaim_at = 0;
+}
+
+/*
+ * new_io_stats: fill in stats for des.  returns -1 if des has never
+ * been read with dgets().
+ */
+int
+new_io_stats(int des, IOStats *stats)
+{
+	MyIO	*rec;
+
+	if (des < 0 || des >= io_rec_size || (rec = io_rec[des]) == NULL)
+		return -1;
+	stats->size = rec->size;
+	stats->used = rec->write_pos - rec->read_pos;
+	stats->reads = rec->reads;
+	stats->bytes = rec->bytes;
+	stats->grows = rec->grows;
+	stats->shrinks = rec->shrinks;
+	stats->idle = time(NULL) - rec->last_used;
+	return 0;
+}
+
+/*
+ * new_io_stats_next: the first descriptor after des that new_io_stats()
+ * knows about, or -1.  start with des -1.
+ */
+int
+new_io_stats_next(int des)
+{
+	for (des++; des >= 0 && des < io_rec_size; des++)
+		if (io_rec[des])
+			return des;
+	return -1;
+}
+
+static	void
+io_mark_ready(int des, int events)
+{
+	if (des < 0 || des >= io_events_size)
+		return;
+	events &= io_events[des];
+	if (events == 0)
+		return;
+	if (io_revents[des] == 0)
+		io_ready[io_ready_count++] = des;
+	io_revents[des] |= events;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * the epoll backend.  the epoll instance is inherited by our children,
+ * and changes made there would be made for us too, so only the process
+ * that created it may touch it.
+ */
+static	int	epoll_fd = -1;
+static	pid_t	epoll_pid;
+static	struct	epoll_event	*epoll_events;
+static	int	epoll_nevents;
+
+static	int
+epoll_io_init(void)
+{
+	if ((epoll_fd = epoll_create(64)) < 0)
+		return -1;
+	(void) fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+	epoll_pid = getpid();
+	epoll_nevents = 64;
+	epoll_events = new_malloc(epoll_nevents * sizeof(*epoll_events));
+	return 0;
+}
+
+static	void
+epoll_io_update(int des, int old, int events)
+{
+	struct	epoll_event ev;
+	int	op;
+
+	if (epoll_pid != getpid())
+		return;
+	memset(&ev, 0, sizeof ev);
+	ev.data.fd = des;
+	if (events & NEWIO_READ)
+		ev.events |= EPOLLIN;
+	if (events & NEWIO_WRITE)
+		ev.events |= EPOLLOUT;
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (old == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	if (epoll_ctl(epoll_fd, op, des, &ev) < 0)
+	{
+		Debug(DB_NEWIO, "epoll_ctl(%d, fd %d) failed: %s", op, des,
+		    strerror(errno));
+	}
+}
+
+static	int
+epoll_io_wait(int ms)
+{
+	int	n, i;
+
+	n = epoll_wait(epoll_fd, epoll_events, epoll_nevents, ms);
+	for (i = 0; i < n; i++)
+	{
+		int	events = 0;
+
+		if (epoll_events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			events |= NEWIO_READ;
+		if (epoll_events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+			events |= NEWIO_WRITE;
+		io_mark_ready(epoll_events[i].data.fd, events);
+	}
+	if (n == epoll_nevents)
+	{
+		epoll_nevents *= 2;
+		epoll_events = new_realloc(epoll_events,
+		    epoll_nevents * sizeof(*epoll_events));
+	}
+	return n;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+#ifdef HAVE_POLL_H
+/*
+ * the poll backend keeps a dense pollfd array, and poll_slot maps each
+ * fd to its place in it, so updates are O(1).
+ */
+static	struct	pollfd	*poll_fds;
+static	int	poll_nfds;
+static	int	poll_size;
+static	int	*poll_slot;
+static	int	poll_slot_size;
+
+static	int
+poll_io_init(void)
+{
+	return 0;
+}
+
+static	void
+poll_io_update(int des, int old, int events)
+{
+	int	i;
+
+	if (des >= poll_slot_size)
+	{
+		int	newsize = io_events_size;
+
+		poll_slot = new_realloc(poll_slot, newsize * sizeof(*poll_slot));
+		for (i = poll_slot_size; i < newsize; i++)
+			poll_slot[i] = -1;
+		poll_slot_size = newsize;
+	}
+	if ((i = poll_slot[des]) == -1)
+	{
+		if (events == 0)
+			return;
+		if (poll_nfds == poll_size)
+		{
+			poll_size = poll_size ? poll_size * 2 : 16;
+			poll_fds = new_realloc(poll_fds,
+			    poll_size * sizeof(*poll_fds));
+		}
+		i = poll_slot[des] = poll_nfds++;
+		poll_fds[i].fd = des;
+	}
+	if (events == 0)
+	{
+		poll_slot[des] = -1;
+		if (i != --poll_nfds)
+		{
+			poll_fds[i] = poll_fds[poll_nfds];
+			poll_slot[poll_fds[i].fd] = i;
+		}
+		return;
+	}
+	poll_fds[i].events = 0;
+	if (events & NEWIO_READ)
+		poll_fds[i].events |= POLLIN;
+	if (events & NEWIO_WRITE)
+		poll_fds[i].events |= POLLOUT;
+	poll_fds[i].revents = 0;
+}
+
+static	int
+poll_io_wait(int ms)
+{
+	int	n, i, found;
+
+	n = poll(poll_fds, poll_nfds, ms);
+	for (i = found = 0; n > 0 && i < poll_nfds && found < n; i++)
+	{
+		int	events = 0;
+		short	rev = poll_fds[i].revents;
+
+		if (rev == 0)
+			continue;
+		found++;
+		if (rev & POLLNVAL)
+		{
+			/* closed behind our back; forget it */
+			new_io_register(poll_fds[i--].fd, 0);
+			continue;
+		}
+		if (rev & (POLLIN|POLLHUP|POLLERR))
+			events |= NEWIO_READ;
+		if (rev & (POLLOUT|POLLHUP|POLLERR))
+			events |= NEWIO_WRITE;
+		io_mark_ready(poll_fds[i].fd, events);
+	}
+	return n;
+}
+#endif /* HAVE_POLL_H */
+
+/*
+ * the select backend, for systems with neither of the above.  it is
+ * limited to FD_SETSIZE descriptors.
+ */
+static	fd_set	select_rd, select_wd;
+static	int	select_max_fd = -1;
+
+static	int
+select_io_init(void)
+{
+	FD_ZERO(&select_rd);
+	FD_ZERO(&select_wd);
+	return 0;
+}
+
+static	void
+select_io_update(int des, int old, int events)
+{
+	if (des >= IO_ARRAYLEN)
+		return;
+	FD_CLR(des, &select_rd);
+	FD_CLR(des, &select_wd);
+	if (events & NEWIO_READ)
+		FD_SET(des, &select_rd);
+	if (events & NEWIO_WRITE)
+		FD_SET(des, &select_wd);
+	if (events && des > select_max_fd)
+		select_max_fd = des;
+}
+
+static	int
+select_io_wait(int ms)
+{
+	fd_set	rd = select_rd, wd = select_wd;
+	struct	timeval	tv, *tvp = NULL;
+	int	n, i, found;
+
+	if (ms >= 0)
+	{
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+		tvp = &tv;
+	}
+	n = select(select_max_fd + 1, &rd, &wd, NULL, tvp);
+	for (i = found = 0; n > 0 && i <= select_max_fd && found < n; i++)
+	{
+		int	events = 0;
+
+		if (FD_ISSET(i, &rd))
+			events |= NEWIO_READ;
+		if (FD_ISSET(i, &wd))
+			events |= NEWIO_WRITE;
+		if (events)
+		{
+			found++;
+			io_mark_ready(i, events);
+		}
+	}
+	return n;
+}
+
 /* new_close: works just like close */
 void
 new_close(int des)
 {
-	if (des < 0 || des >= IO_ARRAYLEN)
+	int	i;
+
+	if (des < 0)
 		return;
-	new_free(&(io_rec[des])); /* gkm */
+	new_io_register(des, 0);
+	if (des < io_rec_size && io_rec[des])
+	{
+		if (io_rec[des]->pending)
+		{
+			for (i = 0; i < io_pending_count; i++)
+				if (io_pending[i] == des)
+				{
+					io_pending[i] = io_pending[--io_pending_count];
+					break;
+				}
+		}
+		io_buffered_remove(io_rec[des]);
+		for (i = 0; i < io_hold_count; i++)
+			if (io_hold[i].rec == io_rec[des])
+				break;
+		if (i < io_hold_count)
+		{
+			io_rec[des]->closed = 1;
+			io_rec[des] = NULL;
+		}
+		else
+		{
+			new_free(&io_rec[des]->buffer);
+			new_free(&(io_rec[des])); /* gkm */
+		}
+	}
 	close(des);
 }
 
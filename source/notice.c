@@ -242,7 +242,7 @@ parse_notice(u_char *from, u_char **Args)
 						goto out;
 					}
 				}
-				if (not_from_server && (flag != DONT_IGNORE) && !from_user_host() &&
+				if (not_from_server && (flag != DONT_IGNORE) && !nick_userhost(from, parsing_server()) &&
 							(ignore_usernames() & IGNORE_NOTICES))
 					add_to_whois_queue(from, whois_ignore_notices, "%s %s", to, line);
 				else
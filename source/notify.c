@@ -47,6 +47,7 @@ IRCII_RCSID("@(#)$eterna: notify.c,v 1.53 2014/03/12 06:17:05 mrg Exp $");
 #include "server.h"
 #include "output.h"
 #include "vars.h"
+#include "names.h"
 
 /* NotifyList: the structure for the notify stuff */
 typedef	struct	notify_stru
@@ -290,6 +291,40 @@ notify_mark(u_char *nick, int flag, int doit)
 	}
 }
 
+/*
+ * notify_mark_channel: notify_mark() each nick we NOTIFY on that is on
+ * channel, as at the end of NAMES for it.  this looks for our few nicks
+ * on the channel, not for each of its nicks in notify_list.
+ */
+void
+notify_mark_channel(u_char *channel, int server)
+{
+	NotifyList	*tmp;
+	u_char	**nicks,
+		*nick;
+	int	count = 0,
+		i;
+
+	for (tmp = notify_list; tmp; tmp = tmp->next)
+		count++;
+	if (count == 0)
+		return;
+	/* find them all first, as notify_mark() may run hooks */
+	nicks = new_malloc(count * sizeof *nicks);
+	for (count = 0, tmp = notify_list; tmp; tmp = tmp->next)
+		if ((nick = channel_nick(channel, server, tmp->nick)) != NULL)
+		{
+			nicks[count] = NULL;
+			malloc_strcpy(&nicks[count++], nick);
+		}
+	for (i = 0; i < count; i++)
+	{
+		notify_mark(nicks[i], 1, 0);
+		new_free(&nicks[i]);
+	}
+	new_free(&nicks);
+}
+
 void
 save_notify(FILE *fp)
 {
@@ -378,6 +378,7 @@ numbered_command(u_char *from, int comm, u_char **ArgList)
 		if (do_hook(current_numeric(), "%s %s", from, *ArgList)) 
 			display_msg(from, ArgList);
 		clean_whois_queue();
+		server_set_flag(from_server, CAP_PENDING, 0);
 		break;
 	case 002:	/* #define RPL_YOURHOST         002 */
 		PasteArgs(ArgList, 0);
@@ -493,20 +494,22 @@ numbered_command(u_char *from, int comm, u_char **ArgList)
 
 	case 366:		/* #define RPL_ENDOFNAMES       366 */
 		{
-			u_char	*tmp = NULL,
+			u_char	*tmp,
 				*chan;
+			size_t	len;
 
 			PasteArgs(ArgList, 0);
-			malloc_strcpy(&tmp, ArgList[0]);
+			len = my_strlen(ArgList[0]) + 1;
+			tmp = parse_scratch(len);
+			memmove(tmp, ArgList[0], len);
 			chan = next_arg(tmp, 0);
+			end_channel_names(chan, parsing_server());
 			flag = do_hook(current_numeric(), "%s %s", from, ArgList[0]);
 			
 			if (flag &&
 			    channel_mode_lookup(chan, CHAN_NAMES | CHAN_MODE, 0) &&
 			    get_int_var(SHOW_END_OF_MSGS_VAR) && flag)
 				display_msg(from, ArgList);
-
-			new_free(&tmp);
 		}
 		break;
 
@@ -526,7 +529,25 @@ numbered_command(u_char *from, int comm, u_char **ArgList)
 		remove_channel(ArgList[0], parsing_server());
 		break;
 		
+	case 410:		/* #define ERR_INVALIDCAPCMD    410 */
+		PasteArgs(ArgList, 0);
+		if (do_hook(current_numeric(), "%s %s", from, *ArgList))
+			display_msg(from, ArgList);
+		if (server_get_flag(from_server, CAP_PENDING))
+		{
+			send_to_server("CAP END");
+			server_set_flag(from_server, CAP_PENDING, 0);
+		}
+		break;
+
 	case 421:		/* #define ERR_UNKNOWNCOMMAND   421 */
+		/* a server from before CAP; it will register us anyway */
+		if (!my_stricmp(ArgList[0], "CAP") &&
+		    server_get_flag(from_server, CAP_PENDING))
+		{
+			server_set_flag(from_server, CAP_PENDING, 0);
+			break;
+		}
 		if (check_screen_redirect(ArgList[0]))
 			break;
 		if (check_wait_command(ArgList[0]))
@@ -617,29 +638,31 @@ numbered_command(u_char *from, int comm, u_char **ArgList)
 		 */
 	default:
 		{
-			u_char	*ArgSpace = NULL;
+			u_char	*ArgSpace,
+				*end;
 			int	i,
 				do_message_from = 0;
 			size_t	len;
 
 			for (i = len = 0; ArgList[i]; len += my_strlen(ArgList[i++]))
 				;
-			len += (i - 1);
-			ArgSpace = new_malloc(len + 1);
-			ArgSpace[0] = '\0';
+			len += i;
+			end = ArgSpace = parse_scratch(len + 1);
+			*end = '\0';
 			/* this is cheating */
 			if (ArgList[0] && is_channel(ArgList[0]))
 				do_message_from = 1;
 			for (i = 0; ArgList[i]; i++)
 			{
 				if (i)
-					my_strcat(ArgSpace, " ");
-				my_strcat(ArgSpace, ArgList[i]);
+					*end++ = ' ';
+				len = my_strlen(ArgList[i]);
+				memmove(end, ArgList[i], len + 1);
+				end += len;
 			}
 			if (do_message_from)
 				message_from(ArgList[0], LOG_CRAP);
 			i = do_hook(current_numeric(), "%s %s", from, ArgSpace);
-			new_free(&ArgSpace);
 			if (do_message_from)
 				restore_message_from();
 			if (i == 0)
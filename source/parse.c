@@ -67,8 +67,8 @@ IRCII_RCSID("@(#)$eterna: parse.c,v 1.114 2014/03/14 21:19:26 mrg Exp $");
 #define	MAXPARA	15	/* Taken from the ircd */
 
 static	void	BreakArgs(u_char *, u_char **, u_char **);
-static	void	p_linreply(u_char **);
-static	void	p_ping(u_char **);
+static	void	p_linreply(u_char *, u_char **);
+static	void	p_ping(u_char *, u_char **);
 static	void	p_topic(u_char *, u_char **);
 static	void	p_wall(u_char *, u_char **);
 static	void	p_wallops(u_char *, u_char **);
@@ -83,6 +83,147 @@ static	void	p_nick(u_char *, u_char **);
 static	void	p_mode(u_char *, u_char **);
 static	void	p_kick(u_char *, u_char **);
 static	void	p_part(u_char *, u_char **);
+static	void	p_cap(u_char *, u_char **);
+static	void	p_away(u_char *, u_char **);
+static	void	p_batch(u_char *, u_char **);
+
+/*
+ * the server commands (other than numerics) that are understood, and
+ * how.  those with an action were added by SERVERCOMMAND, and are run
+ * as commands; a deleted one has neither func nor action.
+ */
+typedef	struct
+{
+	u_char	*name;
+	void	(*func)(u_char *, u_char **);
+	u_char	*action;
+} ParseCommand;
+
+static	ParseCommand parse_commands[] =
+{
+	{ UP("NAMREPLY"),	funny_namreply,		NULL },
+	{ UP("WHOREPLY"),	whoreply,		NULL },
+	{ UP("NOTICE"),		parse_notice,		NULL },
+	{ UP("PRIVMSG"),	p_privmsg,		NULL },
+	{ UP("JOIN"),		p_channel,		NULL },
+	{ UP("PART"),		p_part,			NULL },
+	{ UP("CHANNEL"),	p_channel,		NULL },
+	{ UP("QUIT"),		p_quit,			NULL },
+	{ UP("WALL"),		p_wall,			NULL },
+	{ UP("WALLOPS"),	p_wallops,		NULL },
+	{ UP("LINREPLY"),	p_linreply,		NULL },
+	{ UP("PING"),		p_ping,			NULL },
+	{ UP("TOPIC"),		p_topic,		NULL },
+	{ UP("PONG"),		p_pong,			NULL },
+	{ UP("INVITE"),		p_invite,		NULL },
+	{ UP("NICK"),		p_nick,			NULL },
+	{ UP("KILL"),		p_server_kill,		NULL },
+	{ UP("MODE"),		p_mode,			NULL },
+	{ UP("KICK"),		p_kick,			NULL },
+	{ UP("ERROR"),		p_error,		NULL },
+	{ UP("CAP"),		p_cap,			NULL },
+	{ UP("AWAY"),		p_away,			NULL },
+	{ UP("BATCH"),		p_batch,		NULL },
+	{ UP("ERROR:"),		p_error,		NULL }, /* Server bug makes this a must */
+	{ NULL,			NULL,			NULL }
+};
+
+/*
+ * parse_hash: parse_commands, and those added by SERVERCOMMAND, in an
+ * open addressed hash table on the command name.  it is kept no more
+ * than a quarter full.
+ */
+static	ParseCommand **parse_hash = NULL;
+static	unsigned parse_hash_size = 0;
+static	unsigned parse_hash_count = 0;
+
+static	unsigned parse_hash_name(u_char *);
+static	ParseCommand **parse_hash_slot(u_char *);
+static	void	parse_hash_add(ParseCommand *);
+static	ParseCommand *parse_find_command(u_char *);
+static	void	parse_run_action(ParseCommand *, u_char *, u_char **);
+
+/*
+ * the scratch arena: memory that handlers can use for the line being
+ * parsed, without having to free it.  irc2_parse_server() takes it back
+ * when the line is done.  blocks are kept for the next line rather than
+ * freed, and are never moved, so a line parsed from inside a handler
+ * (by WAIT, say) does not disturb the one outside it.
+ */
+typedef	struct	scratch_stru
+{
+	struct	scratch_stru *next;
+	size_t	size;
+	size_t	used;
+	union
+	{
+		double	align_d;
+		void	*align_p;
+		long	align_l;
+		u_char	data[1];
+	} u;
+} Scratch;
+
+#define SCRATCH_BLOCK	4096
+
+static	Scratch	*scratch_first = NULL;	/* all the blocks, in order */
+static	Scratch	*scratch_cur = NULL;	/* the one being handed out */
+
+static	void	parse_scratch_mark(Scratch **, size_t *);
+static	void	parse_scratch_release(Scratch *, size_t);
+static	Scratch	*parse_scratch_new(size_t, Scratch *);
+
+/*
+ * the IRCv3 capabilities we ask for, if the server has them.
+ */
+static	struct
+{
+	u_char	*name;
+	int	cap;
+} cap_names[] =
+{
+	{ UP("multi-prefix"),		CAP_MULTI_PREFIX },
+	{ UP("userhost-in-names"),	CAP_USERHOST_IN_NAMES },
+	{ UP("away-notify"),		CAP_AWAY_NOTIFY },
+	{ UP("extended-join"),		CAP_EXTENDED_JOIN },
+	{ UP("batch"),			CAP_BATCH },
+	{ NULL,				0 }
+};
+
+static	int	cap_parse(u_char *, int *);
+static	void	cap_end(int);
+
+/*
+ * BATCHes the server has started and not yet ended.  QUITs in a
+ * netsplit batch, and JOINs in a netjoin one, are shown as a single
+ * line when the batch ends instead of a line each.
+ */
+typedef	struct	batch_stru
+{
+	struct	batch_stru *next;
+	int	server;
+	u_char	*ref;		/* the server's name for it */
+	int	type;		/* BATCH_* */
+	u_char	*params;	/* the servers split or joined */
+	int	count;		/* nicks seen */
+	u_char	*nicks;		/* the first few of them */
+} Batch;
+
+#define	BATCH_OTHER	0
+#define	BATCH_NETSPLIT	1
+#define	BATCH_NETJOIN	2
+
+/* how much of the nicks in a batch to show */
+#define	BATCH_NICKS	400
+
+static	Batch	*batch_list = NULL;
+static	Batch	*line_batch = NULL;	/* the one the line being parsed
+					   is in, if any */
+
+static	Batch	*batch_find(int, u_char *);
+static	void	batch_note(Batch *, u_char *);
+static	void	batch_free(Batch *);
+static	u_char	*parse_tag(u_char *, char *);
 
 /* User and host information from server 2.7 */
 static	u_char	*FromUserHost = NULL;
@@ -125,16 +266,33 @@ is_channel(u_char *to)
 }
 
 
+/*
+ * PasteArgs: join Args[StartPoint] and those after it back into one
+ * string, with a space between each, and return it.  the arguments
+ * must all lie in one buffer, in order, as BreakArgs() leaves them; any
+ * gap between two of them is closed up by moving the later one down.
+ */
 u_char	*
 PasteArgs(u_char **Args, int StartPoint)
 {
+	u_char	*end;
+	size_t	len;
 	int	i;
 
 	for (; StartPoint; Args++, StartPoint--)
 		if (!*Args)
 			return NULL;
-	for (i = 0; Args[i] && Args[i+1]; i++)
-		Args[i][my_strlen(Args[i])] = ' ';
+	if (!Args[0])
+		return NULL;
+	end = Args[0] + my_strlen(Args[0]);
+	for (i = 1; Args[i]; i++)
+	{
+		*end++ = ' ';
+		len = my_strlen(Args[i]);
+		if (Args[i] != end)
+			memmove(end, Args[i], len + 1);
+		end += len;
+	}
 	Args[1] = NULL;
 	return Args[0];
 }
@@ -142,13 +300,14 @@ PasteArgs(u_char **Args, int StartPoint)
 /*
  * BreakArgs: breaks up the line from the server, in to where its from,
  * setting FromUserHost if it should be, and returns all the arguements
- * that are there.   Re-written by phone, dec 1992.
+ * that are there.  the line is split where it lies, with the separating
+ * spaces (and the : before a final argument) turned into nuls, so
+ * nothing is copied.  Re-written by phone, dec 1992.
  */
 static	void
 BreakArgs(u_char *Input, u_char **Sender, u_char **OutPut)
 {
-	u_char	*s = Input,
-		*t;
+	u_char	*s = Input;
 	int	ArgCount = 0;
 
 	/*
@@ -174,7 +333,10 @@ BreakArgs(u_char *Input, u_char **Sender, u_char **OutPut)
 		*Sender = empty_string();
 
 	if (!s)
+	{
+		OutPut[0] = NULL;
 		return;
+	}
 
 	for (;;)
 	{
@@ -186,8 +348,7 @@ BreakArgs(u_char *Input, u_char **Sender, u_char **OutPut)
 
 		if (*s == ':')
 		{
-			for (t = s; *t; t++)
-				*t = *(t + 1);
+			*s++ = '\0';
 			OutPut[ArgCount++] = s;
 			break;
 		}
@@ -201,6 +362,76 @@ BreakArgs(u_char *Input, u_char **Sender, u_char **OutPut)
 	OutPut[ArgCount] = NULL;
 }
 
+/*
+ * parse_scratch_mark: note how much of the arena is in use.
+ */
+static	void
+parse_scratch_mark(Scratch **block, size_t *used)
+{
+	*block = scratch_cur;
+	*used = scratch_cur ? scratch_cur->used : 0;
+}
+
+/*
+ * parse_scratch_release: give back what has been handed out since
+ * parse_scratch_mark() returned block and used.
+ */
+static	void
+parse_scratch_release(Scratch *block, size_t used)
+{
+	Scratch	*s;
+
+	if (!scratch_cur)
+		return;
+	for (s = block ? block->next : scratch_first; s; s = s->next)
+		s->used = 0;
+	if (block)
+		block->used = used;
+	scratch_cur = block ? block : scratch_first;
+}
+
+/*
+ * parse_scratch_new: a new block of at least len bytes, to go before
+ * next.
+ */
+static	Scratch	*
+parse_scratch_new(size_t len, Scratch *next)
+{
+	Scratch	*s;
+
+	if (len < SCRATCH_BLOCK)
+		len = SCRATCH_BLOCK;
+	s = new_malloc(sizeof *s + len);
+	s->size = len;
+	s->used = 0;
+	s->next = next;
+	return s;
+}
+
+/*
+ * parse_scratch: len bytes that stay good until the server line now
+ * being parsed is finished with.
+ */
+u_char	*
+parse_scratch(size_t len)
+{
+	u_char	*p;
+
+	len = (len + sizeof(double) - 1) & ~(sizeof(double) - 1);
+	if (!scratch_cur)
+		scratch_first = scratch_cur = parse_scratch_new(len, NULL);
+	else if (scratch_cur->size - scratch_cur->used < len)
+	{
+		if (!scratch_cur->next || scratch_cur->next->size < len)
+			scratch_cur->next = parse_scratch_new(len,
+			    scratch_cur->next);
+		scratch_cur = scratch_cur->next;
+	}
+	p = scratch_cur->u.data + scratch_cur->used;
+	scratch_cur->used += len;
+	return p;
+}
+
 /* beep_em: Not hard to figure this one out */
 void
 beep_em(int beeps)
@@ -242,7 +473,7 @@ p_topic(u_char *from, u_char **ArgList)
 }
 
 static	void
-p_linreply(u_char **ArgList)
+p_linreply(u_char *from, u_char **ArgList)
 {
 	PasteArgs(ArgList, 0);
 	say("%s", ArgList[0]);
@@ -271,7 +502,7 @@ p_wall(u_char *from, u_char **ArgList)
 		else
 			high = empty_string();
 		if ((flag != DONT_IGNORE) && (ignore_usernames() & IGNORE_WALLS)
-				&& !from_user_host())
+				&& !nick_userhost(from, parsing_server()))
 			add_to_whois_queue(from, whois_ignore_walls, "%s",line);
 		else
 		{
@@ -379,6 +610,17 @@ whoreply(u_char *from, u_char **ArgList)
 	if (ArgList[i])
 		name = ArgList[i];
 
+	if (*nick && *user && *host)
+	{
+		u_char	userhost[BIG_BUFFER_SIZE];
+
+		snprintf(CP(userhost), sizeof userhost, "%s@%s", user, host);
+		userhost_cache_add(parsing_server(), nick, userhost);
+	}
+	/* the status starts with H for here or G for gone */
+	if (*nick && (*status == 'H' || *status == 'G'))
+		nick_set_away(nick, parsing_server(), *status == 'G');
+
 	ok = whoreply_check(channel, user, host, server, nick, status, name,
 			    ArgList, format);
 
@@ -430,7 +672,8 @@ p_privmsg(u_char *from, u_char **Args)
 	save_message_from();
 	if (is_channel(to))
 	{
-		malloc_strcpy(&public_nick, from);
+		if (!public_nick || my_strcmp(public_nick, from))
+			malloc_strcpy(&public_nick, from);
 		if (!is_on_channel(to, parsing_server(), from))
 		{
 			log_type = LOG_PUBLIC;
@@ -486,7 +729,7 @@ p_privmsg(u_char *from, u_char **Args)
 	ptr = do_ctcp(from, to, ptr);
 	if (!ptr || !*ptr)
 		goto out;
-	if ((flag != DONT_IGNORE) && (ignore_usernames() & ignore_type) && !from_user_host())
+	if ((flag != DONT_IGNORE) && (ignore_usernames() & ignore_type) && !nick_userhost(from, parsing_server()))
 		add_to_whois_queue(from, whois_ignore_msgs, "%s", ptr);
 	else
 	{
@@ -514,14 +757,13 @@ p_privmsg(u_char *from, u_char **Args)
 			    if (is_away_set())
 			    {
 				time_t t;
-				u_char *msg = NULL;
+				u_char *msg;
 				size_t len = my_strlen(ptr) + 20;
 
 				t = time(NULL);
-				msg = new_malloc(len);
+				msg = parse_scratch(len);
 				snprintf(CP(msg), len, "%s <%.16s>", ptr, ctime(&t));
 				put_it("%s*%s*%s %s", high, from, high, msg);
-				new_free(&msg);
 			    }
 			    else
 				put_it("%s*%s*%s %s", high, from, high, ptr);
@@ -558,7 +800,9 @@ static	void
 p_quit(u_char *from, u_char **ArgList)
 {
 	int	one_prints = 0;
-	u_char	*chan;
+	u_char	*chan,
+		*chans,
+		*rest;
 	u_char	*Reason;
 	int	flag;
 
@@ -570,21 +814,30 @@ p_quit(u_char *from, u_char **ArgList)
 	{
 		PasteArgs(ArgList, 0);
 		Reason = ArgList[0] ? ArgList[0] : (u_char *) "?";
-		for (chan = walk_channels(from, 1, parsing_server()); chan; chan = walk_channels(from, 0, -1))
+		rest = chans = nick_channels(from, parsing_server());
+		while ((chan = next_arg(rest, &rest)) != NULL)
 		{
 			message_from(chan, LOG_CRAP);
 			if (do_hook(CHANNEL_SIGNOFF_LIST, "%s %s %s", chan, from, Reason))
 				one_prints = 1;
 		}
+		new_free(&chans);
 		if (one_prints)
 		{
 			message_from(what_channel(from, parsing_server()), LOG_CRAP);
 			if (do_hook(SIGNOFF_LIST, "%s %s", from, Reason))
-				say("Signoff: %s (%s)", from, Reason);
+			{
+				if (line_batch &&
+				    line_batch->type == BATCH_NETSPLIT)
+					batch_note(line_batch, from);
+				else
+					say("Signoff: %s (%s)", from, Reason);
+			}
 		}
 	}
 	message_from(NULL, LOG_CURRENT);
 	remove_from_channel(NULL, from, parsing_server());
+	userhost_cache_remove(parsing_server(), from);
 	notify_mark(from, 0, 0);
 	restore_message_from();
 }
@@ -596,6 +849,10 @@ p_pong(u_char *from, u_char **ArgList)
 
 	if (!from)
 		return;
+	/* answers to SERVER_PING_INTERVAL are kept quiet */
+	if (server_ping_pong(parsing_server(),
+	    ArgList[0] && ArgList[1] ? ArgList[1] : ArgList[0]))
+		return;
 	flag = double_ignore(from, from_user_host(), IGNORE_CRAP);
 	if (flag == IGNORED)
 		return;
@@ -668,7 +925,8 @@ p_channel(u_char *from, u_char **ArgList)
 		save_message_from();
 		message_from(channel, LOG_CRAP);
 		if (join)
-			add_to_channel(channel, from, parsing_server(), chan_oper, chan_voice);
+			add_to_channel(channel, from, parsing_server(), chan_oper, chan_voice,
+			    from_user_host());
 		else
 			remove_from_channel(channel, from, parsing_server());
 		restore_message_from();
@@ -682,7 +940,9 @@ p_channel(u_char *from, u_char **ArgList)
 		if (flag != IGNORED && do_hook(JOIN_LIST, "%s %s %s", from,
 						channel, ov ? ov : (u_char *) ""))
 		{
-			if (from_user_host())
+			if (line_batch && line_batch->type == BATCH_NETJOIN)
+				batch_note(line_batch, from);
+			else if (from_user_host())
 				if (ov && *ov)
 					say("%s (%s) has joined channel %s +%s", from,
 				    from_user_host(), channel, ov);
@@ -727,7 +987,7 @@ p_invite(u_char *from, u_char **ArgList)
 	if (ArgList[0] && ArgList[1])
 	{
 		if ((flag != DONT_IGNORE) && (ignore_usernames() & IGNORE_INVITES)
-		    && !from_user_host())
+		    && !nick_userhost(from, parsing_server()))
 			add_to_whois_queue(from, whois_ignore_invites,
 					"%s", ArgList[1]);
 		else
@@ -763,7 +1023,7 @@ p_server_kill(u_char *from, u_char **ArgList)
 }
 
 static	void
-p_ping(u_char **ArgList)
+p_ping(u_char *from, u_char **ArgList)
 {
 	PasteArgs(ArgList, 0);
 	send_to_server("PONG :%s", ArgList[0]);
@@ -774,7 +1034,9 @@ p_nick(u_char *from, u_char **ArgList)
 {
 	int	one_prints = 0,
 		its_me = 0;
-	u_char	*chan;
+	u_char	*chan,
+		*chans,
+		*rest;
 	u_char	*line;
 	int	flag;
 
@@ -791,13 +1053,14 @@ p_nick(u_char *from, u_char **ArgList)
 	save_message_from();
 	if (flag != IGNORED)
 	{
-		for (chan = walk_channels(from, 1, parsing_server()); chan;
-				chan = walk_channels(from, 0, -1))
+		rest = chans = nick_channels(from, parsing_server());
+		while ((chan = next_arg(rest, &rest)) != NULL)
 		{
 			message_from(chan, LOG_CRAP);
 			if (do_hook(CHANNEL_NICK_LIST, "%s %s %s", chan, from, line))
 				one_prints = 1;
 		}
+		new_free(&chans);
 		if (one_prints)
 		{
 			if (its_me)
@@ -809,6 +1072,7 @@ p_nick(u_char *from, u_char **ArgList)
 		}
 	}
 	rename_nick(from, line, parsing_server());
+	userhost_cache_rename(parsing_server(), from, line);
 	if (my_stricmp(from, line))
 	{
 		message_from(NULL, LOG_CURRENT);
@@ -952,16 +1216,292 @@ p_part(u_char *from, u_char **ArgList)
 }
 
 
+/*
+ * p_cap: the server's side of capability negotiation.  we send CAP LS
+ * when logging in, ask for those of cap_names[] it lists, and end the
+ * negotiation once it has answered, so that registration can finish.
+ */
+static	void
+p_cap(u_char *from, u_char **ArgList)
+{
+	int	server = parsing_server();
+	u_char	*sub, *list;
+	int	more = 0, caps, off;
+
+	if (!ArgList[0] || !(sub = ArgList[1]))
+		return;
+	/* "CAP * LS * :..." means there is more to come */
+	if (ArgList[2] && ArgList[3] && !my_strcmp(ArgList[2], "*"))
+	{
+		more = 1;
+		list = ArgList[3];
+	}
+	else
+		list = ArgList[2] ? ArgList[2] : empty_string();
+
+	caps = server_get_caps(server);
+	if (!my_stricmp(sub, "LS"))
+	{
+		server_set_cap_ask(server,
+			server_get_cap_ask(server) | cap_parse(list, NULL));
+		if (more || !server_get_flag(server, CAP_PENDING))
+			return;
+		if (server_get_cap_ask(server))
+			send_to_server("CAP REQ :%s",
+				parse_cap_string(server_get_cap_ask(server)));
+		else
+			cap_end(server);
+	}
+	else if (!my_stricmp(sub, "NEW"))
+	{
+		if ((caps = cap_parse(list, NULL) & ~caps) != 0)
+			send_to_server("CAP REQ :%s", parse_cap_string(caps));
+	}
+	else if (!my_stricmp(sub, "ACK"))
+	{
+		caps |= cap_parse(list, &off);
+		server_set_caps(server, caps & ~off);
+		if (!more && server_get_flag(server, CAP_PENDING))
+			cap_end(server);
+	}
+	else if (!my_stricmp(sub, "NAK"))
+	{
+		if (!more && server_get_flag(server, CAP_PENDING))
+			cap_end(server);
+	}
+	else if (!my_stricmp(sub, "DEL"))
+		server_set_caps(server, caps & ~cap_parse(list, NULL));
+	else if (!my_stricmp(sub, "LIST"))
+		say("Server capabilities: %s", list);
+}
+
+/*
+ * cap_parse: the cap_names[] in list, a space separated list of
+ * capabilities as CAP sends them.  those given as "-name" go in *off
+ * instead, if off is not NULL.
+ */
+static	int
+cap_parse(u_char *list, int *off)
+{
+	u_char	*end;
+	size_t	len;
+	int	caps = 0, i, neg;
+
+	if (off)
+		*off = 0;
+	for (; *list; list = end)
+	{
+		while (*list == ' ')
+			list++;
+		if ((neg = (*list == '-')))
+			list++;
+		for (end = list; *end && *end != ' '; end++)
+			;
+		/* CAP LS 302 may give "name=value" */
+		for (len = 0; list + len < end && list[len] != '='; len++)
+			;
+		for (i = 0; cap_names[i].name; i++)
+			if (my_strlen(cap_names[i].name) == len &&
+			    !my_strncmp(cap_names[i].name, list, len))
+			{
+				if (!neg)
+					caps |= cap_names[i].cap;
+				else if (off)
+					*off |= cap_names[i].cap;
+			}
+	}
+	return caps;
+}
+
+/*
+ * parse_cap_string: the names of caps, a set of CAP_* bits, for CAP REQ
+ * and SERVERSTATS.  it is in a static buffer.
+ */
+u_char	*
+parse_cap_string(int caps)
+{
+	static	u_char	buffer[BIG_BUFFER_SIZE];
+	int	i;
+
+	*buffer = '\0';
+	for (i = 0; cap_names[i].name; i++)
+		if (caps & cap_names[i].cap)
+		{
+			if (*buffer)
+				my_strmcat(buffer, " ", sizeof buffer);
+			my_strmcat(buffer, cap_names[i].name, sizeof buffer);
+		}
+	return buffer;
+}
+
+static	void
+cap_end(int server)
+{
+	send_to_server("CAP END");
+	server_set_flag(server, CAP_PENDING, 0);
+}
+
+/*
+ * p_away: with away-notify, the server says when people we share a
+ * channel with go away or come back.  this is kept quiet; see $ISAWAY().
+ */
+static	void
+p_away(u_char *from, u_char **ArgList)
+{
+	if (!from || !*from)
+		return;
+	nick_set_away(from, parsing_server(), ArgList[0] && *ArgList[0]);
+}
+
+/*
+ * p_batch: "BATCH +ref type params" starts a batch, and "BATCH -ref"
+ * ends it.  lines tagged with batch=ref come in between.
+ */
+static	void
+p_batch(u_char *from, u_char **ArgList)
+{
+	Batch	*batch, **bp;
+	int	server = parsing_server();
+
+	if (!ArgList[0] || !ArgList[0][0] || !ArgList[0][1])
+		return;
+	if (ArgList[0][0] == '+')
+	{
+		batch = new_malloc(sizeof *batch);
+		batch->server = server;
+		batch->ref = NULL;
+		malloc_strcpy(&batch->ref, ArgList[0] + 1);
+		if (!ArgList[1])
+			batch->type = BATCH_OTHER;
+		else if (!my_stricmp(ArgList[1], "netsplit"))
+			batch->type = BATCH_NETSPLIT;
+		else if (!my_stricmp(ArgList[1], "netjoin"))
+			batch->type = BATCH_NETJOIN;
+		else
+			batch->type = BATCH_OTHER;
+		batch->params = NULL;
+		malloc_strcpy(&batch->params, ArgList[1] && ArgList[2] ?
+			PasteArgs(ArgList, 2) : empty_string());
+		batch->count = 0;
+		batch->nicks = NULL;
+		batch->next = batch_list;
+		batch_list = batch;
+		return;
+	}
+	if (ArgList[0][0] != '-')
+		return;
+	for (bp = &batch_list; (batch = *bp); bp = &batch->next)
+		if (batch->server == server &&
+		    !my_strcmp(batch->ref, ArgList[0] + 1))
+			break;
+	if (!batch)
+		return;
+	*bp = batch->next;
+	if (batch->count)
+	{
+		save_message_from();
+		message_from(NULL, LOG_CRAP);
+		say("%s %s: %s%s (%d)",
+		    batch->type == BATCH_NETSPLIT ? "Netsplit" : "Netjoin",
+		    batch->params, batch->nicks,
+		    my_strlen(batch->nicks) >= BATCH_NICKS ? " ..." : "",
+		    batch->count);
+		restore_message_from();
+	}
+	if (line_batch == batch)
+		line_batch = NULL;
+	batch_free(batch);
+}
+
+static	Batch	*
+batch_find(int server, u_char *ref)
+{
+	Batch	*batch;
+
+	if (!ref)
+		return NULL;
+	for (batch = batch_list; batch; batch = batch->next)
+		if (batch->server == server && !my_strcmp(batch->ref, ref))
+			return batch;
+	return NULL;
+}
+
+/* batch_note: count nick in batch, and keep it if there is room */
+static	void
+batch_note(Batch *batch, u_char *nick)
+{
+	batch->count++;
+	if (batch->nicks && my_strlen(batch->nicks) >= BATCH_NICKS)
+		return;
+	if (batch->nicks)
+		malloc_strcat(&batch->nicks, UP(" "));
+	malloc_strcat(&batch->nicks, nick);
+}
+
+static	void
+batch_free(Batch *batch)
+{
+	new_free(&batch->ref);
+	new_free(&batch->params);
+	new_free(&batch->nicks);
+	new_free(&batch);
+}
+
+/*
+ * parse_batch_clear: forget the batches server had open, as it has
+ * closed or is starting afresh.
+ */
+void
+parse_batch_clear(int server)
+{
+	Batch	*batch, **bp;
+
+	for (bp = &batch_list; (batch = *bp); )
+		if (batch->server == server)
+		{
+			*bp = batch->next;
+			if (line_batch == batch)
+				line_batch = NULL;
+			batch_free(batch);
+		}
+		else
+			bp = &batch->next;
+}
+
+/*
+ * parse_tag: the value of the message tag name in tags, the part of
+ * a line between the '@' and the first space, or NULL.  tags is cut
+ * up as it is searched.
+ */
+static	u_char	*
+parse_tag(u_char *tags, char *name)
+{
+	u_char	*s, *end;
+	size_t	len = strlen(name);
+
+	for (s = tags; s; s = end)
+	{
+		if ((end = my_index(s, ';')) != NULL)
+			*end++ = '\0';
+		if (!my_strncmp(s, name, len) && s[len] == '=')
+			return s + len + 1;
+	}
+	return NULL;
+}
+
 void
 irc2_parse_server(u_char *line)
 {
 	u_char	*from,
 		*comm,
-		*end,
-		*copy = NULL;
+		*end;
 	int	numeric;
 	u_char	**ArgList;
 	u_char	*TrueArgs[MAXPARA + 1];
+	ParseCommand *cmd;
+	Scratch	*mark;
+	size_t	mark_used;
+	Batch	*old_batch = line_batch;
 
 	if (NULL == line)
 		return;
@@ -972,69 +1512,50 @@ irc2_parse_server(u_char *line)
 	if (*end == '\r')
 		*end-- = '\0';
 
+	/* message tags; only batch is of any use to us */
+	line_batch = NULL;
+	if (*line == '@')
+	{
+		u_char	*tags = line + 1;
+
+		if ((line = my_index(tags, ' ')) == NULL)
+			goto out;
+		*line++ = '\0';
+		while (*line == ' ')
+			line++;
+		if (server_get_caps(parsing_server()) & CAP_BATCH)
+			line_batch = batch_find(parsing_server(),
+						parse_tag(tags, "batch"));
+	}
+
 	if (*line == ':')
 	{
 		if (!do_hook(RAW_IRC_LIST, "%s", line + 1))
-			return;
+			goto out;
 	}
 	else if (!do_hook(RAW_IRC_LIST, "%s %s", "*", line))
-		return;
+		goto out;
 
-	malloc_strcpy(&copy, line);
+	/* the line is ours to cut up until do_server() is done with it */
 	ArgList = TrueArgs;
-	BreakArgs(copy, &from, ArgList);
+	BreakArgs(line, &from, ArgList);
+	if (FromUserHost)
+		userhost_cache_add(parsing_server(), from, FromUserHost);
 
 	if (!(comm = (*ArgList++)))
-		return;		/* Empty line from server - ByeBye */
+		goto out;	/* Empty line from server - ByeBye */
+
+	parse_scratch_mark(&mark, &mark_used);
 
 	/*
 	 * only allow numbers 1 .. 999.
 	 */
-	if ((numeric = my_atoi(comm)) > 0 && numeric < 1000)
+	if (isdigit(*comm) && (numeric = my_atoi(comm)) > 0 && numeric < 1000)
 		numbered_command(from, numeric, ArgList);
-	else if (my_strcmp(comm, "NAMREPLY") == 0)
-		funny_namreply(from, ArgList);
-	else if (my_strcmp(comm, "WHOREPLY") == 0)
-		whoreply(from, ArgList);
-	else if (my_strcmp(comm, "NOTICE") == 0)
-		parse_notice(from, ArgList);
-	/* everything else is handled locally */
-	else if (my_strcmp(comm, "PRIVMSG") == 0)
-		p_privmsg(from, ArgList);
-	else if (my_strcmp(comm, "JOIN") == 0)
-		p_channel(from, ArgList);
-	else if (my_strcmp(comm, "PART") == 0)
-		p_part(from, ArgList);
-	else if (my_strcmp(comm, "CHANNEL") == 0)
-		p_channel(from, ArgList);
-	else if (my_strcmp(comm, "QUIT") == 0)
-		p_quit(from, ArgList);
-	else if (my_strcmp(comm, "WALL") == 0)
-		p_wall(from, ArgList);
-	else if (my_strcmp(comm, "WALLOPS") == 0)
-		p_wallops(from, ArgList);
-	else if (my_strcmp(comm, "LINREPLY") == 0)
-		p_linreply(ArgList);
-	else if (my_strcmp(comm, "PING") == 0)
-		p_ping(ArgList);
-	else if (my_strcmp(comm, "TOPIC") == 0)
-		p_topic(from, ArgList);
-	else if (my_strcmp(comm, "PONG") == 0)
-		p_pong(from, ArgList);
-	else if (my_strcmp(comm, "INVITE") == 0)
-		p_invite(from, ArgList);
-	else if (my_strcmp(comm, "NICK") == 0)
-		p_nick(from, ArgList);
-	else if (my_strcmp(comm, "KILL") == 0)
-		p_server_kill(from, ArgList);
-	else if (my_strcmp(comm, "MODE") == 0)
-		p_mode(from, ArgList);
-	else if (my_strcmp(comm, "KICK") == 0)
-		p_kick(from, ArgList);
-	else if (my_strcmp(comm, "ERROR") == 0)
-		p_error(from, ArgList);
-	else if (my_strcmp(comm, "ERROR:") == 0) /* Server bug makes this a must */
-		p_error(from, ArgList);
+	else if ((cmd = parse_find_command(comm)) != NULL && cmd->func)
+		cmd->func(from, ArgList);
+	else if (cmd && cmd->action)
+		parse_run_action(cmd, from, ArgList);
 	else
 	{
 		PasteArgs(ArgList, 0);
@@ -1044,7 +1565,175 @@ irc2_parse_server(u_char *line)
 		else
 			say("Odd server stuff: \"%s %s\"", comm, ArgList[0]);
 	}
-	new_free(&copy);
+	parse_scratch_release(mark, mark_used);
+out:
+	/* a line parsed from inside this one may have ended its batch */
+	for (line_batch = batch_list; line_batch && line_batch != old_batch;
+	     line_batch = line_batch->next)
+		;
+}
+
+/*
+ * parse_hash_name: the hash of a server command name.
+ */
+static	unsigned
+parse_hash_name(u_char *name)
+{
+	unsigned hash = 0;
+
+	while (*name)
+		hash = hash * 31 + *name++;
+	return hash;
+}
+
+/*
+ * parse_hash_slot: the slot in parse_hash that holds name, or the empty
+ * slot where it would go.
+ */
+static	ParseCommand **
+parse_hash_slot(u_char *name)
+{
+	unsigned i;
+
+	for (i = parse_hash_name(name) & (parse_hash_size - 1);
+	     parse_hash[i]; i = (i + 1) & (parse_hash_size - 1))
+		if (my_strcmp(parse_hash[i]->name, name) == 0)
+			break;
+	return &parse_hash[i];
+}
+
+/*
+ * parse_hash_add: put cmd in parse_hash, which must not have it yet,
+ * making the table bigger if need be.
+ */
+static	void
+parse_hash_add(ParseCommand *cmd)
+{
+	if ((parse_hash_count + 1) * 4 > parse_hash_size)
+	{
+		ParseCommand **old = parse_hash;
+		unsigned old_size = parse_hash_size, i;
+
+		parse_hash_size = parse_hash_size ? parse_hash_size * 2 : 128;
+		parse_hash = new_malloc(parse_hash_size * sizeof *parse_hash);
+		memset(parse_hash, 0, parse_hash_size * sizeof *parse_hash);
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				*parse_hash_slot(old[i]->name) = old[i];
+		new_free(&old);
+	}
+	*parse_hash_slot(cmd->name) = cmd;
+	parse_hash_count++;
+}
+
+/*
+ * parse_find_command: look up a server command, filling parse_hash
+ * the first time through.
+ */
+static	ParseCommand *
+parse_find_command(u_char *name)
+{
+	ParseCommand *cmd;
+
+	if (!parse_hash)
+		for (cmd = parse_commands; cmd->name; cmd++)
+			parse_hash_add(cmd);
+	return *parse_hash_slot(name);
+}
+
+/*
+ * parse_run_action: run the SERVERCOMMAND action for cmd, with $0 being
+ * who it is from (or * for the server) and $1- the arguments.
+ */
+static	void
+parse_run_action(ParseCommand *cmd, u_char *from, u_char **ArgList)
+{
+	u_char	*args,
+		*action,
+		*rest;
+	size_t	len;
+
+	if (!from)
+		from = UP("*");
+	rest = PasteArgs(ArgList, 0);
+	len = my_strlen(from) + (rest ? my_strlen(rest) + 1 : 0) + 1;
+	args = parse_scratch(len);
+	snprintf(CP(args), len, "%s%s%s", from, rest ? " " : "",
+	    rest ? rest : empty_string());
+	/* the action may remove itself */
+	len = my_strlen(cmd->action) + 1;
+	action = parse_scratch(len);
+	memmove(action, cmd->action, len);
+	save_message_from();
+	message_from(NULL, LOG_CRAP);
+	parse_line(NULL, action, args, 0, 0, 1);
+	restore_message_from();
+}
+
+/*
+ * servercommandcmd: the SERVERCOMMAND command.  with a command name and
+ * an action, runs the action whenever a server sends that command.
+ * with -name, stops doing so.  with just a name, or nothing at all,
+ * shows what is set.  the commands ircII knows itself can't be changed.
+ */
+void
+servercommandcmd(u_char *command, u_char *args, u_char *subargs)
+{
+	u_char	*name;
+	ParseCommand *cmd;
+	int	delete = 0;
+	unsigned i;
+
+	if (!(name = next_arg(args, &args)))
+	{
+		for (i = 0; i < parse_hash_size; i++)
+			if (parse_hash[i] && parse_hash[i]->action)
+				say("%s: %s", parse_hash[i]->name,
+				    parse_hash[i]->action);
+		return;
+	}
+	if (*name == '-')
+	{
+		delete = 1;
+		name++;
+	}
+	upper(name);
+	cmd = parse_find_command(name);
+	if (cmd && cmd->func)
+	{
+		say("SERVERCOMMAND: %s is handled by ircII itself", name);
+		return;
+	}
+	if (delete)
+	{
+		if (!cmd || !cmd->action)
+			say("SERVERCOMMAND: %s is not set", name);
+		else
+		{
+			say("%s removed", name);
+			new_free(&cmd->action);
+		}
+		return;
+	}
+	if (!*args)
+	{
+		if (cmd && cmd->action)
+			say("%s: %s", cmd->name, cmd->action);
+		else
+			say("SERVERCOMMAND: %s is not set", name);
+		return;
+	}
+	if (!cmd)
+	{
+		cmd = new_malloc(sizeof *cmd);
+		cmd->name = NULL;
+		cmd->func = NULL;
+		cmd->action = NULL;
+		malloc_strcpy(&cmd->name, name);
+		parse_hash_add(cmd);
+	}
+	malloc_strcpy(&cmd->action, args);
+	say("%s added", name);
 }
 
 int
@@ -175,3 +175,214 @@ wild_match(u_char *pattern, u_char *str)
 	/* assuming a -1 return of false */
 	return reg_wild_match(pattern, str) + 1;
 }
+
+/*
+ * Wild: a mask compiled by wild_compile(), for masks matched over and
+ * over, as those of hooks and ignores are.  masks of only literals and
+ * '*' are split into their runs of literals, already in lower case,
+ * and are matched by finding those runs in order; the first and last
+ * must sit at each end of the string unless a '*' is there.  '%', '?'
+ * and anything odd are left to reg_wild_match().  whatever the mask,
+ * a match scores one more than the literals in it, as wild_match()
+ * does.
+ */
+#define	WILD_LITERAL	0	/* no wildcards at all */
+#define	WILD_ANY	1	/* only '*' */
+#define	WILD_GLOB	2	/* literals and '*' */
+#define	WILD_SLOW	3	/* the rest, for reg_wild_match() */
+
+typedef struct
+{
+	u_char	*str;		/* in lower case */
+	size_t	len;
+} WildSeg;
+
+struct wild_stru
+{
+	int	kind;
+	int	score;		/* what wild_match() gives a match */
+	u_char	*mask;		/* for WILD_SLOW */
+	u_char	*lits;		/* the literals of every seg, one buffer */
+	WildSeg	*seg;
+	int	nseg;
+	int	head;		/* seg[0] starts the string */
+	int	tail;		/* seg[nseg - 1] ends it */
+};
+
+static	int	wild_seg_at(WildSeg *, u_char *);
+
+/* wild_compile: compile mask for wild_exec(); the Wild has its own copy */
+Wild	*
+wild_compile(u_char *mask)
+{
+	Wild	*wild;
+	u_char	*m,
+		*lp;
+	int	nseg = 0,
+		in_seg = 0;
+
+	wild = new_malloc(sizeof *wild);
+	wild->mask = NULL;
+	wild->lits = NULL;
+	wild->seg = NULL;
+	wild->nseg = 0;
+	wild->score = 1;
+	wild->kind = WILD_LITERAL;
+	malloc_strcpy(&wild->mask, mask);
+
+	/* count the runs of literals, and see if we can do it at all */
+	for (m = mask; *m; m++)
+	{
+		if (*m == '*')
+		{
+			in_seg = 0;
+			if (wild->kind == WILD_LITERAL)
+				wild->kind = WILD_ANY;
+			continue;
+		}
+		if (*m == '%' || *m == '?' || (*m == '\\' && !m[1]))
+		{
+			wild->kind = WILD_SLOW;
+			return wild;
+		}
+		if (*m == '\\')
+			m++;
+		if (!in_seg)
+			nseg++;
+		in_seg = 1;
+		wild->score++;
+	}
+	if (wild->kind == WILD_ANY && nseg)
+		wild->kind = WILD_GLOB;
+	if (wild->kind == WILD_ANY)
+		return wild;
+
+	wild->lits = new_malloc(wild->score);
+	wild->seg = new_malloc((nseg ? nseg : 1) * sizeof *wild->seg);
+	wild->head = *mask != '*';
+	wild->tail = 1;
+	lp = wild->lits;
+	in_seg = 0;
+	for (m = mask; *m; m++)
+	{
+		if (*m == '*')
+		{
+			in_seg = 0;
+			wild->tail = 0;
+			continue;
+		}
+		if (*m == '\\')
+			m++;
+		if (!in_seg)
+		{
+			wild->seg[wild->nseg].str = lp;
+			wild->seg[wild->nseg].len = 0;
+			wild->nseg++;
+		}
+		in_seg = 1;
+		wild->tail = 1;
+		*lp++ = my_tolower(*m);
+		wild->seg[wild->nseg - 1].len++;
+	}
+	if (wild->nseg == 0)
+	{
+		/* the empty mask, which matches only the empty string */
+		wild->seg[0].str = wild->lits;
+		wild->seg[0].len = 0;
+		wild->nseg = 1;
+	}
+	return wild;
+}
+
+/*
+ * wild_seg_at: 1 if seg is at str.  a nul in str never matches, so it
+ * may be shorter than seg.
+ */
+static	int
+wild_seg_at(WildSeg *seg, u_char *str)
+{
+	size_t	i;
+
+	for (i = 0; i < seg->len; i++)
+		if (my_tolower(str[i]) != seg->str[i])
+			return 0;
+	return 1;
+}
+
+/* wild_exec: match str against wild, and return what wild_match() would */
+int
+wild_exec(Wild *wild, u_char *str)
+{
+	u_char	*end;
+	WildSeg	*seg = wild->seg,
+		*last = wild->seg + wild->nseg - 1;
+
+	switch (wild->kind)
+	{
+	case WILD_ANY:
+		return 1;
+	case WILD_SLOW:
+		return wild_match(wild->mask, str);
+	case WILD_LITERAL:
+		if (!wild_seg_at(seg, str) || str[seg->len])
+			return 0;
+		return wild->score;
+	}
+
+	if (wild->head)
+	{
+		if (!wild_seg_at(seg, str))
+			return 0;
+		str += seg->len;
+		seg++;
+	}
+	if (seg > last)
+		return wild->score;
+	end = str + my_strlen(str);
+	if (wild->tail)
+	{
+		if ((size_t) (end - str) < last->len ||
+		    !wild_seg_at(last, end - last->len))
+			return 0;
+		end -= last->len;
+		last--;
+	}
+	for (; seg <= last; seg++)
+	{
+		for (;; str++)
+		{
+			if ((size_t) (end - str) < seg->len)
+				return 0;
+			if (my_tolower(*str) == seg->str[0] &&
+			    wild_seg_at(seg, str))
+				break;
+		}
+		str += seg->len;
+	}
+	return wild->score;
+}
+
+/*
+ * wild_hash: a hash of the len bytes at str, folding case as matching
+ * does, so that whatever a literal matches hashes as it does.
+ */
+unsigned
+wild_hash(u_char *str, size_t len)
+{
+	unsigned hash = 0;
+
+	while (len--)
+		hash = hash * 31 + my_tolower(*str++);
+	return hash;
+}
+
+void
+wild_free(Wild **wild)
+{
+	if (!*wild)
+		return;
+	new_free(&(*wild)->mask);
+	new_free(&(*wild)->lits);
+	new_free(&(*wild)->seg);
+	new_free(wild);
+}
@@ -115,6 +115,7 @@ static	void	screen_set_fdin(Screen *, int);
 static	void	screen_set_fpout(Screen *, FILE *);
 static	void	screen_set_wserv_fd(Screen *, int);
 static	void	screen_set_fdout(Screen *, int);
+static	void	screen_add_output(u_char *);
 
 /* are we currently processing a redirect command? */
 static	int	current_in_redirect;
@@ -262,6 +263,7 @@ kill_screen(Screen *screen)
 		/* But fdout is attached to fpout, so close that too.. */
 		fclose(screen_get_fpout(screen));
 	}
+	new_io_register(screen_get_wserv_fd(screen), 0);
 	while ((window = screen_get_window_list(screen)))
 	{
 		screen->window_list = window_get_next(window);
@@ -569,6 +571,25 @@ in_redirect(void)
  */
 void
 add_to_screen(u_char *incoming)
+{
+	static	int	level = 0;
+	struct	timeval	start;
+	int	timed = 0;
+
+	/* time what lines from servers cost to display; see SERVERSTATS */
+	if (level++ == 0 && parsing_server() != -1)
+	{
+		gettimeofday(&start, NULL);
+		timed = 1;
+	}
+	screen_add_output(incoming);
+	if (timed)
+		server_stats_display(&start);
+	level--;
+}
+
+static	void
+screen_add_output(u_char *incoming)
 {
 	Win_Trav wt;
 	Window	*tmp;
@@ -1241,6 +1262,7 @@ static void
 screen_set_fdin(Screen *screen, int fdin)
 {
 	screen->fdin = fdin;
+	new_io_register(fdin, NEWIO_READ);
 }
 
 FILE *
@@ -1259,6 +1281,7 @@ static void
 screen_set_wserv_fd(Screen *screen, int wserv_fd)
 {
 	screen->wserv_fd = wserv_fd;
+	new_io_register(wserv_fd, NEWIO_READ);
 }
 
 unsigned
@@ -60,8 +60,33 @@ int	connect_to_unix(int, u_char *);
 #include "notice.h"
 #include "ssl.h"
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_GETRUSAGE)
+#include <sys/resource.h>
+#endif
+
 #include <assert.h>
 
+/*
+ * SendQ: a line waiting to be written to a server.  the text follows
+ * the structure in the same allocation.
+ */
+typedef	struct	sendq_stru
+{
+	struct	sendq_stru	*next;
+	size_t	len;
+	u_char	data[1];
+}	SendQ;
+
+/* most lines handed to one writev() when flushing a send queue */
+#define SENDQ_IOV	64
+
+/* how long close_server() waits for a send queue to drain */
+#define SENDQ_CLOSE_WAIT	2
+
 /* Server: a structure for the server_list */
 typedef	struct
 {
@@ -93,7 +118,6 @@ typedef	struct
 	int	motd;			/* motd flag (used in notice.c) */
 	int	sent;			/* set if something has been sent,
 					   used for redirect */
-	u_char	*buffer;		/* buffer of what dgets() doesn't get */
 	WhoisQueue *WQ_head;		/* WHOIS Queue head */
 	WhoisQueue *WQ_tail;		/* WHOIS Queue tail */
 	WhoisStuff whois_stuff;		/* Whois Queue current collection buf */
@@ -103,13 +127,28 @@ typedef	struct
 	u_char	*group;			/* ICB group */
 	u_char	*icbmode;		/* ICB initial mode */
 	ChannelList *chan_list;		/* list of channels for this server */
+	NickIndex *nick_index;		/* channels each nick is on, for
+					   names.c */
+	ChanHash *chan_hash;		/* chan_list by name, for names.c */
+	UserhostCache *userhost_cache;	/* recently seen user@hosts, for
+					   names.c */
 	void	(*parse_server)(u_char *); /* pointer to parser for this
 					      server */
 	int	server_group;		/* group this server belongs to */
 	int	attempting_to_connect;	/* are we trying to connect this
 					   server? */
-	struct	addrinfo *res, *res0;	/* current lookup; for non blocking
-					   support */
+	SOCKADDR_STORAGE *addrs;	/* addresses found for the server
+					   (or its proxy) */
+	int	naddrs;			/* how many in addrs */
+	int	next_addr;		/* next of addrs to connect to */
+	int	dns_fd;			/* pipe from the resolver, or -1 */
+	pid_t	dns_pid;		/* process id of the resolver */
+	u_char	*dns_buf;		/* what the resolver has said so far */
+	size_t	dns_len;		/* length of dns_buf */
+	int	*race_fds;		/* connects to addrs still going */
+	int	nrace;			/* how many in race_fds */
+	int	race_error;		/* errno of the last one to fail */
+	struct	timeval	race_next;	/* when to start on another of addrs */
 	SOCKADDR_STORAGE *localaddr;	/* currently bound local port */
 	int 	localaddrlen;		/* length of above */
 	SslInfo	*ssl_info;		/* handle for ssl routines */
@@ -117,6 +156,24 @@ typedef	struct
 	void	*server_private;	/* private data per protocol */
 	server_private_cb_type server_private_cb; /* callback to free
 					   server_private */
+	SendQ	*sendq_head;		/* lines not yet written */
+	SendQ	*sendq_tail;
+	size_t	sendq_off;		/* bytes of sendq_head already written */
+	size_t	sendq_bytes;		/* bytes in the queue, all told */
+	int	sendq_backed_up;	/* over SEND_QUEUE_HIGH, and not yet
+					   back under SEND_QUEUE_LOW */
+	SendQ	*sched_head[SENDQ_CLASSES]; /* lines held back by
+					   SEND_QUEUE_RATE, per class */
+	SendQ	*sched_tail[SENDQ_CLASSES];
+	int	sched_lines[SENDQ_CLASSES];
+	size_t	sched_bytes;		/* bytes held back, all told */
+	long	sched_credit;		/* milliseconds of rate saved up */
+	struct	timeval	sched_stamp;	/* when sched_credit was updated */
+	ServerStats stats;		/* traffic and lag counters */
+	struct	timeval	ping_sent;	/* when the lag PING went, or 0 */
+	time_t	ping_last;		/* when the last one went */
+	int	caps;			/* CAP_* the server has ACKed */
+	int	cap_ask;		/* CAP_* offered in CAP LS, so far */
 }	Server;
 
 /* default SSL for IRC connections */
@@ -131,7 +188,6 @@ struct ser_group_list
 	int	number;
 };
 
-static	void	add_to_server_buffer(int, u_char *);
 static	void	login_to_server(int);
 static	int	connect_to_server_direct(u_char *, int, u_char *, int);
 static	int	connect_to_server_process(u_char *, int, u_char *, int);
@@ -139,8 +195,38 @@ static	void	irc2_login_to_server(int);
 static	void	server_group_get_connected_next(int);
 static	int	reconnect_to_server(int, int);
 static	void	parse_server(u_char *);
+static	void	server_parse_line(int, u_char *, size_t);
 static	ssl_init_status	server_check_ssl(int);
 static	void	reestablish_close_server(int, int);
+static	void	server_connection_lost(int, const char *);
+static	int	server_resolve(int, u_char *, int);
+static	void	server_resolve_abort(int);
+static	void	server_dns_read(int);
+static	void	server_dns_free(int);
+static	int	server_connect_next(int);
+static	int	server_connect_fd(int, int);
+static	void	server_connect_error(int, const char *, int);
+static	void	server_dns_interleave(int);
+static	int	server_race_add(int, int);
+static	void	server_race_check(int);
+static	void	server_race_abort(int);
+static	int	server_drain_more(int, int, int, struct timeval *);
+static	void	server_sendq_add(int, u_char *, size_t);
+static	SendQ	*server_sendq_new(u_char *, size_t);
+static	void	server_sendq_append(int, SendQ *);
+static	int	server_sendq_flush(int);
+static	void	server_sendq_drain(int, int);
+static	void	server_sendq_free(int);
+static	void	server_sendq_set_io(int);
+static	void	server_sendq_check(int);
+static	int	server_sendq_class(int, u_char *);
+static	void	server_stats_reset(int);
+static	long	server_usec_since(struct timeval *, struct timeval *);
+static	void	server_stats_show(int);
+static	void	server_sched_add(int, int, u_char *, size_t);
+static	void	server_sched_refill(int);
+static	void	server_sched_release(int);
+static	void	server_sched_flush(int);
 
 /* server_list: the list of servers that the user can connect to,etc */
 static	Server	*server_list = NULL;
@@ -165,6 +251,10 @@ static	int	connected_to_server_local = 0;	/* true when connection is
 						 * confirmed */
 static	int	parsing_server_index = -1;	/* set to the server we last
 						   got a message from */
+static	int	send_class = SENDQ_BULK;	/* class of lines being sent;
+						   see server_set_send_class() */
+static	int	connect_next_addr = 0;		/* set while moving on to the
+						   next address of a server */
 
 static	u_char	*default_proxy_name;
 static	int	default_proxy_port;
@@ -173,6 +263,9 @@ static	int	default_proxy_port;
 
 #define DEFAULT_PROXY_PORT	3128
 
+/* how long to give each address before also trying the next (RFC 8305) */
+#define CONNECT_RACE_DELAY	250	/* milliseconds */
+
 /*
  * close_server: Given an index into the server list, this closes the
  * connection to the corresponding server.  It does no checking on the
@@ -186,7 +279,8 @@ close_server(int server_index, u_char *message)
 	u_char	buffer[BIG_BUFFER_SIZE];
 	int	i,
 		min,
-		max;
+		max,
+		old_flags;
 
 	Debug(DB_SERVER, "entered. server %d: '%s'", server_index, message);
 	if (server_index == -1)
@@ -220,23 +314,29 @@ close_server(int server_index, u_char *message)
 
 		server_list[i].operator = 0;
 		server_list[i].connected = 0;
-		server_list[i].buffer = NULL;
+		old_flags = server_list[i].flags;
 		server_list[i].flags = SERVER_2_6_2;
+		server_resolve_abort(i);
+		server_race_abort(i);
+		userhost_cache_clear(i);
+		parse_batch_clear(i);
 		if (-1 != server_list[i].write)
 		{
+			/* as in send_to_server(), held lines go before QUIT */
+			server_sched_flush(i);
 			if (message && *message)
 			{
 				snprintf(CP(buffer), sizeof buffer, "QUIT :%s\n", message);
-				/* XXX retval */
-				ssl_write(server_list[i].ssl_info,
-					  server_list[i].write, CP(buffer),
-					  my_strlen(buffer));
+				server_sendq_add(i, buffer, my_strlen(buffer));
 			}
+			server_sendq_drain(i, (old_flags & CONNECTED) ?
+					      SENDQ_CLOSE_WAIT : 0);
 			new_close(server_list[i].write);
 			if (server_list[i].write == server_list[i].read)
 				server_list[i].read = -1;
 			server_list[i].write = -1;
 		}
+		server_sendq_free(i);
 
 		if (server_list[i].ssl_info)
 		{
@@ -257,28 +357,6 @@ close_server(int server_index, u_char *message)
 	}
 }
 
-/*
- * server_set_bits: Sets the proper bits in the fd_set structure according to
- * which servers in the server list have currently active read descriptors.  
- */
-
-void
-server_set_bits(fd_set *rd, fd_set *wd)
-{
-	int	i;
-
-	for (i = 0; i < number_of_servers(); i++)
-	{
-		if (server_list[i].read != -1)
-			FD_SET(server_list[i].read, rd);
-#ifdef NON_BLOCKING_CONNECTS
-		if (server_list[i].write != -1 &&
-		    !(server_list[i].flags & (LOGGED_IN|CLOSE_PENDING|CONNECTED)))
-			FD_SET(server_list[i].write, wd);
-#endif /* NON_BLOCKING_CONNECTS */
-	}
-}
-
 static int
 reconnect_to_server(int si, int fi)
 {
@@ -310,50 +388,214 @@ reestablish_close_server(int server, int old_server)
 }
 
 /*
- * do_server: check the given fd_set against the currently open servers in
+ * server_drain_more: called by do_server() after a line from server i has
+ * been parsed.  returns 1 if another complete line is already buffered for
+ * des and neither SERVER_DRAIN_LINES nor SERVER_DRAIN_USECONDS have been
+ * used up yet, so that it can be parsed without going back to irc_io().
+ */
+static	int
+server_drain_more(int i, int des, int lines, struct timeval *start)
+{
+	struct	timeval	now;
+	int	max;
+
+	if (server_list[i].read != des || !dgets_buffered(des))
+		return 0;
+	max = get_int_var(SERVER_DRAIN_LINES_VAR);
+	if (max > 0 && lines >= max)
+		return 0;
+	max = get_int_var(SERVER_DRAIN_USECONDS_VAR);
+	if (max > 0)
+	{
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - start->tv_sec) * 1000000L +
+		    (now.tv_usec - start->tv_usec) >= max)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * server_connection_lost: the connection to server i has gone away, or
+ * could not be made at all.  close it, say why (if why is not NULL), and
+ * then try the next address, go back to the server we were switching
+ * away from, or find another server, as appropriate.
+ */
+static	void
+server_connection_lost(int i, const char *why)
+{
+	static	int	times = 0;
+#ifdef NON_BLOCKING_CONNECTS
+	int	rv;
+	int	old_serv = server_list[i].close_serv;
+	/* Get this here before close_server() clears it -Sol */
+	int	logged_in = server_list[i].flags & LOGGED_IN;
+#endif /* NON_BLOCKING_CONNECTS */
+
+	if (server_list[i].flags & CLOSE_PENDING)
+	{
+		/* we were switching away from it anyway */
+		server_list[i].flags &= ~(CLOSE_PENDING|CLEAR_PENDING);
+		close_server(i, empty_string());
+		if (why)
+			say("Connection closed from %s: %s", server_list[i].name, why);
+		server_list[i].eof = 1;
+		return;
+	}
+	close_server(i, empty_string());
+	if (why)
+		say("Connection closed from %s: %s", server_list[i].name, why);
+#ifdef NON_BLOCKING_CONNECTS
+	if (!logged_in &&
+	    server_list[i].next_addr < server_list[i].naddrs)
+	{
+		say("Trying next IP address for %s...", server_list[i].name);
+		connect_next_addr = 1;
+		rv = reconnect_to_server(i, -1);
+		connect_next_addr = 0;
+		if (rv) {
+			say("Connection to server %s failed...", server_list[i].name);
+			clean_whois_queue();
+			window_check_servers();
+		}
+		return;
+	}
+
+	if (!logged_in && old_serv != -1)
+	{
+		if (old_serv == i)	/* a hack?  you bet */
+			goto a_hack;
+		reestablish_close_server(i, old_serv);
+		return;
+	}
+a_hack:
+#endif /* NON_BLOCKING_CONNECTS */
+	if (i == primary_server)
+	{
+		if (server_list[i].eof)
+		{
+			say("Unable to connect to server %s",
+				server_list[i].name);
+			if (i == number_of_servers() - 1)
+			{
+				clean_whois_queue();
+				window_check_servers();
+				if (!connected_to_server())
+					say("Use /SERVER to connect to a server");
+				times = 0;
+			}
+			else
+				server_group_get_connected_next(i);
+		}
+		else
+		{
+			if (times++ > 1)
+			{
+				clean_whois_queue();
+				window_check_servers();
+				if (!connected_to_server())
+					say("Use /SERVER to connect to a server");
+				times = 0;
+			}
+			else
+				get_connected(i);
+		}
+	}
+	else if (server_list[i].eof)
+	{
+		say("Connection to server %s lost.", server_list[i].name);
+		clean_whois_queue();
+		window_check_servers();
+	}
+	else
+	{
+		if (reconnect_to_server(i, -1)) {
+			say("Connection to server %s lost.", server_list[i].name);
+			clean_whois_queue();
+			window_check_servers();
+		}
+	}
+	server_list[i].eof = 1;
+}
+
+/*
+ * do_server: check the ready descriptors against the currently open servers in
  * the server list.  If one have information available to be read, it is read
  * and and parsed appropriately.  If an EOF is detected from an open server,
  * one of two things occurs. 1) If the server was the primary server,
  * get_connected() is called to maintain the connection status of the user.
  * 2) If the server wasn't a primary server, connect_to_server() is called to
  * try to keep that connection alive. 
+ *
+ * any further complete lines that are already buffered are parsed as
+ * well, within the SERVER_DRAIN_* budget.
  */
 void
-do_server(fd_set *rd, fd_set *wd)
+do_server(void)
 {
-	u_char	lbuf[BIG_BUFFER_SIZE];
 	int	des, j;
-	static	int	times = 0;
 	int	old_timeout;
-	u_char	*close_msg;
 
 	for (j = 0; j < number_of_servers(); j++)
 	{
-		close_msg = empty_string();
+		if ((des = server_list[j].dns_fd) != -1 &&
+		    (new_io_ready(des) & NEWIO_READ))
+			server_dns_read(j);
 #ifdef NON_BLOCKING_CONNECTS
+		if (server_list[j].nrace)
+			server_race_check(j);
 		/*
 		 *	deraadt@theos.com suggests that every fd awaiting connection
 		 *	should be run at this point.
 		 */
-		if ((des = server_list[j].write) != -1 && /*FD_ISSET(des, wd) &&*/
+		if ((des = server_list[j].write) != -1 &&
 		    !(server_list[j].flags & (LOGGED_IN|CONNECTED))) {
 			SOCKADDR_STORAGE sa;
 			socklen_t salen = sizeof sa;
 
+			int	error = 0;
+			socklen_t errlen = sizeof error;
+
 			if (getpeername(server_list[j].write, (struct sockaddr *) &sa, &salen) != -1)
 				login_to_server((from_server = j));
+			else if (new_io_ready(des))
+			{
+				/* the connect has failed; find out why */
+				if (getsockopt(des, SOL_SOCKET, SO_ERROR,
+					       (void *) &error, &errlen) == -1)
+					error = errno;
+				from_server = j;
+				server_connect_error(j, "connect", error);
+				server_connection_lost(j, NULL);
+				continue;
+			}
 		}
 #endif /* NON_BLOCKING_CONNECTS */
-		if ((des = server_list[j].read) != -1 && FD_ISSET(des, rd))
+		if ((des = server_list[j].write) != -1 &&
+		    server_list[j].sendq_head &&
+		    (new_io_ready(des) & NEWIO_WRITE))
+		{
+			server_sendq_flush(j);
+			server_sched_release(j);
+			server_sendq_check(j);
+		}
+		if ((des = server_list[j].write) != -1 &&
+		    (server_list[j].flags & (CONNECTED|LOGGED_IN)) == CONNECTED &&
+		    (new_io_ready(des) & NEWIO_WRITE))
+			login_to_server((from_server = j));
+		if ((des = server_list[j].read) != -1 &&
+		    (new_io_ready(des) & NEWIO_READ))
 		{
 			int	junk;
-			u_char 	*bufptr;
-			u_char	*s;
+			u_char	*line;
 			int	i = j; /* i is always j? */
 			int	old_sep = -1;
 			int	is_icb;
+			int	lines = 0;
+			struct	timeval	start;
 			size_t	len;
 
+			gettimeofday(&start, NULL);
 			from_server = i;
 			is_icb = server_get_version(from_server) == ServerICB;
 
@@ -372,121 +614,29 @@ do_server(fd_set *rd, fd_set *wd)
 			if (is_icb)
 				old_sep = dgets_set_separator('\0');
 
+read_line:
+			from_server = i;
 			old_timeout = dgets_timeout(1);
-			s = server_list[from_server].buffer;
-			bufptr = lbuf;
-			if (s && *s)
-			{
-				len = my_strlen(s);
-				my_strncpy(lbuf, s, len);
-				bufptr += len;
-			}
-			else
-				len = 0;
-			if (len >= sizeof(lbuf))
-				goto buffer_is_full_hack;	/* XXX */
-			junk = dgets(bufptr, (sizeof(lbuf) - len), des);
+			junk = dgets_view(des, &line, &len);
 			(void) dgets_timeout(old_timeout);
 
 			switch (junk)
 			{
 			case -2:
 				/* SSL retry */
-				goto real_continue;
 			case -1:
-				add_to_server_buffer(from_server, lbuf);
+				/* partial lines are kept by dgets_view() */
 				goto real_continue;
 			case 0:
-			{
-#ifdef NON_BLOCKING_CONNECTS
-				int	old_serv = server_list[i].close_serv;
-			/* Get this here before close_server() clears it -Sol */
-				int	logged_in = server_list[i].flags & LOGGED_IN;
-#endif /* NON_BLOCKING_CONNECTS */
-
-				close_server(i, close_msg);
-				say("Connection closed from %s: %s", server_list[i].name,
-					dgets_errno() == -1 ? "Remote end closed connection" : strerror(dgets_errno()));
-#ifdef NON_BLOCKING_CONNECTS
-				if (!logged_in && server_list[i].res0)
-				{
-					say("Trying next IP address for %s...", server_list[i].name);
-					if (reconnect_to_server(i, -1)) {
-						say("Connection to server %s failed...", server_list[i].name);
-						clean_whois_queue();
-						window_check_servers();
-					}
-					goto real_continue;
-				}
-
-				if (!logged_in && old_serv != -1)
-				{
-					if (old_serv == i)	/* a hack?  you bet */
-						goto a_hack;
-					reestablish_close_server(i, old_serv);
-					break;
-				}
-a_hack:
-#endif /* NON_BLOCKING_CONNECTS */
-				if (i == primary_server)
-				{
-					if (server_list[i].eof)
-					{
-						say("Unable to connect to server %s",
-							server_list[i].name);
-						if (i == number_of_servers() - 1)
-  						{
-							clean_whois_queue();
-							window_check_servers();
-							if (!connected_to_server())
-								say("Use /SERVER to connect to a server");
-							times = 0;
-						}
-						else
-							server_group_get_connected_next(i);
-					}
-					else
-					{
-						if (times++ > 1)
-						{
-							clean_whois_queue();
-							window_check_servers();
-							if (!connected_to_server())
-								say("Use /SERVER to connect to a server");
-							times = 0;
-  						}
-						else
-							get_connected(i);
-					}
-				}
-				else if (server_list[i].eof)
-				{
-					say("Connection to server %s lost.", server_list[i].name);
-					clean_whois_queue();
-					window_check_servers();
-				}
-				else
-				{
-					if (reconnect_to_server(i, -1)) {
-						say("Connection to server %s lost.", server_list[i].name);
-						clean_whois_queue();
-						window_check_servers();
-					}
-				}
-				server_list[i].eof = 1;
+				server_connection_lost(i,
+				    dgets_errno() == -1 ? "Remote end closed connection" : strerror(dgets_errno()));
 				break;
-			}
 			default:
-buffer_is_full_hack:
-				{
-					int	old_psi = parsing_server_index;
-
-					parsing_server_index = i;
-					parse_server(lbuf);
-					new_free(&server_list[i].buffer);
-					parsing_server_index = old_psi;
-					break;
-				}
+				server_parse_line(i, line, len);
+				dgets_view_release();
+				if (server_drain_more(i, des, ++lines, &start))
+					goto read_line;
+				break;
 			}
 real_continue:
 			from_server = primary_server;
@@ -563,6 +713,8 @@ add_to_server_list(u_char *server, int port, u_char *proxy_name, int proxy_port,
 		   u_char *password, u_char *nick,
 		   int group, int type, int flags)
 {
+	int	i;
+
 	Debug(DB_SERVER, "server '%s' port %d pass '%s' nick '%s' group %d "
 			 "type %d flags %x proxy %s:%d", server, port, password,
 			 nick, group, type, flags,
@@ -595,6 +747,9 @@ add_to_server_list(u_char *server, int port, u_char *proxy_name, int proxy_port,
 		server_list[from_server].group = NULL;
 		server_list[from_server].icbmode = NULL;
 		server_list[from_server].chan_list = NULL;
+		server_list[from_server].nick_index = NULL;
+		server_list[from_server].chan_hash = NULL;
+		server_list[from_server].userhost_cache = NULL;
 		malloc_strcpy(&server_list[from_server].name, server);
 		if (password && *password)
 			malloc_strcpy(&server_list[from_server].password, password);
@@ -619,12 +774,29 @@ add_to_server_list(u_char *server, int port, u_char *proxy_name, int proxy_port,
 		server_list[from_server].whois_stuff.chop = 0;
 		server_list[from_server].whois_stuff.not_on = 0;
 		server_list[from_server].who_info = alloc_who_info();
-		server_list[from_server].buffer = NULL;
 		server_list[from_server].close_serv = -1;
 		server_list[from_server].localaddr = 0;
 		server_list[from_server].localaddrlen = 0;
 		server_list[from_server].ssl_info = NULL;
 		server_list[from_server].server_private = NULL;
+		server_list[from_server].sendq_head = NULL;
+		server_list[from_server].sendq_tail = NULL;
+		server_list[from_server].sendq_off = 0;
+		server_list[from_server].sendq_bytes = 0;
+		server_list[from_server].sendq_backed_up = 0;
+		for (i = 0; i < SENDQ_CLASSES; i++)
+		{
+			server_list[from_server].sched_head[i] = NULL;
+			server_list[from_server].sched_tail[i] = NULL;
+			server_list[from_server].sched_lines[i] = 0;
+		}
+		server_list[from_server].sched_bytes = 0;
+		server_list[from_server].sched_credit = 0;
+		server_list[from_server].sched_stamp.tv_sec = 0;
+		server_list[from_server].sched_stamp.tv_usec = 0;
+		server_list[from_server].caps = 0;
+		server_list[from_server].cap_ask = 0;
+		server_stats_reset(from_server);
 		if (flags & SL_ADD_DO_SSL_VERIFY)
 			server_list[from_server].ssl_level = SSL_VERIFY;
 		else if (flags & SL_ADD_DO_SSL)
@@ -657,8 +829,16 @@ add_to_server_list(u_char *server, int port, u_char *proxy_name, int proxy_port,
 			server_list[from_server].server_group = 0;
 		else
 			server_list[from_server].server_group = group;
-		server_list[from_server].res = 0;
-		server_list[from_server].res0 = 0;
+		server_list[from_server].addrs = NULL;
+		server_list[from_server].naddrs = 0;
+		server_list[from_server].next_addr = 0;
+		server_list[from_server].dns_fd = -1;
+		server_list[from_server].dns_pid = -1;
+		server_list[from_server].dns_buf = NULL;
+		server_list[from_server].dns_len = 0;
+		server_list[from_server].race_fds = NULL;
+		server_list[from_server].nrace = 0;
+		server_list[from_server].race_error = 0;
 	}
 	else
 	{
@@ -677,12 +857,6 @@ add_to_server_list(u_char *server, int port, u_char *proxy_name, int proxy_port,
 			if (group != -1)
 				server_list[from_server].server_group = group;
 		}
-		if (server_list[from_server].res0)
-		{
-			freeaddrinfo(server_list[from_server].res0);
-			server_list[from_server].res0 = 0;
-		}
-		server_list[from_server].res = 0;
 		if ((int) my_strlen(server) > (int) my_strlen(server_list[from_server].name))
 			malloc_strcpy(&(server_list[from_server].name), server);
 	}
@@ -744,8 +918,7 @@ remove_from_server_list(int i)
 		new_free(&server_list[i].whois_stuff.server_stuff);
 	if (server_list[i].ctcp_flood)
 		ctcp_clear_flood(&server_list[i].ctcp_flood);
-	if (server_list[i].res0)
-		freeaddrinfo(server_list[i].res0);
+	server_dns_free(i);
 
 	/* update all the structs with server in them */
 	window_server_delete(i);
@@ -1062,11 +1235,12 @@ static	int
 connect_to_server_direct(u_char *server_name, int port, u_char *nick, int server_index)
 {
 	int	new_des;
-	struct	addrinfo *r = 0, *r0 = 0;
 	u_char	*connect_name;
 	int	connect_port;
 	u_char	*proxy_name = NULL;
 	int	proxy_port = 0;
+	int	old_server = from_server;
+	int	rv;
 
 	if (server_index >= 0)
 		server_list[server_index].oper_command = 0;
@@ -1094,171 +1268,594 @@ connect_to_server_direct(u_char *server_name, int port, u_char *nick, int server
 		proxy_port = connect_port;
 	}
 
-#ifdef HAVE_SYS_UN_H
-	if (*server_name == '/')
-		new_des = connect_to_unix(port, server_name);
-	else
-#endif /* HAVE_SYS_UN_H */
-	{
-		if (server_index >= 0 &&
-		    server_list[server_index].res &&
-		    server_list[server_index].res0)
-			new_des = connect_by_number(connect_port, connect_name,
-					1, &server_list[server_index].res,
-					&server_list[server_index].res0);
-		else
-		{
-
-			new_des = connect_by_number(connect_port, connect_name,
-					1, &r, &r0);
-		}
-	}
-	if (new_des < 0)
-	{
-		int	error = errno;
-
-		char *e = NULL;
-		switch (new_des)
-		{
-		default:
-		case -2:
-			error = 0;
-		case -1:
-			e = "Unknown host";
-			break;
-		case -3:
-			e = "socket";
-			break;
-		case -4:
-			e = "connect";
-			break;
-		}
-			
-		if (proxy_name)
-			say("Unable to connect to port %d of server %s "
-			    "(proxy %s:%d): %s%s%s",
-			    port, server_name,
-			    proxy_name, proxy_port,
-			    e, error ? ": " : "", error ? strerror(error) : "");
-		else
-			say("Unable to connect to port %d of server %s: %s%s%s",
-			    port, server_name,
-			    e, error ? ": " : "", error ? strerror(error) : "");
-		if (is_server_open(from_server))
-			say("Connection to server %s resumed...", server_list[from_server].name);
-		return (-1);
-	}
-
 	update_all_status();
 	add_to_server_list(server_name, port, proxy_name, proxy_port, NULL,
 			   nick, -1, server_get_version(from_server),
 			   SL_ADD_OVERWRITE);
 
-	if (server_list[from_server].localaddr)
-		new_free(&server_list[from_server].localaddr);
-	server_list[from_server].localaddr = 0;
-
 #ifdef HAVE_SYS_UN_H
 	if (*server_name == '/')
 	{
-		server_list[from_server].localaddr = 0;
-		server_list[from_server].localaddrlen = 0;
-	}
-	else
-#endif /* HAVE_SYS_UN_H */
-	{
-		SOCKADDR_STORAGE *localaddr = new_malloc(sizeof *localaddr);
-		socklen_t address_len = sizeof *localaddr;
-
-		if (getsockname(new_des, (struct sockaddr *) localaddr, &address_len)
-		    >= 0)
+		if ((new_des = connect_to_unix(port, server_name)) < 0)
 		{
-			server_list[from_server].localaddr = localaddr;
-			server_list[from_server].localaddrlen = address_len;
+			server_connect_error(from_server,
+			    new_des == -3 ? "socket" : "connect", errno);
+			rv = -1;
 		}
 		else
-		{
-			close(new_des);
-			say("Could not getsockname(): %s", strerror(errno));
-			new_free(&localaddr);
-			return -1;
-		}
-	}
-	if (port)
-	{
-		server_list[from_server].read = new_des;
-		server_list[from_server].write = new_des;
+			rv = server_connect_fd(from_server, new_des);
 	}
 	else
-		server_list[from_server].read = new_des;
-	if (!server_list[from_server].res0 && r && r0)
+#endif /* HAVE_SYS_UN_H */
+	/*
+	 * carry on through the addresses we already have, if the last
+	 * one didn't work out, otherwise look the name up again.
+	 */
+	if (connect_next_addr &&
+	    server_list[from_server].next_addr < server_list[from_server].naddrs)
+		rv = server_connect_next(from_server);
+	else
+		rv = server_resolve(from_server, connect_name, connect_port);
+
+	if (rv)
 	{
-		server_list[from_server].res = r;
-		server_list[from_server].res0 = r0;
+		from_server = old_server;
+		if (is_server_open(from_server))
+			say("Connection to server %s resumed...", server_list[from_server].name);
 	}
-
-	server_list[from_server].operator = 0;
-	return (0);
+	return rv;
 }
 
 /*
- * connect_to_server_process: handles the tcp connection to a server.  If
- * successful, the user is disconnected from any previously connected server,
- * the new server is added to the server list, and the user is registered on
- * the new server.  If connection to the server is not successful,  the
- * reason for failure is displayed and the previous server connection is
- * resumed uniterrupted. 
- *
- * This version of connect_to_server() uses the ircio process to talk to a
- * server 
+ * server_resolve: find the addresses for host and port, and start
+ * connecting to server.  a numeric host is done here and now; otherwise
+ * getaddrinfo() is run in a child process, so that a slow name server
+ * does not hold everything else up, and do_server() picks up the answer
+ * with server_dns_read().  returns -1 if this failed straight away.
  */
 static	int
-connect_to_server_process(u_char *server_name, int port, u_char *nick, int server_index)
+server_resolve(int server, u_char *host, int port)
 {
-	int	write_des[2],
-		read_des[2],
-		pid,
-		c;
-	u_char	*path,
-		*name = NULL,
-		*s;
-	u_char	buffer[BIG_BUFFER_SIZE];
-	int	old_timeout;
-
-	path = UP(IRCIO_PATH);
-	if ((s = my_rindex(path, '/')) != NULL)
-		malloc_strcpy(&name, s + 1);
-	if (!name)
-		name = path;
-	if (*path == '\0')
-		return (connect_to_server_direct(server_name, port, nick, server_index));
-	if (server_index >= 0)
-		server_list[server_index].oper_command = 0;
-	write_des[0] = -1;
-	write_des[1] = -1;
-	if (pipe(write_des) || pipe(read_des))
+	struct	addrinfo hints, *res, *res0;
+	u_char	strport[NI_MAXSERV];
+	int	fds[2];
+	int	err,
+		i;
+	pid_t	pid;
+
+	server_dns_free(server);
+	snprintf(CP(strport), sizeof strport, "%d", port);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(CP(host), CP(strport), &hints, &res0) == 0)
 	{
-		if (write_des[0] != -1)
+		for (res = res0; res; res = res->ai_next)
+			server_list[server].naddrs++;
+		server_list[server].addrs = new_malloc(server_list[server].naddrs *
+					    sizeof(*server_list[server].addrs));
+		for (i = 0, res = res0; res; res = res->ai_next, i++)
 		{
-			new_close(write_des[0]);
-			new_close(write_des[1]);
+			memset(&server_list[server].addrs[i], 0,
+			       sizeof(*server_list[server].addrs));
+			memcpy(&server_list[server].addrs[i], res->ai_addr,
+			       res->ai_addrlen);
 		}
-		say("Couldn't start new process: %s", strerror(errno));
-		return (connect_to_server_direct(server_name, port, nick, server_index));
+		freeaddrinfo(res0);
+		return server_connect_next(server);
+	}
+
+	if (pipe(fds) == -1)
+	{
+		say("Couldn't start resolver: %s", strerror(errno));
+		return -1;
 	}
 	switch (pid = fork())
 	{
 	case -1:
-		say("Couldn't start new process: %s\n", strerror(errno));
-		return (-1);
+		say("Couldn't start resolver: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
 	case 0:
+		/*
+		 * send back the getaddrinfo() error, then each address in
+		 * a SOCKADDR_STORAGE of its own.
+		 */
 		(void) MY_SIGNAL(SIGINT, (sigfunc *)SIG_IGN, 0);
-		dup2(read_des[1], 1);
-		dup2(write_des[0], 0);
-		new_close(read_des[0]);
-		new_close(read_des[1]);
-		new_close(write_des[0]);
-		new_close(write_des[1]);
+		close(fds[0]);
+		hints.ai_flags = 0;
+		err = getaddrinfo(CP(host), CP(strport), &hints, &res0);
+		if (write(fds[1], &err, sizeof err) != sizeof err)
+			_exit(1);
+		if (err == 0)
+		{
+			SOCKADDR_STORAGE sa;
+
+			for (res = res0; res; res = res->ai_next)
+			{
+				if (res->ai_addrlen > sizeof sa)
+					continue;
+				memset(&sa, 0, sizeof sa);
+				memcpy(&sa, res->ai_addr, res->ai_addrlen);
+				if (write(fds[1], &sa, sizeof sa) != sizeof sa)
+					_exit(1);
+			}
+		}
+		_exit(0);
+	default:
+		close(fds[1]);
+		break;
+	}
+	Debug(DB_SERVER, "server %d: resolving %s in process %d", server,
+	      host, (int)pid);
+	set_non_blocking(fds[0]);
+	server_list[server].dns_fd = fds[0];
+	server_list[server].dns_pid = pid;
+	new_io_register(fds[0], NEWIO_READ);
+	return 0;
+}
+
+/*
+ * server_resolve_abort: stop looking up the name for server.
+ */
+static	void
+server_resolve_abort(int server)
+{
+	if (server_list[server].dns_fd == -1)
+		return;
+	kill(server_list[server].dns_pid, SIGKILL);
+	new_close(server_list[server].dns_fd);
+	server_list[server].dns_fd = -1;
+	server_list[server].dns_pid = -1;
+	new_free(&server_list[server].dns_buf);
+	server_list[server].dns_len = 0;
+}
+
+/*
+ * server_dns_read: the resolver for server has something to say.  once
+ * it has said it all, start connecting to the addresses it found.
+ */
+static	void
+server_dns_read(int server)
+{
+	u_char	buf[1024];
+	ssize_t	n;
+	int	err,
+		i;
+
+	n = read(server_list[server].dns_fd, buf, sizeof buf);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+	{
+		server_list[server].dns_buf = new_realloc(server_list[server].dns_buf,
+					      server_list[server].dns_len + n);
+		memcpy(server_list[server].dns_buf + server_list[server].dns_len,
+		       buf, n);
+		server_list[server].dns_len += n;
+		return;
+	}
+
+	/* it has finished */
+	new_close(server_list[server].dns_fd);
+	server_list[server].dns_fd = -1;
+	server_list[server].dns_pid = -1;
+	err = EAI_FAIL;
+	if (server_list[server].dns_len >= sizeof err)
+		memcpy(&err, server_list[server].dns_buf, sizeof err);
+	if (err == 0)
+	{
+		server_list[server].naddrs = (server_list[server].dns_len -
+		    sizeof err) / sizeof(*server_list[server].addrs);
+		server_list[server].addrs = new_malloc(server_list[server].naddrs *
+					    sizeof(*server_list[server].addrs));
+		for (i = 0; i < server_list[server].naddrs; i++)
+			memcpy(&server_list[server].addrs[i],
+			       server_list[server].dns_buf + sizeof err +
+			       i * sizeof(*server_list[server].addrs),
+			       sizeof(*server_list[server].addrs));
+	}
+	new_free(&server_list[server].dns_buf);
+	server_list[server].dns_len = 0;
+	Debug(DB_SERVER, "server %d: resolver done, error %d, %d addresses",
+	      server, err, server_list[server].naddrs);
+
+	from_server = server;
+	if (err != 0 || server_list[server].naddrs == 0)
+	{
+		server_connect_error(server, "Unknown host", 0);
+		server_connection_lost(server, NULL);
+	}
+	else
+	{
+		server_dns_interleave(server);
+		if (server_connect_next(server) == 0)
+		{
+			SOCKADDR_STORAGE sa;
+			socklen_t salen = sizeof sa;
+
+			if (server_list[server].read != -1 &&
+			    getpeername(server_list[server].read,
+					(struct sockaddr *) &sa, &salen) != -1)
+				login_to_server(server);
+		}
+		else
+			server_connection_lost(server, NULL);
+	}
+}
+
+/*
+ * server_dns_interleave: put the addresses for server in an order that
+ * alternates between address families, keeping the resolver's order
+ * within each family, so that a broken IPv6 (or IPv4) path does not
+ * hold up all the others.
+ */
+static	void
+server_dns_interleave(int server)
+{
+	SOCKADDR_STORAGE *in = server_list[server].addrs,
+			*out;
+	int	n = server_list[server].naddrs,
+		*used,
+		i, j,
+		first,
+		want_first = 1;
+
+	if (n < 3)
+		return;
+	out = new_malloc(n * sizeof(*out));
+	used = new_malloc(n * sizeof(*used));
+	memset(used, 0, n * sizeof(*used));
+	first = ((struct sockaddr *) &in[0])->sa_family;
+	for (i = 0; i < n; i++)
+	{
+		/* the next unused one of the family we want, or else any */
+		for (j = 0; j < n; j++)
+			if (!used[j] && want_first ==
+			    (((struct sockaddr *) &in[j])->sa_family == first))
+				break;
+		if (j == n)
+			for (j = 0; used[j]; j++)
+				;
+		used[j] = 1;
+		out[i] = in[j];
+		want_first = !want_first;
+	}
+	new_free(&used);
+	new_free(&server_list[server].addrs);
+	server_list[server].addrs = out;
+}
+
+/*
+ * server_dns_free: forget the addresses found for server.
+ */
+static	void
+server_dns_free(int server)
+{
+	new_free(&server_list[server].addrs);
+	server_list[server].naddrs = 0;
+	server_list[server].next_addr = 0;
+}
+
+/*
+ * server_connect_next: start a connection to the next address of server
+ * that will take one.  returns -1 if none of them would, and there are
+ * no others still trying.
+ */
+static	int
+server_connect_next(int server)
+{
+	int	new_des = -4,
+		error = server_list[server].race_error;
+
+	while (server_list[server].next_addr < server_list[server].naddrs)
+	{
+		new_des = connect_by_number(-2, (u_char *)
+		    &server_list[server].addrs[server_list[server].next_addr++],
+		    1, NULL, NULL);
+		if (new_des >= 0)
+#ifdef NON_BLOCKING_CONNECTS
+			return server_race_add(server, new_des);
+#else
+			return server_connect_fd(server, new_des);
+#endif /* NON_BLOCKING_CONNECTS */
+		error = errno;
+	}
+	if (server_list[server].nrace)
+		return 0;
+	server_dns_free(server);
+	server_list[server].race_error = 0;
+	server_connect_error(server, new_des == -3 ? "socket" : "connect",
+			     error);
+	return -1;
+}
+
+/*
+ * server_race_add: new_des is a connect in progress to one of the
+ * addresses of server.  it races any that are already going; the first
+ * to finish is used, and the rest are closed.  if none has finished
+ * after CONNECT_RACE_DELAY, server_race_run() starts on the next address
+ * as well.
+ */
+static	int
+server_race_add(int server, int new_des)
+{
+	struct	timeval	*tv = &server_list[server].race_next;
+
+	server_list[server].race_fds = new_realloc(server_list[server].race_fds,
+	    (server_list[server].nrace + 1) * sizeof(int));
+	server_list[server].race_fds[server_list[server].nrace++] = new_des;
+	new_io_register(new_des, NEWIO_WRITE);
+	Debug(DB_SERVER, "server %d: connect %d of %d on fd %d", server,
+	      server_list[server].next_addr, server_list[server].naddrs,
+	      new_des);
+
+	gettimeofday(tv, NULL);
+	tv->tv_usec += CONNECT_RACE_DELAY * 1000;
+	tv->tv_sec += tv->tv_usec / 1000000;
+	tv->tv_usec %= 1000000;
+	return 0;
+}
+
+/*
+ * server_race_check: see if any of the connects going for server have
+ * finished.  the first that has succeeded becomes the connection to the
+ * server.  one that has failed makes way for the next address at once.
+ */
+static	void
+server_race_check(int server)
+{
+	SOCKADDR_STORAGE sa;
+	socklen_t salen;
+	int	k,
+		des,
+		error,
+		failed = 0;
+	socklen_t errlen;
+
+	for (k = 0; k < server_list[server].nrace; )
+	{
+		des = server_list[server].race_fds[k];
+		if (!new_io_ready(des))
+		{
+			k++;
+			continue;
+		}
+		salen = sizeof sa;
+		if (getpeername(des, (struct sockaddr *) &sa, &salen) != -1)
+		{
+			Debug(DB_SERVER, "server %d: fd %d won", server, des);
+			server_list[server].race_fds[k] =
+			    server_list[server].race_fds[--server_list[server].nrace];
+			server_race_abort(server);
+			from_server = server;
+			if (server_connect_fd(server, des) == 0)
+				login_to_server(server);
+			else
+				server_connection_lost(server, NULL);
+			return;
+		}
+		error = 0;
+		errlen = sizeof error;
+		if (getsockopt(des, SOL_SOCKET, SO_ERROR, (void *) &error,
+			       &errlen) == -1)
+			error = errno;
+		Debug(DB_SERVER, "server %d: fd %d failed: %s", server, des,
+		      strerror(error));
+		new_close(des);
+		server_list[server].race_fds[k] =
+		    server_list[server].race_fds[--server_list[server].nrace];
+		server_list[server].race_error = error;
+		failed = 1;
+	}
+	if (failed)
+	{
+		from_server = server;
+		if (server_connect_next(server) == -1)
+			server_connection_lost(server, NULL);
+	}
+}
+
+/*
+ * server_race_abort: close any connects still going for server.
+ */
+static	void
+server_race_abort(int server)
+{
+	int	k;
+
+	for (k = 0; k < server_list[server].nrace; k++)
+		new_close(server_list[server].race_fds[k]);
+	new_free(&server_list[server].race_fds);
+	server_list[server].nrace = 0;
+}
+
+/*
+ * server_race_run: called each time around irc_io() to start on the
+ * next address of any server whose connects have had CONNECT_RACE_DELAY
+ * to finish, and haven't.
+ */
+void
+server_race_run(void)
+{
+	struct	timeval	now;
+	int	i;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < number_of_servers_count; i++)
+		if (server_list[i].nrace &&
+		    server_list[i].next_addr < server_list[i].naddrs &&
+		    (now.tv_sec > server_list[i].race_next.tv_sec ||
+		     (now.tv_sec == server_list[i].race_next.tv_sec &&
+		      now.tv_usec >= server_list[i].race_next.tv_usec)))
+			(void) server_connect_next(i);
+}
+
+/*
+ * server_race_timeout: if some server is waiting to start on its next
+ * address, sets tv to how long until the first of them, and returns 1.
+ * otherwise returns 0.
+ */
+int
+server_race_timeout(struct timeval *tv)
+{
+	struct	timeval	now;
+	long	wait,
+		least = -1;
+	int	i;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < number_of_servers_count; i++)
+	{
+		if (!server_list[i].nrace ||
+		    server_list[i].next_addr >= server_list[i].naddrs)
+			continue;
+		wait = (server_list[i].race_next.tv_sec - now.tv_sec) * 1000 +
+		       (server_list[i].race_next.tv_usec - now.tv_usec) / 1000;
+		if (wait < 0)
+			wait = 0;
+		if (least == -1 || wait < least)
+			least = wait;
+	}
+	if (least == -1)
+		return 0;
+	tv->tv_sec = least / 1000;
+	tv->tv_usec = (least % 1000) * 1000;
+	return 1;
+}
+
+/*
+ * server_connect_fd: new_des is a connection, or the start of one, to
+ * server.  set it up to be read from and written to.
+ */
+static	int
+server_connect_fd(int server, int new_des)
+{
+	if (server_list[server].localaddr)
+		new_free(&server_list[server].localaddr);
+	server_list[server].localaddr = 0;
+	server_list[server].localaddrlen = 0;
+
+#ifdef HAVE_SYS_UN_H
+	if (*server_list[server].name != '/')
+#endif /* HAVE_SYS_UN_H */
+	{
+		SOCKADDR_STORAGE *localaddr = new_malloc(sizeof *localaddr);
+		socklen_t address_len = sizeof *localaddr;
+
+		if (getsockname(new_des, (struct sockaddr *) localaddr, &address_len)
+		    >= 0)
+		{
+			server_list[server].localaddr = localaddr;
+			server_list[server].localaddrlen = address_len;
+		}
+		else
+		{
+			say("Could not getsockname(): %s", strerror(errno));
+			new_free(&localaddr);
+			new_close(new_des);
+			return -1;
+		}
+	}
+	if (server_list[server].port)
+	{
+		server_list[server].read = new_des;
+		server_list[server].write = new_des;
+	}
+	else
+		server_list[server].read = new_des;
+#ifdef NON_BLOCKING_CONNECTS
+	/* writable means the connect has finished; see do_server() */
+	new_io_register(new_des, NEWIO_READ|NEWIO_WRITE);
+#else
+	new_io_register(new_des, NEWIO_READ);
+#endif /* NON_BLOCKING_CONNECTS */
+
+	server_list[server].operator = 0;
+	update_all_status();
+	return (0);
+}
+
+/*
+ * server_connect_error: tell the user why connecting to server failed.
+ */
+static	void
+server_connect_error(int server, const char *e, int error)
+{
+	u_char	*proxy_name = server_get_proxy_name(server, 1);
+
+	if (proxy_name)
+		say("Unable to connect to port %d of server %s "
+		    "(proxy %s:%d): %s%s%s",
+		    server_list[server].port, server_list[server].name,
+		    proxy_name, server_get_proxy_port(server, 1),
+		    e, error ? ": " : "", error ? strerror(error) : "");
+	else
+		say("Unable to connect to port %d of server %s: %s%s%s",
+		    server_list[server].port, server_list[server].name,
+		    e, error ? ": " : "", error ? strerror(error) : "");
+}
+
+/*
+ * connect_to_server_process: handles the tcp connection to a server.  If
+ * successful, the user is disconnected from any previously connected server,
+ * the new server is added to the server list, and the user is registered on
+ * the new server.  If connection to the server is not successful,  the
+ * reason for failure is displayed and the previous server connection is
+ * resumed uniterrupted. 
+ *
+ * This version of connect_to_server() uses the ircio process to talk to a
+ * server 
+ */
+static	int
+connect_to_server_process(u_char *server_name, int port, u_char *nick, int server_index)
+{
+	int	write_des[2],
+		read_des[2],
+		pid,
+		c;
+	u_char	*path,
+		*name = NULL,
+		*s;
+	u_char	buffer[BIG_BUFFER_SIZE];
+	int	old_timeout;
+
+	path = UP(IRCIO_PATH);
+	if ((s = my_rindex(path, '/')) != NULL)
+		malloc_strcpy(&name, s + 1);
+	if (!name)
+		name = path;
+	if (*path == '\0')
+		return (connect_to_server_direct(server_name, port, nick, server_index));
+	if (server_index >= 0)
+		server_list[server_index].oper_command = 0;
+	write_des[0] = -1;
+	write_des[1] = -1;
+	if (pipe(write_des) || pipe(read_des))
+	{
+		if (write_des[0] != -1)
+		{
+			new_close(write_des[0]);
+			new_close(write_des[1]);
+		}
+		say("Couldn't start new process: %s", strerror(errno));
+		return (connect_to_server_direct(server_name, port, nick, server_index));
+	}
+	switch (pid = fork())
+	{
+	case -1:
+		say("Couldn't start new process: %s\n", strerror(errno));
+		return (-1);
+	case 0:
+		(void) MY_SIGNAL(SIGINT, (sigfunc *)SIG_IGN, 0);
+		dup2(read_des[1], 1);
+		dup2(write_des[0], 0);
+		new_close(read_des[0]);
+		new_close(read_des[1]);
+		new_close(write_des[0]);
+		new_close(write_des[1]);
 		snprintf(CP(buffer), sizeof buffer, "%u", port);
 		(void)setuid(getuid());
 		execl(CP(path), CP(name), server_name, buffer, NULL);
@@ -1309,6 +1906,7 @@ connect_to_server_process(u_char *server_name, int port, u_char *nick, int serve
 	server_list[from_server].read = read_des[0];
 	server_list[from_server].write = write_des[1];
 	server_list[from_server].pid = pid;
+	new_io_register(read_des[0], NEWIO_READ);
 	server_list[from_server].operator = 0;
 	return (0);
 }
@@ -1377,9 +1975,25 @@ connect_to_server(u_char *server_name, int port, u_char *nick, int c_server)
 			if (server_list[c_server].flags & CLOSE_PENDING)
 				say("--- why are we flagging this for closing a second time?");
 #endif /* GKM */
-			server_list[from_server].close_serv = c_server;
-			server_list[c_server].flags |= CLOSE_PENDING;
-			server_list[c_server].connected = 0;
+			if (!server_list[c_server].connected &&
+			    !(server_list[c_server].flags & CLOSE_PENDING))
+			{
+				/*
+				 * c_server is itself still connecting, so
+				 * there is nothing to go back to; take over
+				 * whatever it was going to replace instead.
+				 */
+				server_list[from_server].close_serv =
+					server_list[c_server].close_serv;
+				server_list[c_server].close_serv = -1;
+				close_server(c_server, empty_string());
+			}
+			else
+			{
+				server_list[from_server].close_serv = c_server;
+				server_list[c_server].flags |= CLOSE_PENDING;
+				server_list[c_server].connected = 0;
+			}
 #else
 			close_server(c_server, empty_string());
 #endif /* NON_BLOCKING_CONNECTS */
@@ -1396,7 +2010,7 @@ connect_to_server(u_char *server_name, int port, u_char *nick, int c_server)
 		 * whenever the connection is valid, it's possible for a connect to be
 		 * "immediate".
 		 */
-		if (is_server_open(from_server) &&
+		if (server_list[from_server].read != -1 &&
 		    (using_ircio() ||
 		    getpeername(server_list[from_server].read, (struct sockaddr *) &sa, &salen) != -1))
 			login_to_server(from_server);
@@ -1427,14 +2041,11 @@ login_to_server_nonblocking(int server)
 {
 #ifdef NON_BLOCKING_CONNECTS
 	int	old_serv = server_list[server].close_serv;
+#endif /* NON_BLOCKING_CONNECTS */
 
 	/* clean up after ourselves */
-	if (server_list[server].res0)
-	{
-		freeaddrinfo(server_list[server].res0);
-		server_list[server].res0 = 0;
-	}
-	server_list[server].res = 0;
+	server_dns_free(server);
+#ifdef NON_BLOCKING_CONNECTS
 	if (old_serv != -1)
 	{
 #if defined(GKM)
@@ -1481,7 +2092,14 @@ server_check_ssl(int server)
 				     &server_list[server].ssl_info);
 	Debug(DB_SERVER, "server = %d; status = %d; set: %p", server, status,
 	      server_list[server].ssl_info);
-	if (status == SSL_INIT_FAIL)
+	if (status == SSL_INIT_PENDING)
+	{
+		/* do_server() calls login_to_server() when it can go on */
+		new_io_register(server_list[server].read, NEWIO_READ |
+		    (ssl_want_write(server_list[server].ssl_info) ?
+		     NEWIO_WRITE : 0));
+	}
+	else if (status == SSL_INIT_FAIL)
 	{
 		if (server_list[server].ssl_level == SSL_OFF)
 		{
@@ -1546,6 +2164,7 @@ server_check_http_response(int server, u_char *lbuf, size_t buflen)
 	}
 	/* be generous */
 	if (lbuf[0] == '\0' ||
+	    (lbuf[0] == '\r' && lbuf[1] == '\0') ||
 	    (lbuf[0] == '\n' && lbuf[1] == '\0') ||
 	    (lbuf[0] == '\n' && lbuf[1] == '\r' && lbuf[2] == '\0') ||
 	    (lbuf[0] == '\r' && lbuf[1] == '\n' && lbuf[2] == '\0'))
@@ -1576,15 +2195,14 @@ login_to_server(int server)
 		 * successfully initialised.
 		 */
 		server_list[server].flags |= CONNECTED;
+		new_io_register(server_list[server].read, NEWIO_READ);
 
-#ifdef NON_BLOCKING_CONNECTS
+		/*
+		 * the socket stays non-blocking; writes go through the
+		 * send queue, and reads only happen once it is readable.
+		 */
 		if (using_ircio() == 0)
-		{
-			set_blocking(server_list[server].read);
-			if (server_list[server].read != server_list[server].write)
-				set_blocking(server_list[server].write);
-		}
-#endif /* NON_BLOCKING_CONNECTS */
+			set_non_blocking(server_list[server].write);
 	}
 
 	proxy_name = server_get_proxy_name(server, 1);
@@ -1604,7 +2222,8 @@ login_to_server(int server)
 			Debug(DB_PROXY, "lbuf at %s:%d is too small", __func__, __LINE__);
 			goto failed_recover;
 		}
-		if (write(server_list[server].write, CP(lbuf), len) != len)
+		server_sendq_add(server, lbuf, len);
+		if (server_sendq_flush(server) == -1)
 		{
 			yell("--- proxy login failed.");
 			Debug(DB_PROXY, "proxy write failed, closing.");
@@ -1623,56 +2242,40 @@ login_to_server(int server)
 	 * if we've sent proxy stuff, but haven't completed it yet, we
 	 * need to eat the HTTP reply.
 	 */
-	if ((server_list[server].flags & PROXY_CONNECT) != 0 &&
-	    (server_list[server].flags & PROXY_DONE) == 0)
+	while ((server_list[server].flags & PROXY_CONNECT) != 0 &&
+	       (server_list[server].flags & PROXY_DONE) == 0)
 	{
-		u_char	lbuf[BIG_BUFFER_SIZE];
-		u_char 	*bufptr;
-		u_char	*s;
+		u_char	*line;
 		int	old_timeout;
 		int	junk;
-			size_t	len;
+		size_t	len;
 
-		old_timeout = dgets_timeout(1);
-		s = server_list[server].buffer;
-		bufptr = lbuf;
-		if (s && *s)
-		{
-			len = my_strlen(s);
-			my_strncpy(lbuf, s, len);
-			bufptr += len;
-		}
-		else
-			len = 0;
-		if (len >= sizeof(lbuf))
-			goto buffer_is_full_hack;	/* XXX */
-		junk = dgets(bufptr, sizeof(lbuf), server_list[server].read);
+		/* only take what is there; do_server() brings us back */
+		old_timeout = dgets_timeout(-1);
+		junk = dgets_view(server_list[server].read, &line, &len);
 		(void) dgets_timeout(old_timeout);
 
 		switch (junk)
 		{
 		case -2:
-			/* shouldn't happen! SSL retry */
-			yell("--- proxy http reponse got -2 / SSL retry!?");
-			Debug(DB_PROXY, "proxy http reponse got -2 / SSL retry, closing.");
-			goto failed_recover;
 		case -1:
-			Debug(DB_PROXY, "added \"%s\" to the server buffer for proxy.", lbuf);
-			add_to_server_buffer(server, lbuf);
+			Debug(DB_PROXY, "partial proxy reply kept for server %d", server);
 			return;
 		case 0:
 			goto failed_recover;
 		default:
-buffer_is_full_hack:
-			switch (server_check_http_response(server, lbuf, sizeof lbuf))
+			junk = server_check_http_response(server, line, len + 1);
+			dgets_view_release();
+			switch (junk)
 			{
 			case -1:
 				Debug(DB_PROXY, "got retry on http response server %d", server);
-				return;
+				continue;
 			case 0:
 				Debug(DB_PROXY, "proxy setup complete, server %d!", server);
 				server_list[server].flags |= PROXY_DONE;
-				return;
+				/* on to SSL, or the login itself */
+				break;
 			case 1:
 				yell("--- proxy http login failed, closing");
 				Debug(DB_PROXY, "proxy http login failed, closing server %d", server);
@@ -1705,6 +2308,7 @@ failed_recover:
 		return;
 	}
 	server_list[server].flags |= LOGGED_IN;
+	server_stats_reset(server);
 	login_to_server_nonblocking(server);
 	if (server_get_version(server) == ServerICB)
 		icb_login_to_server(server);
@@ -1722,6 +2326,15 @@ irc2_login_to_server(int server)
 		return;
 	}
 
+	/*
+	 * ask what the server can do before registering; servers that
+	 * know nothing of CAP just carry on with NICK and USER.
+	 */
+	server_list[server].caps = 0;
+	server_list[server].cap_ask = 0;
+	server_list[server].flags |= CAP_PENDING;
+	parse_batch_clear(server);
+	send_to_server("CAP LS 302");
 	if (server_list[server].password)
 		send_to_server("PASS %s", server_list[server].password);
 	send_to_server("NICK %s", server_list[server].nickname);
@@ -1849,9 +2462,11 @@ display_server_list(void)
 		for (i = 0; i < number_of_servers(); i++)
 		{
 			u_char	proxy_msg[BIG_BUFFER_SIZE];
+			u_char	ssl_msg[64];
 			u_char	*icb_msg, *group_msg, lbuf[BIG_BUFFER_SIZE];
 			u_char	*pname = NULL;
 			int	pport = 0;
+			int	hits, misses;
 
 			icb_msg = server_list[i].version == ServerICB ? (u_char *) " (ICB connection)" : empty_string();
 			if (server_list[i].server_group)
@@ -1874,26 +2489,37 @@ display_server_list(void)
 			else
 				proxy_msg[0] = '\0';
 
+			if (ssl_session_stats(server_list[i].name,
+					      server_list[i].port,
+					      &hits, &misses) == 0)
+				snprintf(CP(ssl_msg), sizeof ssl_msg,
+					 " (SSL sessions: %d resumed, %d new)",
+					 hits, misses);
+			else
+				ssl_msg[0] = '\0';
+
 			if (!server_list[i].nickname)
 			{
-				say("\t%d) %s %d%s%s%s%s", i,
+				say("\t%d) %s %d%s%s%s%s%s", i,
 					server_list[i].name,
 					server_list[i].port,
 					server_list[i].read == -1 ? UP(" (not connected)") : empty_string(),
 					group_msg,
 					icb_msg,
-					proxy_msg);
+					proxy_msg,
+					ssl_msg);
 			}
 			else
 			{
-				say("\t%d) %s %d (%s%s)%s%s%s", i,
+				say("\t%d) %s %d (%s%s)%s%s%s%s", i,
 					server_list[i].name,
 					server_list[i].port,
 					(server_list[i].read == -1) ? UP("was ") : empty_string(),
 					server_list[i].nickname,
 					group_msg,
 					icb_msg,
-					proxy_msg);
+					proxy_msg,
+					ssl_msg);
 			}
 #ifdef GKM
 			say("\t\tflags: %s%s%s%s%s%s%s",
@@ -2234,7 +2860,6 @@ servercmd(u_char *command, u_char *args, u_char *subargs)
 void
 flush_server(void)
 {
-	fd_set rd;
 	struct timeval time_out;
 	int	flushing = 1;
 	int	des;
@@ -2248,37 +2873,30 @@ flush_server(void)
 	old_timeout = dgets_timeout(1);
 	while (flushing)
 	{
-		FD_ZERO(&rd);
-		FD_SET(des, &rd);
-		switch (new_select(&rd, NULL, &time_out))
+		switch (new_io_poll(des, &time_out))
 		{
 		case -1:
 		case 0:
 			flushing = 0;
 			break;
 		default:
-			if (FD_ISSET(des, &rd))
+			switch (dgets(buffer, sizeof buffer, des))
 			{
-				switch (dgets(buffer, sizeof buffer, des))
-				{
-				case -2:
-					/* SSL retry */
-					break;
-				case -1:
-				case 0:
-					flushing = 0;
-					break;
-				default:
-					break;
-				}
+			case -2:
+				/* SSL retry */
+				break;
+			case -1:
+			case 0:
+				flushing = 0;
+				break;
+			default:
+				break;
 			}
 			break;
 		}
 	}
 	/* make sure we've read a full line from server */
-	FD_ZERO(&rd);
-	FD_SET(des, &rd);
-	if (new_select(&rd, NULL, &time_out) > 0)
+	if (new_io_poll(des, &time_out) > 0)
 		dgets(buffer, sizeof buffer, des);
 	(void) dgets_timeout(old_timeout);
 }
@@ -2442,7 +3060,10 @@ is_server_open(int server_index)
 {
 	if (server_index < 0)
 		return (0);
-	return (server_list[server_index].read != -1);
+	return (server_list[server_index].read != -1 ||
+		server_list[server_index].dns_fd != -1 ||
+		server_list[server_index].nrace != 0 ||
+		(server_list[server_index].flags & SERVER_REPLAY));
 }
 
 /*
@@ -2480,176 +3101,919 @@ server_get_nickname(int server_index)
 		return my_nickname();
 }
 
-
-
-/* server_get_qhead - get the head of the whois queue */
-WhoisQueue *
-server_get_qhead(int server_index)
+
+
+/* server_get_qhead - get the head of the whois queue */
+WhoisQueue *
+server_get_qhead(int server_index)
+{
+	if (server_index >= 0)
+		return server_list[server_index].WQ_head;
+	return NULL;
+}
+
+/* server_get_whois_stuff */
+WhoisStuff *
+server_get_whois_stuff(int server_index)
+{
+	if (server_index >= 0)
+		return &server_list[server_index].whois_stuff;
+	return NULL;
+}
+
+/* server_get_qtail - get the tail of the whois queue */
+WhoisQueue *
+server_get_qtail(int server_index)
+{
+	if (server_index >= 0)
+		return server_list[server_index].WQ_tail;
+	return NULL;
+}
+
+
+/* server_set_qhead - set the head of the whois queue */
+void
+server_set_qhead(int server_index, WhoisQueue *value)
+{
+	if (server_index >= 0)
+		server_list[server_index].WQ_head = value;
+}
+
+/* server_set_qtail - set the tail of the whois queue */
+void
+server_set_qtail(int server_index, WhoisQueue *value)
+{
+	if (server_index >= 0)
+		server_list[server_index].WQ_tail = value;
+}
+
+
+/*
+ * server_get_operator: returns true if the user has op privs on the server,
+ * false otherwise 
+ */
+int
+server_get_operator(int server_index)
+{
+	return (server_list[server_index].operator);
+}
+
+/*
+ * server_set_operator: If flag is non-zero, marks the user as having op
+ * privs on the given server.  
+ */
+void
+server_set_operator(int server_index, int flag)
+{
+	server_list[server_index].operator = flag;
+}
+
+/*
+ * server_set_nickname: sets the nickname for the given server to nickname.
+ * This nickname is then used for all future connections to that server
+ * (unless changed with NICK while connected to the server 
+ */
+void
+server_set_nickname(int server_index, u_char *nick)
+{
+	if (server_index >= 0)
+	{
+		malloc_strcpy(&(server_list[server_index].nickname), nick);
+		if (server_index == primary_server)
+			set_nickname(nick);
+	}
+	update_all_status();
+}
+
+void
+server_set_motd(int server_index, int flag)
+{
+	if (server_index >= 0)
+		server_list[server_index].motd = flag;
+}
+
+int
+server_get_motd(int server_index)
+{
+	if (server_index >= 0)
+		return(server_list[server_index].motd);
+	return (0);
+}
+
+void
+server_is_connected(int server_index, int value)
+{
+	server_list[server_index].connected = value;
+	if (value)
+		server_list[server_index].eof = 0;
+}
+
+/* send_to_server: sends the given info the the server */
+void
+send_to_server(const char *format, ...)
+{
+	static	int	in_send_to_server = 0;
+	u_char	lbuf[BIG_BUFFER_SIZE];	/* make this buffer *much*
+					 * bigger than needed */
+	u_char	*buf = lbuf;
+	int	des;
+	int	queued;
+	int	class;
+	size_t	len;
+	int	server = from_server;
+	va_list vlist;
+
+	va_start(vlist, format);
+
+	if (in_send_to_server)
+		return;
+	in_send_to_server = 1;
+	if (server == -1)
+		server = primary_server;
+	if (server != -1 && (server_list[server].flags & SERVER_REPLAY))
+	{
+		/* nowhere to send it */
+		server_list[server].stats.lines_out++;
+		va_end(vlist);
+		in_send_to_server = 0;
+		return;
+	}
+	if (server != -1 && ((des = server_list[server].write) != -1) &&
+	    (server_list[server].flags & LOGGED_IN) )
+	{
+		/* save space for the packet length */
+		if (server_get_version(server) == ServerICB)
+			*buf++ = '\0';
+		server_list[server].sent = 1;
+		vsnprintf(CP(buf), sizeof lbuf - (buf - lbuf), format, vlist);
+		va_end(vlist);
+		len = my_strlen(buf);
+		if (len > (IRCD_BUFFER_SIZE - 2))
+			lbuf[IRCD_BUFFER_SIZE - 2] = '\0';
+		/*
+		 * for ICB, we send a final nul, and for IRC, we have
+		 * a final newline.
+		 */
+		len++;
+		if (do_hook(RAW_SEND_LIST, "%s", lbuf))
+		{
+			if (server_get_version(server) == ServerICB)
+			{
+				/*
+				 * we depend on our caller to split things
+				 * up for the ICB server
+				 */
+				if (len > 254)
+					len = 254;
+				lbuf[len] = 0;
+				lbuf[0] = (u_char)len;
+				lbuf[++len] = 0;
+			}
+			else
+			{
+				my_strmcat(buf, "\n", IRCD_BUFFER_SIZE);
+				len = my_strlen(buf);
+			}
+
+			server_list[server].stats.lines_out++;
+			server_list[server].stats.bytes_out += len;
+			class = server_sendq_class(server, buf);
+			if (class == SENDQ_URGENT)
+			{
+				/*
+				 * if lines are already waiting, the socket
+				 * is full and do_server() will flush when
+				 * it is writable.
+				 */
+				queued = server_list[server].sendq_head != NULL;
+				/* nothing follows a QUIT, so let out what is held */
+				if (!my_strnicmp(buf, UP("QUIT"), 4))
+					server_sched_flush(server);
+				server_sendq_add(server, lbuf, len);
+				if (!queued)
+					server_sendq_flush(server);
+			}
+			else
+			{
+				server_sched_add(server, class, lbuf, len);
+				server_sched_release(server);
+			}
+		}
+	}
+	else if (!in_redirect() && !connected_to_server())
+		say("You are not connected to a server, use /SERVER to connect.");
+	in_send_to_server = 0;
+	if (server != -1)
+		server_sendq_check(server);
+}
+
+/*
+ * server_sendq_add: queue len bytes of buf to be written to server.
+ */
+static	void
+server_sendq_add(int server, u_char *buf, size_t len)
+{
+	server_sendq_append(server, server_sendq_new(buf, len));
+}
+
+/*
+ * server_sendq_new: make a SendQ holding a copy of len bytes of buf.
+ */
+static	SendQ	*
+server_sendq_new(u_char *buf, size_t len)
+{
+	SendQ	*q;
+
+	q = new_malloc(sizeof(*q) + len);
+	q->next = NULL;
+	q->len = len;
+	memcpy(q->data, buf, len);
+	return q;
+}
+
+/*
+ * server_sendq_append: put q on the end of the send queue for server.
+ */
+static	void
+server_sendq_append(int server, SendQ *q)
+{
+	q->next = NULL;
+	if (server_list[server].sendq_tail)
+		server_list[server].sendq_tail->next = q;
+	else
+		server_list[server].sendq_head = q;
+	server_list[server].sendq_tail = q;
+	server_list[server].sendq_bytes += q->len;
+}
+
+/*
+ * server_sendq_flush: write as much of the send queue for server as the
+ * socket will take without blocking, several lines per writev().  when
+ * some is left over, the descriptor is watched for writability so that
+ * do_server() can carry on later.  returns -1 if the write failed, and
+ * the queue has been thrown away; the read side will notice the close.
+ */
+static	int
+server_sendq_flush(int server)
+{
+	struct	iovec	iov[SENDQ_IOV];
+	SendQ	*q;
+	ssize_t	rv;
+	size_t	n;
+	int	cnt;
+
+	while ((q = server_list[server].sendq_head) != NULL)
+	{
+		iov[0].iov_base = CP(q->data + server_list[server].sendq_off);
+		iov[0].iov_len = q->len - server_list[server].sendq_off;
+		for (cnt = 1, q = q->next; q && cnt < SENDQ_IOV; q = q->next, cnt++)
+		{
+			iov[cnt].iov_base = CP(q->data);
+			iov[cnt].iov_len = q->len;
+		}
+		rv = ssl_writev(server_list[server].ssl_info,
+				server_list[server].write, iov, cnt);
+		if (rv == -2)
+			break;
+		if (rv <= 0)
+		{
+			Debug(DB_SERVER, "server %d: write failed: %s", server,
+			      rv == 0 ? "closed" : strerror(errno));
+			server_sendq_free(server);
+			return -1;
+		}
+		server_list[server].sendq_bytes -= rv;
+		for (n = rv; n > 0; )
+		{
+			q = server_list[server].sendq_head;
+			if (n < q->len - server_list[server].sendq_off)
+			{
+				server_list[server].sendq_off += n;
+				break;
+			}
+			n -= q->len - server_list[server].sendq_off;
+			server_list[server].sendq_off = 0;
+			server_list[server].sendq_head = q->next;
+			new_free(&q);
+		}
+		if (server_list[server].sendq_head == NULL)
+			server_list[server].sendq_tail = NULL;
+	}
+	server_sendq_set_io(server);
+	return 0;
+}
+
+/*
+ * server_sendq_drain: flush the send queue for server, waiting up to
+ * secs seconds for the socket to take it all.
+ */
+static	void
+server_sendq_drain(int server, int secs)
+{
+	struct	timeval	tv;
+	time_t	end = time(NULL) + secs;
+
+	while (server_list[server].sendq_head &&
+	       server_sendq_flush(server) == 0 &&
+	       server_list[server].sendq_head)
+	{
+		tv.tv_sec = end - time(NULL);
+		tv.tv_usec = 0;
+		if (tv.tv_sec <= 0 ||
+		    new_io_poll_write(server_list[server].write, &tv) <= 0)
+			break;
+	}
+}
+
+/*
+ * server_sendq_free: throw away anything still queued for server.
+ */
+static	void
+server_sendq_free(int server)
+{
+	SendQ	*q;
+	int	class;
+
+	while ((q = server_list[server].sendq_head) != NULL)
+	{
+		server_list[server].sendq_head = q->next;
+		new_free(&q);
+	}
+	for (class = 0; class < SENDQ_CLASSES; class++)
+	{
+		while ((q = server_list[server].sched_head[class]) != NULL)
+		{
+			server_list[server].sched_head[class] = q->next;
+			new_free(&q);
+		}
+		server_list[server].sched_tail[class] = NULL;
+		server_list[server].sched_lines[class] = 0;
+	}
+	server_list[server].sched_bytes = 0;
+	server_list[server].sendq_tail = NULL;
+	server_list[server].sendq_off = 0;
+	server_list[server].sendq_bytes = 0;
+	server_list[server].sendq_backed_up = 0;
+	server_sendq_set_io(server);
+}
+
+/*
+ * server_sendq_set_io: watch the write side of server for writability
+ * only while there is something queued.  before the connection is made
+ * the registration belongs to the non-blocking connect code.
+ */
+static	void
+server_sendq_set_io(int server)
+{
+	int	des = server_list[server].write,
+		want = server_list[server].sendq_head ? NEWIO_WRITE : 0;
+
+	if (des == -1 || (server_list[server].flags & CONNECTED) == 0)
+		return;
+	if (des == server_list[server].read)
+		want |= NEWIO_READ;
+	new_io_register(des, want);
+}
+
+/*
+ * server_sendq_check: run ON SEND_QUEUE when the send queue for server,
+ * counting lines held back by SEND_QUEUE_RATE, goes over SEND_QUEUE_HIGH
+ * bytes, and again when it has drained back to SEND_QUEUE_LOW.
+ */
+static	void
+server_sendq_check(int server)
+{
+	size_t	bytes = server_get_sendq_bytes(server);
+	int	old_server;
+
+	if (server_list[server].sendq_backed_up)
+	{
+		if (bytes > (size_t)get_int_var(SEND_QUEUE_LOW_VAR))
+			return;
+		server_list[server].sendq_backed_up = 0;
+		old_server = set_from_server(server);
+		do_hook(SEND_QUEUE_LIST, "%s LOW %lu", server_list[server].name,
+			(unsigned long)bytes);
+		set_from_server(old_server);
+	}
+	else if (get_int_var(SEND_QUEUE_HIGH_VAR) > 0 &&
+		 bytes > (size_t)get_int_var(SEND_QUEUE_HIGH_VAR))
+	{
+		server_list[server].sendq_backed_up = 1;
+		old_server = set_from_server(server);
+		if (do_hook(SEND_QUEUE_LIST, "%s HIGH %lu",
+			    server_list[server].name, (unsigned long)bytes))
+			say("Send queue to %s is backed up (%lu bytes)",
+			    server_list[server].name, (unsigned long)bytes);
+		set_from_server(old_server);
+	}
+}
+
+/*
+ * server_sendq_class: decide which class line, about to be sent to
+ * server, belongs to.  everything until the server has welcomed us is
+ * urgent, as are PING, PONG and QUIT; the rest goes by send_class.
+ */
+static	int
+server_sendq_class(int server, u_char *line)
+{
+	if (!server_list[server].connected)
+		return SENDQ_URGENT;
+	if (server_get_version(server) == ServerICB)
+	{
+		if (*line == ICB_PING || *line == ICB_PONG)
+			return SENDQ_URGENT;
+	}
+	else if (!my_strnicmp(line, UP("PING "), 5) ||
+		 !my_strnicmp(line, UP("PONG "), 5) ||
+		 !my_strnicmp(line, UP("QUIT"), 4))
+		return SENDQ_URGENT;
+	return send_class;
+}
+
+/*
+ * server_set_send_class: lines sent to servers from now on are of the
+ * given class, until it is set back.  returns the old class.
+ */
+int
+server_set_send_class(int class)
+{
+	int	old_class = send_class;
+
+	send_class = class;
+	return old_class;
+}
+
+/*
+ * server_sched_add: hold len bytes of buf back for server, behind other
+ * lines of the same class, until SEND_QUEUE_RATE lets them out.
+ */
+static	void
+server_sched_add(int server, int class, u_char *buf, size_t len)
+{
+	SendQ	*q;
+
+	q = server_sendq_new(buf, len);
+	if (server_list[server].sched_tail[class])
+		server_list[server].sched_tail[class]->next = q;
+	else
+		server_list[server].sched_head[class] = q;
+	server_list[server].sched_tail[class] = q;
+	server_list[server].sched_lines[class]++;
+	server_list[server].sched_bytes += len;
+}
+
+/*
+ * server_sched_refill: give server credit for the time since it was last
+ * topped up, up to SEND_QUEUE_BURST lines worth.  each line that is let
+ * out costs SEND_QUEUE_RATE milliseconds of it.
+ */
+static	void
+server_sched_refill(int server)
+{
+	struct	timeval	now,
+			*stamp = &server_list[server].sched_stamp;
+	long	burst = get_int_var(SEND_QUEUE_BURST_VAR),
+		full,
+		ms;
+
+	if (burst < 1)
+		burst = 1;
+	full = burst * get_int_var(SEND_QUEUE_RATE_VAR);
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - stamp->tv_sec > full / 1000 + 1)
+	{
+		server_list[server].sched_credit = full;
+		*stamp = now;
+		return;
+	}
+	ms = ((now.tv_sec - stamp->tv_sec) * 1000000L +
+	      (now.tv_usec - stamp->tv_usec)) / 1000;
+	if (ms < 0)
+		*stamp = now;
+	if (ms <= 0)
+		return;
+	server_list[server].sched_credit += ms;
+	if (server_list[server].sched_credit >= full)
+	{
+		server_list[server].sched_credit = full;
+		*stamp = now;
+		return;
+	}
+	/* only move on by whole milliseconds, so none are lost */
+	stamp->tv_sec += ms / 1000;
+	stamp->tv_usec += (ms % 1000) * 1000;
+	if (stamp->tv_usec >= 1000000)
+	{
+		stamp->tv_sec++;
+		stamp->tv_usec -= 1000000;
+	}
+}
+
+/*
+ * server_sched_release: move the lines that SEND_QUEUE_RATE allows from
+ * the class queues of server to its send queue, user lines first, and
+ * write them.  nothing is moved while the send queue is not empty, so
+ * that an urgent line never waits for more than the socket does.
+ */
+static	void
+server_sched_release(int server)
+{
+	SendQ	*q;
+	long	rate = get_int_var(SEND_QUEUE_RATE_VAR);
+	int	class,
+		moved = 0;
+
+	if (server_list[server].sched_bytes == 0 ||
+	    server_list[server].sendq_head)
+		return;
+	if (rate > 0)
+		server_sched_refill(server);
+	for (class = 0; class < SENDQ_CLASSES; class++)
+		while ((q = server_list[server].sched_head[class]) != NULL)
+		{
+			if (rate > 0)
+			{
+				if (server_list[server].sched_credit < rate)
+					goto out;
+				server_list[server].sched_credit -= rate;
+			}
+			if ((server_list[server].sched_head[class] = q->next) == NULL)
+				server_list[server].sched_tail[class] = NULL;
+			server_list[server].sched_lines[class]--;
+			server_list[server].sched_bytes -= q->len;
+			server_sendq_append(server, q);
+			moved++;
+		}
+out:
+	if (moved)
+		server_sendq_flush(server);
+}
+
+/*
+ * server_sched_flush: move everything the class queues of server hold
+ * onto its send queue, as server_sched_release() would but without
+ * waiting for SEND_QUEUE_RATE, as the connection is about to close.
+ */
+static	void
+server_sched_flush(int server)
+{
+	SendQ	*q;
+	int	class;
+
+	for (class = 0; class < SENDQ_CLASSES; class++)
+	{
+		while ((q = server_list[server].sched_head[class]) != NULL)
+		{
+			server_list[server].sched_head[class] = q->next;
+			server_sendq_append(server, q);
+		}
+		server_list[server].sched_tail[class] = NULL;
+		server_list[server].sched_lines[class] = 0;
+	}
+	server_list[server].sched_bytes = 0;
+}
+
+/*
+ * server_sendq_run: called each time around irc_io() to let out any
+ * lines that SEND_QUEUE_RATE has been holding back.
+ */
+void
+server_sendq_run(void)
+{
+	int	i;
+
+	for (i = 0; i < number_of_servers_count; i++)
+		if (server_list[i].sched_bytes && !server_list[i].sendq_head)
+		{
+			server_sched_release(i);
+			server_sendq_check(i);
+		}
+}
+
+/*
+ * server_sendq_timeout: if some server has lines waiting only for
+ * SEND_QUEUE_RATE, sets tv to how long until the first of them may go,
+ * and returns 1.  otherwise returns 0.
+ */
+int
+server_sendq_timeout(struct timeval *tv)
+{
+	long	rate = get_int_var(SEND_QUEUE_RATE_VAR),
+		wait,
+		least = -1;
+	int	i;
+
+	for (i = 0; i < number_of_servers_count; i++)
+	{
+		if (!server_list[i].sched_bytes || server_list[i].sendq_head)
+			continue;
+		wait = 0;
+		if (rate > 0)
+		{
+			server_sched_refill(i);
+			if (server_list[i].sched_credit < rate)
+				wait = rate - server_list[i].sched_credit;
+		}
+		if (least == -1 || wait < least)
+			least = wait;
+	}
+	if (least == -1)
+		return 0;
+	tv->tv_sec = least / 1000;
+	tv->tv_usec = (least % 1000) * 1000;
+	return 1;
+}
+
+/*
+ * server_get_sendq_bytes: how many bytes are waiting to be written to
+ * server, including those held back by SEND_QUEUE_RATE.
+ */
+size_t
+server_get_sendq_bytes(int server)
 {
-	if (server_index >= 0)
-		return server_list[server_index].WQ_head;
-	return NULL;
+	if (server < 0 || server >= number_of_servers_count)
+		return 0;
+	return server_list[server].sendq_bytes + server_list[server].sched_bytes;
 }
 
-/* server_get_whois_stuff */
-WhoisStuff *
-server_get_whois_stuff(int server_index)
+/*
+ * server_get_sendq_lines: how many lines of class are being held back
+ * for server by SEND_QUEUE_RATE.
+ */
+int
+server_get_sendq_lines(int server, int class)
 {
-	if (server_index >= 0)
-		return &server_list[server_index].whois_stuff;
-	return NULL;
+	if (server < 0 || server >= number_of_servers_count ||
+	    class < 0 || class >= SENDQ_CLASSES)
+		return 0;
+	return server_list[server].sched_lines[class];
 }
 
-/* server_get_qtail - get the tail of the whois queue */
-WhoisQueue *
-server_get_qtail(int server_index)
+/*
+ * server_stats_reset: start the counters for server afresh, as it has
+ * just logged in.
+ */
+static	void
+server_stats_reset(int server)
 {
-	if (server_index >= 0)
-		return server_list[server_index].WQ_tail;
-	return NULL;
-}
+	Server	*s = &server_list[server];
 
+	memset(&s->stats, 0, sizeof s->stats);
+	s->stats.lag = -1;
+	s->stats.since = time(NULL);
+	s->ping_sent.tv_sec = s->ping_sent.tv_usec = 0;
+	s->ping_last = s->stats.since;
+}
 
-/* server_set_qhead - set the head of the whois queue */
-void
-server_set_qhead(int server_index, WhoisQueue *value)
+/*
+ * server_usec_since: microseconds from start until now.
+ */
+static	long
+server_usec_since(struct timeval *start, struct timeval *now)
 {
-	if (server_index >= 0)
-		server_list[server_index].WQ_head = value;
+	return (now->tv_sec - start->tv_sec) * 1000000L +
+	       (now->tv_usec - start->tv_usec);
 }
 
-/* server_set_qtail - set the tail of the whois queue */
+/*
+ * server_stats_hook: do_hook() has been running ON hooks since start;
+ * charge the time to the server whose line is being parsed, if any.
+ */
 void
-server_set_qtail(int server_index, WhoisQueue *value)
+server_stats_hook(struct timeval *start)
 {
-	if (server_index >= 0)
-		server_list[server_index].WQ_tail = value;
-}
+	struct	timeval	now;
 
+	if (parsing_server_index < 0 ||
+	    parsing_server_index >= number_of_servers_count)
+		return;
+	gettimeofday(&now, NULL);
+	server_list[parsing_server_index].stats.hook_usec +=
+	    server_usec_since(start, &now);
+}
 
 /*
- * server_get_operator: returns true if the user has op privs on the server,
- * false otherwise 
+ * server_stats_display: count the time since start as spent displaying
+ * the line being parsed.
  */
-int
-server_get_operator(int server_index)
+void
+server_stats_display(struct timeval *start)
 {
-	return (server_list[server_index].operator);
+	struct	timeval	now;
+
+	if (parsing_server_index < 0 ||
+	    parsing_server_index >= number_of_servers_count)
+		return;
+	gettimeofday(&now, NULL);
+	server_list[parsing_server_index].stats.display_usec +=
+	    server_usec_since(start, &now);
 }
 
 /*
- * server_set_operator: If flag is non-zero, marks the user as having op
- * privs on the given server.  
+ * server_get_stats: fill in stats for server.  returns -1 if there is
+ * no such server.
  */
-void
-server_set_operator(int server_index, int flag)
+int
+server_get_stats(int server, ServerStats *stats)
 {
-	server_list[server_index].operator = flag;
+	struct	timeval	now;
+	SendQ	*q;
+	int	i;
+
+	if (server < 0 || server >= number_of_servers_count)
+		return -1;
+	*stats = server_list[server].stats;
+	if (server_list[server].ping_sent.tv_sec)
+	{
+		gettimeofday(&now, NULL);
+		stats->lag_wait = server_usec_since(
+		    &server_list[server].ping_sent, &now) / 1000;
+	}
+	stats->sendq_bytes = server_get_sendq_bytes(server);
+	stats->sendq_lines = 0;
+	for (q = server_list[server].sendq_head; q; q = q->next)
+		stats->sendq_lines++;
+	for (i = 0; i < SENDQ_CLASSES; i++)
+		stats->sendq_lines += server_list[server].sched_lines[i];
+	return 0;
 }
 
 /*
- * server_set_nickname: sets the nickname for the given server to nickname.
- * This nickname is then used for all future connections to that server
- * (unless changed with NICK while connected to the server 
+ * server_ping_run: called each time around irc_io() to send a PING to
+ * every registered IRC server that is due one, every
+ * SERVER_PING_INTERVAL seconds.  the PONG gives the lag.  no more are
+ * sent while one is still unanswered, but one that has gone unanswered
+ * for twice the interval is given up on, and the lag is unknown again.
  */
 void
-server_set_nickname(int server_index, u_char *nick)
+server_ping_run(void)
 {
-	if (server_index >= 0)
+	int	interval = get_int_var(SERVER_PING_INTERVAL_VAR),
+		old_server,
+		i;
+	struct	timeval	now;
+
+	if (interval <= 0)
+		return;
+	gettimeofday(&now, NULL);
+	for (i = 0; i < number_of_servers_count; i++)
 	{
-		malloc_strcpy(&(server_list[server_index].nickname), nick);
-		if (server_index == primary_server)
-			set_nickname(nick);
+		Server	*s = &server_list[i];
+
+		if (!s->connected || !(s->flags & LOGGED_IN) ||
+		    s->version == ServerICB)
+			continue;
+		if (s->ping_sent.tv_sec &&
+		    now.tv_sec >= s->ping_sent.tv_sec + interval * 2)
+		{
+			Debug(DB_SERVER, "server %d: lag PING unanswered", i);
+			s->ping_sent.tv_sec = s->ping_sent.tv_usec = 0;
+			s->stats.lag = -1;
+		}
+		if (s->ping_sent.tv_sec || now.tv_sec < s->ping_last + interval)
+			continue;
+		s->ping_sent = now;
+		s->ping_last = now.tv_sec;
+		s->stats.pings++;
+		old_server = set_from_server(i);
+		send_to_server("PING :LAG%ld.%06ld", (long)now.tv_sec,
+		    (long)now.tv_usec);
+		set_from_server(old_server);
 	}
-	update_all_status();
 }
 
-void
-server_set_motd(int server_index, int flag)
+/*
+ * server_ping_timeout: if some server will be due a lag PING, or will
+ * give up on the one it sent, sets tv to how long until the first of
+ * them, and returns 1.  otherwise returns 0.
+ */
+int
+server_ping_timeout(struct timeval *tv)
 {
-	if (server_index >= 0)
-		server_list[server_index].motd = flag;
+	time_t	now,
+		least = -1;
+	int	interval = get_int_var(SERVER_PING_INTERVAL_VAR),
+		i;
+
+	if (interval <= 0)
+		return 0;
+	now = time(NULL);
+	for (i = 0; i < number_of_servers_count; i++)
+	{
+		Server	*s = &server_list[i];
+		time_t	due;
+
+		if (!s->connected || !(s->flags & LOGGED_IN) ||
+		    s->version == ServerICB)
+			continue;
+		if (s->ping_sent.tv_sec)
+			due = s->ping_sent.tv_sec + interval * 2;
+		else
+			due = s->ping_last + interval;
+		if (least == -1 || due < least)
+			least = due;
+	}
+	if (least == -1)
+		return 0;
+	tv->tv_sec = least > now ? least - now : 0;
+	tv->tv_usec = 0;
+	return 1;
 }
 
+/*
+ * server_ping_pong: a PONG with token has come from server.  if it
+ * answers our lag PING, note the lag and return 1, so that the user
+ * is not told about it.  otherwise return 0.
+ */
 int
-server_get_motd(int server_index)
+server_ping_pong(int server, u_char *token)
 {
-	if (server_index >= 0)
-		return(server_list[server_index].motd);
-	return (0);
+	Server	*s;
+	u_char	expect[64];
+	struct	timeval	now;
+
+	if (server < 0 || server >= number_of_servers_count || !token)
+		return 0;
+	s = &server_list[server];
+	if (!s->ping_sent.tv_sec)
+		return 0;
+	snprintf(CP(expect), sizeof expect, "LAG%ld.%06ld",
+	    (long)s->ping_sent.tv_sec, (long)s->ping_sent.tv_usec);
+	if (my_strcmp(expect, token) != 0)
+		return 0;
+	gettimeofday(&now, NULL);
+	s->stats.lag = server_usec_since(&s->ping_sent, &now) / 1000;
+	s->stats.pongs++;
+	s->ping_sent.tv_sec = s->ping_sent.tv_usec = 0;
+	return 1;
 }
 
-void
-server_is_connected(int server_index, int value)
+/*
+ * server_stats_show: tell the user what the counters for server are.
+ */
+static	void
+server_stats_show(int server)
 {
-	server_list[server_index].connected = value;
-	if (value)
-		server_list[server_index].eof = 0;
+	ServerStats stats;
+	u_char	lag[64];
+
+	if (server_get_stats(server, &stats))
+		return;
+	say("Server %d: %s %d (%ld seconds)", server,
+	    server_list[server].itsname ? server_list[server].itsname :
+					  server_list[server].name,
+	    server_list[server].port, (long)(time(NULL) - stats.since));
+	say("    In: %lu lines, %lu bytes.  Out: %lu lines, %lu bytes",
+	    stats.lines_in, stats.bytes_in, stats.lines_out, stats.bytes_out);
+	say("    Parsing: %lu usec, slowest line %lu usec, %lu usec in hooks, "
+	    "%lu usec displaying", stats.parse_usec, stats.parse_max,
+	    stats.hook_usec, stats.display_usec);
+	if (stats.lag == -1)
+		my_strcpy(lag, "unknown");
+	else
+		snprintf(CP(lag), sizeof lag, "%ld ms", stats.lag);
+	if (stats.lag_wait)
+		snprintf(CP(lag) + my_strlen(lag), sizeof lag - my_strlen(lag),
+		    " (waiting %ld ms)", stats.lag_wait);
+	say("    Lag: %s, %lu of %lu PINGs answered", lag, stats.pongs,
+	    stats.pings);
+	say("    Send queue: %d lines, %lu bytes", stats.sendq_lines,
+	    (unsigned long)stats.sendq_bytes);
+	if (server_list[server].caps)
+		say("    Capabilities: %s",
+		    parse_cap_string(server_list[server].caps));
 }
 
-/* send_to_server: sends the given info the the server */
+/*
+ * serverstatscmd: the SERVERSTATS command.  shows the counters for the
+ * given server, or for every open server.
+ */
 void
-send_to_server(const char *format, ...)
+serverstatscmd(u_char *command, u_char *args, u_char *subargs)
 {
-	static	int	in_send_to_server = 0;
-	u_char	lbuf[BIG_BUFFER_SIZE];	/* make this buffer *much*
-					 * bigger than needed */
-	u_char	*buf = lbuf;
-	int	des;
-	size_t	len;
-	int	server = from_server;
-	va_list vlist;
-
-	va_start(vlist, format);
+	u_char	*server;
+	int	i, shown = 0;
 
-	if (in_send_to_server)
-		return;
-	memset(lbuf, 0, sizeof(lbuf));
-	in_send_to_server = 1;
-	if (server == -1)
-		server = primary_server;
-	if (server != -1 && ((des = server_list[server].write) != -1) &&
-	    (server_list[server].flags & LOGGED_IN) )
+	if ((server = next_arg(args, &args)) != NULL)
 	{
-		/* save space for the packet length */
-		if (server_get_version(server) == ServerICB)
-			buf++;
-		server_list[server].sent = 1;
-		vsnprintf(CP(buf), sizeof lbuf, format, vlist);
-		va_end(vlist);
-		len = my_strlen(buf);
-		if (len > (IRCD_BUFFER_SIZE - 2))
-			lbuf[IRCD_BUFFER_SIZE - 2] = '\0';
-		/*
-		 * for ICB, we send a final nul, and for IRC, we have
-		 * a final newline.
-		 */
-		len++;
-		if (do_hook(RAW_SEND_LIST, "%s", lbuf))
+		if ((i = parse_server_index(server)) == -1 &&
+		    (i = find_in_server_list(server, 0, NULL)) == -1)
 		{
-			if (server_get_version(server) == ServerICB)
-			{
-				/*
-				 * we depend on our caller to split things
-				 * up for the ICB server
-				 */
-				if (len > 254)
-					len = 254;
-				lbuf[len] = 0;
-				lbuf[0] = (u_char)len;
-				lbuf[++len] = 0;
-			}
-			else
-				my_strmcat(buf, "\n", IRCD_BUFFER_SIZE);
-
-			/* XXX retval */
-			ssl_write(server_list[server].ssl_info,
-				  server_list[server].write, CP(lbuf), len);
+			say("SERVERSTATS: No such server %s", server);
+			return;
 		}
+		server_stats_show(i);
+		return;
 	}
-	else if (!in_redirect() && !connected_to_server())
-		say("You are not connected to a server, use /SERVER to connect.");
-	in_send_to_server = 0;
+	for (i = 0; i < number_of_servers_count; i++)
+		if (server_list[i].write != -1)
+		{
+			server_stats_show(i);
+			shown++;
+		}
+	if (!shown)
+		say("SERVERSTATS: Not connected to any server");
 }
 
 #ifdef HAVE_SYS_UN_H
@@ -2714,18 +4078,6 @@ create_server_list(void)
 	return value;
 }
 
-static	void
-add_to_server_buffer(int server, u_char *buf)
-{
-	if (buf && *buf)
-	{
-		if (server_list[server].buffer)
-			malloc_strcat(&server_list[server].buffer, buf);
-		else
-			malloc_strcpy(&server_list[server].buffer, buf);
-	}
-}
-
 void
 disconnectcmd(u_char *command, u_char *args, u_char *subargs)
 {
@@ -2765,7 +4117,8 @@ disconnectcmd(u_char *command, u_char *args, u_char *subargs)
 		message = UP("Disconnecting");
 	else
 		message = args;
-	if (-1 == server_list[i].write)
+	if (-1 == server_list[i].write && -1 == server_list[i].dns_fd &&
+	    0 == server_list[i].nrace)
 	{
 		say("That server isn't connected!");
 		return;
@@ -2810,6 +4163,103 @@ parse_server(u_char *line)
 	server_list[parsing_server_index].parse_server(line);
 }
 
+/*
+ * server_parse_line: handle a line of len bytes from server, counting
+ * it and the time it took.
+ */
+static	void
+server_parse_line(int server, u_char *line, size_t len)
+{
+	int	old_psi = parsing_server_index;
+	struct	timeval	before, after;
+	ServerStats *stats;
+	long	usec;
+
+	parsing_server_index = server;
+	gettimeofday(&before, NULL);
+	if (len)
+		parse_server(line);
+	gettimeofday(&after, NULL);
+	parsing_server_index = old_psi;
+	stats = &server_list[server].stats;
+	stats->lines_in++;
+	stats->bytes_in += len;
+	usec = server_usec_since(&before, &after);
+	stats->parse_usec += usec;
+	if (usec > stats->parse_max)
+		stats->parse_max = usec;
+}
+
+/*
+ * server_replay: parse the lines in file, saved from a server, as if
+ * they had just been read from one, so that the same hooks, channel
+ * lists, windows and lastlogs are used.  nothing is sent: lines for
+ * the server are counted and dropped.  afterwards, how long it took
+ * goes to stderr.  this is --replay on the command line, for measuring
+ * what a script or a change costs on a known stream of traffic.
+ */
+void
+server_replay(u_char *file)
+{
+	FILE	*fp;
+	u_char	buffer[BIG_BUFFER_SIZE + 1];
+	struct	timeval	start, end;
+	ServerStats *stats;
+	size_t	len;
+	long	usec;
+	long	maxrss = -1;
+	int	server;
+
+	if ((fp = fopen(CP(file), "r")) == NULL)
+	{
+		fprintf(stderr, "irc: can not open %s: %s\n", file,
+			strerror(errno));
+		return;
+	}
+	add_to_server_list(UP("replay"), irc_port(), NULL, 0, NULL,
+			   my_nickname(), -1, DEFAULT_SERVER_VERSION, 0);
+	server = from_server;
+	server_list[server].flags |= SERVER_REPLAY | LOGGED_IN;
+	server_is_connected(server, 1);
+	window_set_server(-1, server, WIN_TRANSFER);
+	set_connected_to_server(1);
+	/* scripts are loaded first, so that only the traffic is timed */
+	maybe_load_ircrc();
+
+	gettimeofday(&start, NULL);
+	while (fgets(CP(buffer), sizeof buffer, fp))
+	{
+		from_server = server;
+		len = my_strlen(buffer);
+		server_parse_line(server, buffer, len);
+		from_server = primary_server;
+	}
+	gettimeofday(&end, NULL);
+	fclose(fp);
+
+	stats = &server_list[server].stats;
+	usec = server_usec_since(&start, &end);
+#if defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_GETRUSAGE)
+	{
+		struct	rusage	ru;
+
+		/* kilobytes on most systems, but bytes on some */
+		if (getrusage(RUSAGE_SELF, &ru) == 0)
+			maxrss = ru.ru_maxrss;
+	}
+#endif
+	fflush(stdout);
+	fprintf(stderr, "replay: %lu lines, %lu bytes in %ld.%06ld seconds, "
+		"%.0f lines/sec\n", stats->lines_in, stats->bytes_in,
+		usec / 1000000, usec % 1000000,
+		usec ? stats->lines_in * 1e6 / usec : 0.0);
+	fprintf(stderr, "replay: parsing %lu usec (slowest line %lu), "
+		"hooks %lu, display %lu\n", stats->parse_usec,
+		stats->parse_max, stats->hook_usec, stats->display_usec);
+	fprintf(stderr, "replay: %lu lines for the server dropped, "
+		"peak memory %ld\n", stats->lines_out, maxrss);
+}
+
 int
 server_get_server_group(int server_index)
 {
@@ -2954,6 +4404,42 @@ server_get_chan_list(int server)
 	return server_list[server].chan_list;
 }
 
+void
+server_set_nick_index(int server, NickIndex *index)
+{
+	server_list[server].nick_index = index;
+}
+
+NickIndex *
+server_get_nick_index(int server)
+{
+	return server_list[server].nick_index;
+}
+
+void
+server_set_chan_hash(int server, ChanHash *hash)
+{
+	server_list[server].chan_hash = hash;
+}
+
+ChanHash *
+server_get_chan_hash(int server)
+{
+	return server_list[server].chan_hash;
+}
+
+void
+server_set_userhost_cache(int server, UserhostCache *cache)
+{
+	server_list[server].userhost_cache = cache;
+}
+
+UserhostCache *
+server_get_userhost_cache(int server)
+{
+	return server_list[server].userhost_cache;
+}
+
 void
 server_set_attempting_to_connect(int server, int attempt)
 {
@@ -3163,3 +4649,43 @@ server_set_default_proxy(u_char *proxy_and_port)
 				&default_proxy_name, &default_proxy_port);
 	Debug(DB_PROXY, "set server '%s' port '%d'", default_proxy_name, default_proxy_port);
 }
+
+/*
+ * the IRCv3 capabilities the server has agreed to, as CAP_* bits.
+ * parse.c does the negotiating.
+ */
+int
+server_get_caps(int server)
+{
+	if (server < 0 || server >= number_of_servers())
+		return 0;
+	return server_list[server].caps;
+}
+
+void
+server_set_caps(int server, int caps)
+{
+	if (server < 0 || server >= number_of_servers())
+		return;
+	server_list[server].caps = caps;
+}
+
+/*
+ * the capabilities we want that the server has offered in CAP LS, which
+ * may take several lines.
+ */
+int
+server_get_cap_ask(int server)
+{
+	if (server < 0 || server >= number_of_servers())
+		return 0;
+	return server_list[server].cap_ask;
+}
+
+void
+server_set_cap_ask(int server, int caps)
+{
+	if (server < 0 || server >= number_of_servers())
+		return;
+	server_list[server].cap_ask = caps;
+}
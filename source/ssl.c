@@ -36,6 +36,11 @@ IRCII_RCSID("@(#)$eterna: ssl.c,v 2.10 2014/08/25 04:45:38 mrg Exp $");
 #ifdef USE_OPENSSL
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
 #endif
 
 #include "ssl.h"
@@ -52,13 +57,35 @@ IRCII_RCSID("@(#)$eterna: ssl.c,v 2.10 2014/08/25 04:45:38 mrg Exp $");
  */
 
 #ifdef USE_OPENSSL
+/*
+ * SslSession: the last TLS session for a server, offered again when
+ * reconnecting so that the server can skip the full handshake.  they are
+ * looked up by name and port, so they survive the server list changing.
+ */
+typedef struct ssl_session_stru SslSession;
+struct ssl_session_stru {
+	SslSession	*next;
+	u_char	*name;
+	int	port;
+	SSL_SESSION	*session;
+	int	hits;			/* handshakes that resumed it */
+	int	misses;			/* full handshakes */
+};
+
 static	void	ssl_print_error_queue(const char *);
+static	SslSession *ssl_session_find(u_char *, int, int);
+static	int	ssl_session_new(SSL *, SSL_SESSION *);
+static	void	ssl_session_load(void);
+static	void	ssl_session_save(void);
 
 static	SSL_CTX	*ssl_ctx;
+static	SslSession *ssl_sessions;
+static	u_char	*ssl_session_file;	/* SSL_SESSION_FILE last loaded */
 
 /* SslInfo: private structure per-server connection. */
 struct ssl_info_stru {
 	SSL	*ssl;
+	SslSession *cache;
 };
 
 static	void
@@ -79,6 +106,128 @@ ssl_print_error_queue(const char *msg)
 		     ERR_reason_error_string(sslcode));
 	} while ((sslcode = ERR_get_error()));
 }
+
+/*
+ * ssl_session_find: the session cache entry for name and port, made
+ * empty if create is set and there is none yet.
+ */
+static	SslSession *
+ssl_session_find(u_char *name, int port, int create)
+{
+	SslSession *cache;
+
+	for (cache = ssl_sessions; cache; cache = cache->next)
+		if (cache->port == port && !my_stricmp(cache->name, name))
+			return cache;
+	if (!create)
+		return NULL;
+	cache = new_malloc(sizeof *cache);
+	cache->name = NULL;
+	malloc_strcpy(&cache->name, name);
+	cache->port = port;
+	cache->session = NULL;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->next = ssl_sessions;
+	ssl_sessions = cache;
+	return cache;
+}
+
+/*
+ * ssl_session_new: called by OpenSSL when the server gives us a session
+ * we can offer next time.  it replaces any we had for the server.
+ */
+static	int
+ssl_session_new(SSL *ssl, SSL_SESSION *session)
+{
+	SslInfo	*info = SSL_get_app_data(ssl);
+
+	if (!info || !info->cache)
+		return 0;
+	Debug(DB_SSL, "new session for %s:%d", info->cache->name,
+	      info->cache->port);
+	if (info->cache->session)
+		SSL_SESSION_free(info->cache->session);
+	info->cache->session = session;
+	ssl_session_save();
+	return 1;
+}
+
+/*
+ * ssl_session_load: if SSL_SESSION_FILE has changed, read the sessions
+ * saved in it.  each is a line with the server name and port, followed
+ * by the session in PEM form.
+ */
+static	void
+ssl_session_load(void)
+{
+	u_char	*file = get_string_var(SSL_SESSION_FILE_VAR);
+	u_char	lbuf[BIG_BUFFER_SIZE];
+	u_char	*name, *port, *rest;
+	SSL_SESSION *session;
+	SslSession *cache;
+	FILE	*fp;
+
+	if (!file || !*file)
+	{
+		new_free(&ssl_session_file);
+		return;
+	}
+	if (ssl_session_file && !my_strcmp(file, ssl_session_file))
+		return;
+	malloc_strcpy(&ssl_session_file, file);
+	if ((fp = fopen(CP(file), "r")) == NULL)
+		return;
+	while (fgets(CP(lbuf), sizeof lbuf, fp))
+	{
+		rest = lbuf;
+		if ((name = next_arg(rest, &rest)) == NULL ||
+		    (port = next_arg(rest, &rest)) == NULL ||
+		    (session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL)) == NULL)
+			break;
+		cache = ssl_session_find(name, my_atoi(port), 1);
+		if (cache->session)
+			SSL_SESSION_free(cache->session);
+		cache->session = session;
+		Debug(DB_SSL, "loaded session for %s:%d", cache->name,
+		      cache->port);
+	}
+	fclose(fp);
+}
+
+/*
+ * ssl_session_save: write out all the sessions we have to
+ * SSL_SESSION_FILE, if it is set.
+ */
+static	void
+ssl_session_save(void)
+{
+	SslSession *cache;
+	FILE	*fp;
+	int	fd;
+
+	if (!ssl_session_file)
+		return;
+	if ((fd = open(CP(ssl_session_file), O_WRONLY | O_CREAT | O_TRUNC,
+		       0600)) == -1)
+	{
+		Debug(DB_SSL, "can't save sessions to %s: %s",
+		      ssl_session_file, strerror(errno));
+		return;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL)
+	{
+		close(fd);
+		return;
+	}
+	for (cache = ssl_sessions; cache; cache = cache->next)
+		if (cache->session)
+		{
+			fprintf(fp, "%s %d\n", cache->name, cache->port);
+			PEM_write_SSL_SESSION(fp, cache->session);
+		}
+	fclose(fp);
+}
 #endif
 
 /*
@@ -176,7 +325,13 @@ ssl_init_connection(int server, int fd, SslInfo **newp)
 			goto cleanup;
 		}
 		ssl_setup_certs(NULL);
+
+		/* sessions are kept by ssl_session_new(), not OpenSSL */
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ssl_ctx, ssl_session_new);
 	}
+	ssl_session_load();
 
 	if (*newp)
 		new = *newp;
@@ -184,6 +339,8 @@ ssl_init_connection(int server, int fd, SslInfo **newp)
 	{
 		new = new_malloc(sizeof *new);
 		new->ssl = NULL;
+		new->cache = ssl_session_find(server_get_name(server),
+					      server_get_port(server), 1);
 
 		new->ssl = SSL_new(ssl_ctx);
 		if (!new->ssl)
@@ -193,7 +350,13 @@ ssl_init_connection(int server, int fd, SslInfo **newp)
 			goto cleanup;
 		}
 
-		SSL_set_mode(new->ssl, SSL_MODE_AUTO_RETRY);
+		/*
+		 * the server send queue retries with a buffer that may
+		 * have moved or grown, and copes with partial writes.
+		 */
+		SSL_set_mode(new->ssl, SSL_MODE_AUTO_RETRY |
+				       SSL_MODE_ENABLE_PARTIAL_WRITE |
+				       SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 		SSL_set_fd(new->ssl, fd);
 
 		if (ssl_level == SSL_VERIFY)
@@ -205,6 +368,13 @@ ssl_init_connection(int server, int fd, SslInfo **newp)
 			yell("SSL connection not verified, may be insecure");
 			SSL_set_verify(new->ssl, SSL_VERIFY_NONE, NULL);
 		}
+
+		SSL_set_app_data(new->ssl, new);
+		if (new->cache->session)
+		{
+			Debug(DB_SSL, "offering saved session");
+			SSL_set_session(new->ssl, new->cache->session);
+		}
 	}
 
 	rv = SSL_connect(new->ssl);
@@ -232,10 +402,27 @@ ssl_init_connection(int server, int fd, SslInfo **newp)
 		yell("Unable to connect to SSL server");
 		ssl_print_error_queue("SSL_connect failed");
 		status = SSL_INIT_FAIL;
+
+		/* don't offer it again, in case that is the trouble */
+		if (new->cache->session)
+		{
+			SSL_SESSION_free(new->cache->session);
+			new->cache->session = NULL;
+			ssl_session_save();
+		}
 		goto cleanup;
 	}
 
-	yell("Connected to SSL successfully!");
+	if (SSL_session_reused(new->ssl))
+	{
+		new->cache->hits++;
+		yell("Connected to SSL successfully! (session resumed)");
+	}
+	else
+	{
+		new->cache->misses++;
+		yell("Connected to SSL successfully!");
+	}
 
 	status = SSL_INIT_OK;
 	Debug(DB_SSL, "success!");
@@ -264,12 +451,75 @@ ssl_close_connection(SslInfo **ssl_info)
 		return;
 
 	if ((*ssl_info)->ssl)
+	{
+		/*
+		 * OpenSSL throws away the session of a connection that was
+		 * not shut down, and there is no waiting around for the
+		 * server's close_notify here, so say that it was.
+		 */
+		if (SSL_is_init_finished((*ssl_info)->ssl))
+			SSL_set_shutdown((*ssl_info)->ssl, SSL_SENT_SHUTDOWN |
+					 SSL_RECEIVED_SHUTDOWN);
 		SSL_free((*ssl_info)->ssl);
+	}
 
 	new_free(ssl_info);
 #endif
 }
 
+/*
+ * ssl_session_stats: how many connections to server name and port have
+ * resumed a saved session, and how many needed a full handshake.
+ * returns -1 if there have been no TLS connections to it.
+ */
+int
+ssl_session_stats(u_char *name, int port, int *hits, int *misses)
+{
+#ifdef USE_OPENSSL
+	SslSession *cache = ssl_session_find(name, port, 0);
+
+	if (cache && (cache->hits || cache->misses))
+	{
+		*hits = cache->hits;
+		*misses = cache->misses;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/*
+ * ssl_want_write: true if a pending handshake is waiting for the socket
+ * to become writable, rather than readable.
+ */
+int
+ssl_want_write(SslInfo *info)
+{
+#ifdef USE_OPENSSL
+	if (info && info->ssl)
+		return SSL_want_write(info->ssl);
+#endif
+	return 0;
+}
+
+/*
+ * ssl_pending: true if SSL has read data off the socket that has not
+ * been handed back by ssl_read() yet.
+ */
+int
+ssl_pending(SslInfo *info)
+{
+#ifdef USE_OPENSSL
+	if (info && info->ssl)
+# if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		return SSL_has_pending(info->ssl);
+# else
+		return SSL_pending(info->ssl) > 0;
+# endif
+#endif
+	return 0;
+}
+
 ssize_t
 ssl_write(SslInfo *info, int fd, const void *buf, size_t len)
 {
@@ -297,6 +547,52 @@ ssl_write(SslInfo *info, int fd, const void *buf, size_t len)
 		return write(fd, buf, len);
 }
 
+/*
+ * ssl_writev: write out several buffers in one go, returning like
+ * ssl_write(), including -2 for a write that would block.  SSL_write()
+ * has no scatter/gather version, so up to one TLS record's worth is
+ * gathered into a single buffer first.
+ */
+ssize_t
+ssl_writev(SslInfo *info, int fd, struct iovec *iov, int iovcnt)
+{
+	char	buf[16384];
+	size_t	len = 0, n;
+	ssize_t	rv;
+	int	i;
+
+#ifdef HAVE_WRITEV
+# ifdef USE_OPENSSL
+	if (!info || !info->ssl)
+# endif
+	{
+		rv = writev(fd, iov, iovcnt);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return -2;
+		return rv;
+	}
+#endif
+	if (iovcnt == 1)
+	{
+		n = iov[0].iov_len;
+		rv = ssl_write(info, fd, iov[0].iov_base, n);
+		goto out;
+	}
+	for (i = 0; i < iovcnt && len < sizeof buf; i++)
+	{
+		n = iov[i].iov_len;
+		if (n > sizeof buf - len)
+			n = sizeof buf - len;
+		memcpy(buf + len, iov[i].iov_base, n);
+		len += n;
+	}
+	rv = ssl_write(info, fd, buf, len);
+out:
+	if (rv < 0 && rv != -2 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return -2;
+	return rv;
+}
+
 ssize_t
 ssl_read(SslInfo *info, int fd, void *buf, size_t len)
 {
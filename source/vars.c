@@ -52,6 +52,7 @@ IRCII_RCSID("@(#)$eterna: vars.c,v 1.104 2014/07/11 11:36:04 mrg Exp $");
 #include "server.h"
 #include "dcc.h"
 #include "ssl.h"
+#include "newio.h"
 
 #define	VF_NODAEMON	0x0001
 #define VF_EXPAND_PATH	0x0002
@@ -153,6 +154,8 @@ static	IrcVariable irc_variable[] =
 	{ "INPUT_PROTECTION",		BOOL_TYPE_VAR,	DEFAULT_INPUT_PROTECTION,		NULL, input_warning, 0,			0, 0 },
 	{ "INSERT_MODE",		BOOL_TYPE_VAR,	DEFAULT_INSERT_MODE,			NULL, v_update_all_status, 0,		0, 0 },
 	{ "INVERSE_VIDEO",		BOOL_TYPE_VAR,	DEFAULT_INVERSE_VIDEO,			NULL, 0, NULL,				0, 0 },
+	{ "IO_BUFFER_IDLE",		INT_TYPE_VAR,	DEFAULT_IO_BUFFER_IDLE,			NULL, new_io_set_buffer_idle, 0,	0, 0 },
+	{ "IO_BUFFER_MAX",		INT_TYPE_VAR,	DEFAULT_IO_BUFFER_MAX,			NULL, new_io_set_buffer_max, 0,		0, 0 },
 	{ "IRCHOST",			STR_TYPE_VAR,	0,					NULL, 0, set_irchost,			0, 0 },
 	{ "IRC_ENCODING",		STR_TYPE_VAR,	0,					NULL, 0, set_irc_encoding,			0, 0 },
 	{ "LASTLOG",			INT_TYPE_VAR,	DEFAULT_LASTLOG,			NULL, set_lastlog_size, 0,		0, 0 },
@@ -179,6 +182,13 @@ static	IrcVariable irc_variable[] =
 	{ "SCROLL",			BOOL_TYPE_VAR,	DEFAULT_SCROLL,				NULL, set_scroll, 0,			0, 0 },
 	{ "SCROLL_LINES",		INT_TYPE_VAR,	DEFAULT_SCROLL_LINES,			NULL, set_scroll_lines, 0,		0, 0 },
 	{ "SEND_IGNORE_MSG",		BOOL_TYPE_VAR,	DEFAULT_SEND_IGNORE_MSG,		NULL, 0, NULL,				0, 0 },
+	{ "SEND_QUEUE_BURST",		INT_TYPE_VAR,	DEFAULT_SEND_QUEUE_BURST,		NULL, 0, NULL,				0, 0 },
+	{ "SEND_QUEUE_HIGH",		INT_TYPE_VAR,	DEFAULT_SEND_QUEUE_HIGH,		NULL, 0, NULL,				0, 0 },
+	{ "SEND_QUEUE_LOW",		INT_TYPE_VAR,	DEFAULT_SEND_QUEUE_LOW,			NULL, 0, NULL,				0, 0 },
+	{ "SEND_QUEUE_RATE",		INT_TYPE_VAR,	DEFAULT_SEND_QUEUE_RATE,		NULL, 0, NULL,				0, 0 },
+	{ "SERVER_DRAIN_LINES",		INT_TYPE_VAR,	DEFAULT_SERVER_DRAIN_LINES,		NULL, 0, NULL,				0, 0 },
+	{ "SERVER_DRAIN_USECONDS",	INT_TYPE_VAR,	DEFAULT_SERVER_DRAIN_USECONDS,		NULL, 0, NULL,				0, 0 },
+	{ "SERVER_PING_INTERVAL",	INT_TYPE_VAR,	DEFAULT_SERVER_PING_INTERVAL,		NULL, 0, NULL,				0, 0 },
 	{ "SHELL",			STR_TYPE_VAR,	0,					NULL, 0, NULL,				0, VF_NODAEMON },
 	{ "SHELL_FLAGS",		STR_TYPE_VAR,	0,					NULL, 0, NULL,				0, VF_NODAEMON },
 	{ "SHELL_LIMIT",		INT_TYPE_VAR,	DEFAULT_SHELL_LIMIT,			NULL, 0, NULL,				0, VF_NODAEMON },
@@ -193,6 +203,7 @@ static	IrcVariable irc_variable[] =
 	{ "SSL_CA_FILE", 		STR_TYPE_VAR,	0,					NULL, 0, ssl_setup_certs,		0, VF_NODAEMON },
 	{ "SSL_CA_PATH", 		STR_TYPE_VAR,	0,					NULL, 0, ssl_setup_certs,		0, VF_NODAEMON },
 	{ "SSL_CA_PRIVATE_KEY_FILE", 	STR_TYPE_VAR,	0,					NULL, 0, ssl_setup_certs,		0, VF_NODAEMON },
+	{ "SSL_SESSION_FILE", 		STR_TYPE_VAR,	0,					NULL, 0, NULL,				0, VF_EXPAND_PATH|VF_NODAEMON },
 	{ "STAR_PREFIX",		STR_TYPE_VAR,	0,					NULL, 0, NULL,				0, 0 },
 	{ "STATUS_AWAY",		STR_TYPE_VAR,	0,					NULL, 0, build_status,			0, 0 },
 	{ "STATUS_CHANNEL",		STR_TYPE_VAR,	0,					NULL, 0, build_status,			0, 0 },
@@ -267,6 +278,7 @@ init_variables(void)
 	set_string_var(SSL_CA_FILE_VAR, UP(DEFAULT_SSL_CA_FILE));
 	set_string_var(SSL_CA_PATH_VAR, UP(DEFAULT_SSL_CA_PATH));
 	set_string_var(SSL_CA_PRIVATE_KEY_FILE_VAR, UP(DEFAULT_SSL_CA_PRIVATE_KEY_FILE));
+	set_string_var(SSL_SESSION_FILE_VAR, UP(DEFAULT_SSL_SESSION_FILE));
 	set_string_var(STAR_PREFIX_VAR, UP(DEFAULT_STAR_PREFIX));
 	set_string_var(STATUS_FORMAT_VAR, UP(DEFAULT_STATUS_FORMAT));
 	set_string_var(STATUS_FORMAT1_VAR, UP(DEFAULT_STATUS_FORMAT1));